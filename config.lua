@@ -9,4 +9,35 @@ return {
 
     aspect_keep = true,
     scale_viewport = true,
+
+    -- Run EventIDs.FixedUpdate systems at a constant rate instead of once per frame.
+    -- fixed_tick_rate = 60,
+    -- max_fixed_steps = 5,
+
+    -- Number of job system worker threads, defaults to one per core minus the main thread.
+    -- job_workers = 4,
+
+    -- Draw the last frame's render stats in the top left corner, same as Render.overlay(true).
+    -- render_stats_overlay = true,
+
+    -- Record each frame's draw calls and submit them to the renderer after the next
+    -- frame's update. Shows everything a frame late.
+    -- pipelined_rendering = true,
+
+    -- Milliseconds per frame that Schedule.idle() tasks may use after the update.
+    -- idle_budget_ms = 2,
+
+    -- Watchdog for Lua systems, one that runs longer is stopped with a traceback in the
+    -- log. Off by default, these set a limit for every system except Init ones, 0 turns
+    -- it off again. push_system() can set budget_ms and instructions per system.
+    -- system_time_budget_ms = 250,
+    -- system_instruction_budget = 0,
+    -- "abort" stops the system for that call only, "disable" never calls it again.
+    -- system_overrun_policy = "abort",
+
+    -- Export engine and Metrics.* values in the Prometheus text format every
+    -- metrics_interval seconds, to a file and/or to clients of a UNIX socket.
+    -- metrics_file = "metrics.prom",
+    -- metrics_socket = "lovial.sock",
+    -- metrics_interval = 5,
 }
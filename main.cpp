@@ -9,6 +9,26 @@
 #include "OS/FileAccess.h"
 #include "Util/JovialFont.h"
 #include "Batteries/PhysicsPP.h"
+#include "Util/EasingFuncs.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 using namespace jovial;
 
@@ -17,9 +37,33 @@ using namespace jovial;
 PixelFont default_font;
 pp::Physics physics;
 
+// The part of the world that is on screen, anything outside of it can be skipped.
+Rect2 view_rect;
+bool view_follows_window = true; // false once the content is scaled or a script sized the view
+
 Arena static_arena;
 Arena frame_arena;
 
+// Bytes Lovial itself puts in the arenas, exported as metrics.
+struct ArenaUsage {
+    u64 static_bytes;
+    u64 frame_bytes;
+    u64 last_frame_bytes;
+};
+
+ArenaUsage arena_usage;
+
+template <typename T>
+T *static_new(T value) {
+    arena_usage.static_bytes += sizeof(T);
+    return New(static_arena, value);
+}
+
+String frame_string(StrView text) {
+    arena_usage.frame_bytes += text.size() + 1;
+    return String(frame_arena, text);
+}
+
 static bool has_errored = false;
 
 #define LOG_ERROR(...)                                          \
@@ -39,278 +83,1939 @@ static bool has_errored = false;
         return luaL_error(L, __VA_ARGS__); \
     } while(0)
 
-struct LuaSystem {
-    int func_ref = 0;
-    lua_State *L;
+// Work stealing job system. Every thread owns a Chase-Lev deque, it pushes and pops
+// from the bottom of its own deque and steals from the top of everyone else's.
+// The main thread is worker 0 and helps out while it waits on a handle.
+
+#define JOB_DEQUE_SIZE 4096 // must be a power of two
+
+struct Job;
+
+struct JobCounter {
+    std::atomic<i64> pending{0};
+    std::atomic<bool> finished{false};
+
+    std::mutex lock;
+    DArray<Job *> waiting; // jobs that were scheduled to run after this counter
+
+    Job *batch = nullptr;
 };
 
-void on_event(void *user_data, Event &event) {
-    LuaSystem *system = (LuaSystem *) user_data;
+struct Job {
+    void (*fn)(void *data, u64 begin, u64 end);
+    void *data;
+    u64 begin, end;
+    JobCounter *counter;
+};
 
-    lua_rawgeti(system->L, LUA_REGISTRYINDEX, system->func_ref);  // Get the Lua function from the registry
-    
-    lua_newtable(system->L);
-    switch (event.type) {
-        case Events::DRAW_ID: {
-            auto &draw = (Events::Draw &) event;
-            lua_pushinteger(system->L, draw.viewport.id);
-            lua_setfield(system->L, -2, "viewport");
+struct JobDeque {
+    std::atomic<i64> top{0};
+    std::atomic<i64> bottom{0};
+    std::atomic<Job *> jobs[JOB_DEQUE_SIZE];
+
+    // Only ever called by the owning thread.
+    bool push(Job *job) {
+        i64 b = bottom.load(std::memory_order_relaxed);
+        i64 t = top.load(std::memory_order_acquire);
+        if (b - t >= JOB_DEQUE_SIZE) return false;
+
+        jobs[b & (JOB_DEQUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only ever called by the owning thread.
+    Job *pop() {
+        i64 b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        i64 t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
         }
-        case Events::UPDATE_ID: {
-            auto &update = (Events::Update &) event;
-            lua_pushinteger(system->L, update.viewport.id);
-            lua_setfield(system->L, -2, "viewport");
+
+        Job *job = jobs[b & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+        if (t == b) {
+            // Last job left, race the thieves for it.
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                job = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
         }
-        default: break;
+        return job;
     }
 
-    if (lua_pcall(system->L, 1, 0, 0) != LUA_OK) {
-        LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(system->L, -1));
+    Job *steal() {
+        i64 t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        i64 b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+
+        Job *job = jobs[t & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return job;
     }
-}
 
-int lua_push_system(lua_State *L) {
-    if (!lua_isfunction(L, 2)) {
-        RETURN_ERROR(L, "Expected an int and a function as the arguments");
+    i64 depth() const {
+        return bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
     }
+};
 
-    // Get the first argument, which should be an int
-    int type = luaL_checkinteger(L, 1);
+// -1 on threads the job system doesn't own, they can't touch the owner only deques.
+thread_local int job_worker_index = -1;
 
-    // Store the Lua function in the registry and get a reference to it
-    lua_pushvalue(L, 2);  // Push the function to the top of the stack
-    int lua_func_ref = luaL_ref(L, LUA_REGISTRYINDEX);  // Get the reference to the Lua function
+struct JobSystem {
+    int worker_count = -1; // -1 means one per hardware thread minus the main thread
 
-    LuaSystem *system = New(static_arena, LuaSystem{lua_func_ref, L});
+    JobDeque *deques = nullptr;
+    std::thread *workers = nullptr;
+    int thread_count = 1;
 
-    WM::get_main_window()->get_viewport()->push_system(type, on_event, system);
+    std::atomic<bool> running{false};
+    std::mutex sleep_lock;
+    std::condition_variable wake;
 
-    return 0;  // No return value to Lua
-}
+    // Jobs pushed from threads without a deque of their own.
+    std::mutex inject_lock;
+    DArray<Job *> injected;
+    std::atomic<u64> injected_count{0};
 
-#define load_v2(L, vector, name, arg)                                                \
-    do {                                                                             \
-    lua_getfield(L, arg, name);                                                      \
-    if (lua_istable(L, -1)) {                                                        \
-        lua_getfield(L, -1, "x");                                                    \
-        vector.x = luaL_checknumber(L, -1);                                          \
-        lua_pop(L, 1);                                                               \
-                                                                                     \
-        lua_getfield(L, -1, "y");                                                    \
-        vector.y = luaL_checknumber(L, -1);                                          \
-        lua_pop(L, 1);                                                               \
-    } else {                                                                         \
-        RETURN_ERROR(L, "'" #vector "' must be a table {x: number, y: number}");\
-    }                                                                                \
-    lua_pop(L, 1);                                                                   \
-    } while(0)
+    std::atomic<u64> jobs_run{0};
+    std::atomic<u64> steals{0};
+    std::atomic<u64> idle_ns{0};
+    std::atomic<i64> max_depth{0};
 
-#define load_rect2(L, rect, arg) \
-    load_v2(L, rect.position, "position", arg); \
-    load_v2(L, rect.size, "size", arg);
+    ~JobSystem() {
+        stop();
+    }
 
-#define color_from_object(result, L)                                            \
-    if (lua_isnil(L, -1)) {                                                     \
-        /* pass */                                                              \
-    } else if (lua_istable(L, -1)) {                                            \
-        lua_getfield(L, -1, "r");                                               \
-        result.r = luaL_optnumber(L, -1, 0.0);                                  \
-        lua_pop(L, 1);                                                          \
-                                                                                \
-        lua_getfield(L, -1, "g");                                               \
-        result.g = luaL_optnumber(L, -1, 0.0);                                  \
-        lua_pop(L, 1);                                                          \
-                                                                                \
-        lua_getfield(L, -1, "b");                                               \
-        result.b = luaL_optnumber(L, -1, 0.0);                                  \
-        lua_pop(L, 1);                                                          \
-                                                                                \
-        lua_getfield(L, -1, "a");                                               \
-        result.a = luaL_optnumber(L, -1, 1.0);                                  \
-        lua_pop(L, 1);                                                          \
-                                                                                \
-        lua_pop(L, 1);                                                          \
-    } else {                                                                    \
-        RETURN_ERROR(L, "'color' must be an object: {r: 0, g: 0, b: 0, a: 0}"); \
-    } 
+    void start();
+    void stop();
+};
 
-int lua_load_texture(lua_State *L) {
-    if (!lua_isstring(L, 1)) {
-        RETURN_ERROR(L, "Expected a string (path to the texture) as the first argument");
-    }
+JobSystem jobs;
 
-    u64 size = 0;
-    const char *pointer = luaL_checklstring(L, 1, &size);
+void run_job(Job *job);
 
-    StrView path = {pointer, size};
-    TextureID id = TextureID::from_file(path);
+void push_job(Job *job) {
+    if (job_worker_index < 0) {
+        {
+            std::lock_guard<std::mutex> guard(jobs.inject_lock);
+            jobs.injected.push(halloc, job);
+            jobs.injected_count.fetch_add(1, std::memory_order_release);
+        }
+        jobs.wake.notify_one();
+        return;
+    }
 
-    lua_pushinteger(L, id.id);
+    if (!jobs.deques[job_worker_index].push(job)) {
+        // Our deque is full, doing the work right here is better than waiting for room.
+        run_job(job);
+        return;
+    }
 
-    return 1;
+    i64 depth = jobs.deques[job_worker_index].depth();
+    i64 max_depth = jobs.max_depth.load(std::memory_order_relaxed);
+    while (depth > max_depth && !jobs.max_depth.compare_exchange_weak(max_depth, depth)) {}
+
+    jobs.wake.notify_one();
 }
 
-int lua_load_shader(lua_State *L) {
-    StrView vertex, fragment;
+Job *find_job() {
+    Job *job = nullptr;
+    if (job_worker_index >= 0) {
+        job = jobs.deques[job_worker_index].pop();
+        if (job) return job;
+    }
 
-    if (lua_isnil(L, 1)) {
-        vertex = Renderer2D::vertex_shader_code();
-    } else if (lua_isstring(L, 1)) {
-        u64 size = 0;
-        const char *pointer = luaL_checklstring(L, 1, &size);
-        vertex = {pointer, size};
-    } else {
-        RETURN_ERROR(L, "Expected a string (path to the vertex shader) as the first argument");
+    if (jobs.injected_count.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<std::mutex> guard(jobs.inject_lock);
+        if (jobs.injected.size() > 0) {
+            job = jobs.injected.back();
+            jobs.injected.pop();
+            jobs.injected_count.fetch_sub(1, std::memory_order_relaxed);
+            return job;
+        }
     }
 
-    if (lua_isnil(L, 1)) {
-        fragment = Renderer2D::fragment_shader_code();
-    } else if (lua_isstring(L, 1)) {
-        u64 size = 0;
-        const char *pointer = luaL_checklstring(L, 1, &size);
-        fragment = {pointer, size};
-    } else {
-        RETURN_ERROR(L, "Expected a string (path to the fragment shader) as the second argument");
+    // Threads without a deque steal from every worker, the main thread included.
+    int self = job_worker_index < 0 ? 0 : job_worker_index;
+    for (int i = job_worker_index < 0 ? 0 : 1; i < jobs.thread_count; ++i) {
+        int victim = (self + i) % jobs.thread_count;
+        job = jobs.deques[victim].steal();
+        if (job) {
+            jobs.steals.fetch_add(1, std::memory_order_relaxed);
+            return job;
+        }
     }
+    return nullptr;
+}
 
-    Shader shader = Shader::from_path(vertex, fragment);
+void finish_job_counter(JobCounter *counter) {
+    DArray<Job *> ready;
+    {
+        std::lock_guard<std::mutex> guard(counter->lock);
+        ready = counter->waiting;
+        counter->waiting = {};
+    }
 
-    auto *r2d = Renderer2D::from(WM::get_main_window()->get_renderers()[0]);
-    r2d->add_shader(shader);
+    for (Job *job : ready) {
+        push_job(job);
+    }
+    ready.free();
 
-    lua_pushinteger(L, shader.id);
+    counter->finished.store(true, std::memory_order_release);
+}
 
-    return 1;
+void run_job(Job *job) {
+    job->fn(job->data, job->begin, job->end);
+    jobs.jobs_run.fetch_add(1, std::memory_order_relaxed);
+
+    if (job->counter->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        finish_job_counter(job->counter);
+    }
 }
 
-int lua_draw_line(lua_State *L) {
-    if (!lua_istable(L, 1)) {
-        RETURN_ERROR(L, "Expected a table {start = v2(), end = v2(), color = {}, thickness = 1.0, z_index = 0} as the first argument");
+void job_worker_main(int index) {
+    job_worker_index = index;
+
+    while (jobs.running.load(std::memory_order_acquire)) {
+        Job *job = find_job();
+        if (job) {
+            run_job(job);
+            continue;
+        }
+
+        auto idle_start = std::chrono::steady_clock::now();
+        {
+            std::unique_lock<std::mutex> guard(jobs.sleep_lock);
+            jobs.wake.wait_for(guard, std::chrono::milliseconds(1));
+        }
+        auto idle = std::chrono::steady_clock::now() - idle_start;
+        jobs.idle_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(idle).count(), std::memory_order_relaxed);
     }
+}
 
-    Line2DCmd cmd;
+void JobSystem::start() {
+    int count = worker_count;
+    if (count < 0) {
+        count = (int) std::thread::hardware_concurrency() - 1;
+    }
+    if (count < 0) count = 0;
 
-    load_v2(L, cmd.start, "start", 1);
-    load_v2(L, cmd.end, "finish", 1);
+    thread_count = count + 1;
+    deques = new JobDeque[thread_count];
+    job_worker_index = 0; // the thread that starts the job system is the main thread
+    workers = new std::thread[count];
 
-    lua_getfield(L, 1, "color");
-    color_from_object(cmd.color, L);
+    running.store(true, std::memory_order_release);
+    for (int i = 0; i < count; ++i) {
+        workers[i] = std::thread(job_worker_main, i + 1);
+    }
+}
 
-    lua_getfield(L, 1, "thickness");  
-    cmd.thickness = luaL_optnumber(L, -1, 1.0);  
-    lua_pop(L, 1);  
+void JobSystem::stop() {
+    if (!running.exchange(false)) return;
 
-    lua_getfield(L, 1, "z_index");  
-    int z_index = luaL_optnumber(L, -1, 0.0);  
-    lua_pop(L, 1);  
+    wake.notify_all();
+    for (int i = 0; i < thread_count - 1; ++i) {
+        workers[i].join();
+    }
 
-    cmd.draw(WM::get_main_window()->get_renderers()[0], z_index);
-    return 0;
+    delete[] workers;
+    delete[] deques;
+    workers = nullptr;
+    deques = nullptr;
 }
 
-int lua_draw_text(lua_State *L) {
-    if (!lua_istable(L, 1)) {
-        RETURN_ERROR(L, "Expected a table {text = 'Hello, World', position = v2(), color = {}, z_index = 0} as the first argument");
+// Splits [0, count) into chunks of at most `grain` items and runs `fn` on them across
+// the pool. If `after` is given none of the chunks start until it has finished.
+// The returned counter must be handed to wait_jobs() before it goes away.
+JobCounter *parallel_for(u64 count, u64 grain, void (*fn)(void *, u64, u64), void *data, JobCounter *after = nullptr) {
+    if (grain == 0) grain = 1;
+    u64 chunks = (count + grain - 1) / grain;
+
+    JobCounter *counter = new JobCounter;
+    if (chunks == 0) {
+        counter->finished.store(true);
+        return counter;
     }
 
-    Text2DCmd cmd;
-    cmd.bitmap_font = &default_font;
+    counter->pending.store(chunks);
+    Job *batch = new Job[chunks];
+    for (u64 i = 0; i < chunks; ++i) {
+        u64 begin = i * grain;
+        u64 end = begin + grain < count ? begin + grain : count;
+        batch[i] = {fn, data, begin, end, counter};
+    }
 
-    load_v2(L, cmd.position, "position", 1);
+    counter->batch = batch;
 
-    lua_getfield(L, 1, "text");
-    size_t len = 0;
-    const char *text = luaL_checklstring(L, -1, &len);
-    cmd.text = String(frame_arena, {text, len}).to_upper();
+    if (!jobs.running.load(std::memory_order_acquire)) {
+        for (u64 i = 0; i < chunks; ++i) run_job(&batch[i]);
+        return counter;
+    }
 
-    lua_getfield(L, 1, "color");
-    color_from_object(cmd.color, L);
+    bool deferred = false;
+    if (after) {
+        std::lock_guard<std::mutex> guard(after->lock);
+        if (after->pending.load(std::memory_order_acquire) > 0) {
+            for (u64 i = 0; i < chunks; ++i) after->waiting.push(halloc, &batch[i]);
+            deferred = true;
+        }
+    }
 
-    lua_getfield(L, 1, "z_index");  
-    int z_index = luaL_optnumber(L, -1, 0.0);  
-    lua_pop(L, 1);  
+    if (!deferred) {
+        for (u64 i = 0; i < chunks; ++i) push_job(&batch[i]);
+    }
 
-    cmd.draw(WM::get_main_window()->get_renderers()[0], z_index);
-    return 0;
+    return counter;
 }
 
-int lua_draw_rect2(lua_State *L) {
-    if (!lua_istable(L, 1)) {
-        RETURN_ERROR(L, "Expected a table {position = v2(), size = v2(), outline = 0, outline_color = {}, color = {}, z_index = 0} as the first argument");
+bool jobs_done(JobCounter *counter) {
+    return counter->finished.load(std::memory_order_acquire);
+}
+
+// Blocks until every job behind `counter` has run, running jobs itself in the meantime.
+void wait_jobs(JobCounter *counter) {
+    while (!jobs_done(counter)) {
+        Job *job = jobs.running.load(std::memory_order_acquire) ? find_job() : nullptr;
+        if (job) {
+            run_job(job);
+        } else {
+            std::this_thread::yield();
+        }
     }
+}
 
-    Rect2DCmd cmd;
+void free_jobs(JobCounter *counter) {
+    delete[] counter->batch;
+    counter->waiting.free();
+    delete counter;
+}
 
-    Rect2 rect;
-    load_rect2(L, rect, 1);
-    cmd.set(rect);
+// Hierarchical timer wheel. Time is counted in whole milliseconds, level 0 has one
+// slot per millisecond and every level above it covers 64 times the span of the one
+// below. Timers cascade down a level as their slot comes up, so advancing only
+// touches the timers that are close to firing.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_NONE 0xffffffff
+
+struct TimerNode {
+    u64 expires;
+    u32 next, prev;
+    u32 user;
+    u32 generation;
+    u8 level, slot;
+    bool active;
+};
 
-    lua_getfield(L, 1, "color");
-    color_from_object(cmd.color, L);
+// Handles pack the node's generation in the high bits so a stale handle never
+// touches a node that has since been reused.
+typedef u64 TimerHandle;
 
-    lua_getfield(L, 1, "outline_color");
-    color_from_object(cmd.outline_color, L);
+struct TimerWheel {
+    u64 now = 0;
+    u32 slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    DArray<TimerNode> nodes;
+    DArray<u32> free_nodes;
+    u64 active = 0;
 
-    lua_getfield(L, 1, "outline");  
-    cmd.outline = luaL_optnumber(L, -1, 0.0);  
-    lua_pop(L, 1);  
+    TimerWheel() {
+        for (auto &level : slots) {
+            for (u32 &slot : level) slot = TIMER_NONE;
+        }
+    }
 
-    lua_getfield(L, 1, "z_index");  
-    int z_index = luaL_optnumber(L, -1, 0.0);  
-    lua_pop(L, 1);  
+    void link(u32 index) {
+        TimerNode &node = nodes[index];
+        u64 expires = node.expires > now ? node.expires : now + 1;
+        u64 delta = expires - now;
 
-    cmd.draw(WM::get_main_window()->get_renderers()[0], z_index);
-    return 0;
-}
+        int level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1)))) {
+            level++;
+        }
 
-int lua_draw_sprite(lua_State *L) {
-    if (!lua_istable(L, 1)) {
-        RETURN_ERROR(L, "Expected a table {position = {x = 0, y = 0}, texture = 0, color = {}, scale = {x = 1, y = 1}, rotation = 0, z_index = 0} as the first argument");
+        node.level = level;
+        node.slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        node.prev = TIMER_NONE;
+        node.next = slots[level][node.slot];
+        if (node.next != TIMER_NONE) nodes[node.next].prev = index;
+        slots[level][node.slot] = index;
     }
 
-    Sprite2DCmd cmd;
+    void unlink(u32 index) {
+        TimerNode &node = nodes[index];
+        if (node.prev != TIMER_NONE) {
+            nodes[node.prev].next = node.next;
+        } else {
+            slots[node.level][node.slot] = node.next;
+        }
+        if (node.next != TIMER_NONE) nodes[node.next].prev = node.prev;
+    }
 
-    load_v2(L, cmd.position, "position", 1);
+    TimerHandle add(u64 expires, u32 user) {
+        u32 index;
+        if (free_nodes.size() > 0) {
+            index = free_nodes.back();
+            free_nodes.pop();
+        } else {
+            index = nodes.size();
+            nodes.push(halloc, {});
+        }
 
-    lua_getfield(L, 1, "texture");
-    cmd.texture.id = luaL_checkinteger(L, -1);
-    lua_pop(L, 1);
+        TimerNode &node = nodes[index];
+        node.expires = expires;
+        node.user = user;
+        node.active = true;
+        link(index);
+        active++;
 
-    lua_getfield(L, 1, "color");
-    color_from_object(cmd.color, L);
+        return ((u64) node.generation << 32) | index;
+    }
 
-    lua_getfield(L, 1, "scale");
-    if (lua_istable(L, -1)) {
-        lua_getfield(L, -1, "x");
-        cmd.scale.x = luaL_optnumber(L, -1, 1.0);  
-        lua_pop(L, 1);  
+    TimerNode *get(TimerHandle handle) {
+        u32 index = handle & 0xffffffff;
+        if (index >= nodes.size()) return nullptr;
 
-        lua_getfield(L, -1, "y");
-        cmd.scale.y = luaL_optnumber(L, -1, 1.0);  
-        lua_pop(L, 1);
-    } else {
-        cmd.scale = {1.0f, 1.0f};  
+        TimerNode &node = nodes[index];
+        if (!node.active || node.generation != (u32) (handle >> 32)) return nullptr;
+        return &node;
     }
-    lua_pop(L, 1);  
 
-    lua_getfield(L, 1, "rotation");  
-    cmd.rotation = luaL_optnumber(L, -1, 0.0);  
-    lua_pop(L, 1);
+    void release(u32 index) {
+        nodes[index].active = false;
+        nodes[index].generation++;
+        free_nodes.push(halloc, index);
+        active--;
+    }
 
-    lua_getfield(L, 1, "z_index");  
-    int z_index = luaL_optnumber(L, -1, 0);  
-    lua_pop(L, 1);  
+    bool remove(TimerHandle handle) {
+        if (!get(handle)) return false;
 
-    lua_getfield(L, 1, "shader");
-    int shader_id = luaL_optinteger(L, -1, -1);
-    lua_pop(L, 1);
+        u32 index = handle & 0xffffffff;
+        unlink(index);
+        release(index);
+        return true;
+    }
 
-    auto &renderer = WM::get_main_window()->get_renderers()[0];
-    if (shader_id != -1) {
-        JV_LOG_ENGINE(LOG_WARNING, "Shaders are not yet implemented for lua. Sorry, too lazy.");
-        // Sequence2DCmd seq;
-        //
-        // Shader2DCmd shader;
+    // Moves every timer that expires at or before `to` out of the wheel and appends
+    // their user values to `fired` in expiry order.
+    void advance(u64 to, DArray<u32> &fired) {
+        if (active == 0) {
+            now = to > now ? to : now;
+            return;
+        }
+
+        while (now < to) {
+            now++;
+
+            // Whenever a level wraps around, the next slot of the level above is due
+            // to be spread out over the levels below it.
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+                if ((now & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) != 0) break;
+
+                u32 slot = (now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+                u32 index = slots[level][slot];
+                slots[level][slot] = TIMER_NONE;
+                while (index != TIMER_NONE) {
+                    u32 next = nodes[index].next;
+                    link(index);
+                    index = next;
+                }
+            }
+
+            u32 slot = now & TIMER_WHEEL_MASK;
+            u32 index = slots[0][slot];
+            slots[0][slot] = TIMER_NONE;
+            while (index != TIMER_NONE) {
+                u32 next = nodes[index].next;
+                if (nodes[index].expires <= now) {
+                    fired.push(halloc, nodes[index].user);
+                    release(index);
+                } else {
+                    link(index); // only past the last level's reach, it goes around again
+                }
+                index = next;
+            }
+
+            if (active == 0) {
+                now = to;
+                break;
+            }
+        }
+    }
+};
+
+u64 monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+u64 seconds_to_wheel_ticks(double seconds) {
+    if (seconds <= 0.0) return 0;
+    return (u64) (seconds * 1000.0 + 0.5);
+}
+
+// How a subscription wants its events. EVENT_POLICY_ALL calls Lua for every event,
+// the other two collect a frame's worth and call once before the next update.
+enum EventPolicy {
+    EVENT_POLICY_ALL,
+    EVENT_POLICY_COALESCE,  // only the latest event counts
+    EVENT_POLICY_AGGREGATE, // every event counts, mouse movement is summed into a delta
+};
+
+struct LuaSystem {
+    int func_ref = 0;
+    lua_State *L;
+
+    int policy = EVENT_POLICY_ALL;
+    int action = -1; // key or button events only pass for this action, -1 for any
+    u32 pending = 0; // events collected for a coalescing policy this frame
+    int last_type = 0;
+
+    int type = 0;
+    u64 budget_ns = 0;          // 0 for no time limit
+    u64 instruction_budget = 0; // 0 for no instruction limit
+    bool disabled = false;
+
+    // Read back with Profiler.systems().
+    u64 calls = 0;
+    u64 slow = 0;     // calls that used more than half of the time budget
+    u64 overruns = 0; // calls the watchdog aborted
+    u64 total_ns = 0;
+    u64 max_ns = 0;
+};
+
+// Watchdog for Lua systems. A count hook checks the running system every
+// WATCHDOG_HOOK_INSTRUCTIONS instructions, one that goes over its time or instruction
+// budget gets its traceback logged and is aborted with an error. With the "disable"
+// overrun policy it's also never called again. The hook is only installed once a
+// system has a budget, there are none by default.
+
+#define WATCHDOG_HOOK_INSTRUCTIONS 10000
+
+enum WatchdogPolicy {
+    WATCHDOG_ABORT,
+    WATCHDOG_DISABLE,
+};
+
+struct Watchdog {
+    // Defaults for systems that don't set their own budget in push_system(). Init systems
+    // never get these, stopping one halfway would leave the game half loaded.
+    double time_budget_ms = 0.0;
+    u64 instruction_budget = 0;
+    int policy = WATCHDOG_ABORT;
+
+    LuaSystem *running = nullptr;
+    u64 deadline_ns = 0;
+    u64 instructions = 0; // counted in hook steps
+    bool tripped = false;
+
+    DArray<LuaSystem *> systems;
+};
+
+Watchdog watchdog;
+
+void watchdog_hook(lua_State *L, lua_Debug *) {
+    LuaSystem *system = watchdog.running;
+    if (!system) return;
+
+    watchdog.instructions += WATCHDOG_HOOK_INSTRUCTIONS;
+    bool over_time = system->budget_ns && monotonic_ns() >= watchdog.deadline_ns;
+    bool over_count = system->instruction_budget && watchdog.instructions >= system->instruction_budget;
+    if (!over_time && !over_count) return;
+
+    if (!watchdog.tripped) {
+        watchdog.tripped = true;
+        system->overruns++;
+        if (watchdog.policy == WATCHDOG_DISABLE) system->disabled = true;
+
+        luaL_traceback(L, L, over_time ? "system ran over its time budget" : "system ran over its instruction budget", 0);
+        LOG_ERROR("ERROR: watchdog % a system for event %: %", system->disabled ? "disabled" : "stopped",
+                  system->type, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    // Raised again on every check so a pcall inside the runaway code can't swallow it.
+    luaL_error(L, "system stopped by the watchdog");
+}
+
+// Threads made later copy the hook, the watchdog only acts while a system runs.
+void arm_watchdog(lua_State *L) {
+    if (lua_gethook(L) != watchdog_hook) {
+        lua_sethook(L, watchdog_hook, LUA_MASKCOUNT, WATCHDOG_HOOK_INSTRUCTIONS);
+    }
+}
+
+// Calls a system's function, already pushed with its nargs arguments, under the watchdog.
+void call_lua_system(LuaSystem *system, int nargs) {
+    lua_State *L = system->L;
+    if (system->disabled) {
+        lua_pop(L, nargs + 1);
+        return;
+    }
+
+    // Systems can run inside other systems, e.g. through a nested event dispatch.
+    LuaSystem *outer = watchdog.running;
+    u64 outer_deadline = watchdog.deadline_ns;
+    u64 outer_instructions = watchdog.instructions;
+    bool outer_tripped = watchdog.tripped;
+
+    u64 start = monotonic_ns();
+    watchdog.running = system;
+    watchdog.deadline_ns = start + system->budget_ns;
+    watchdog.instructions = 0;
+    watchdog.tripped = false;
+
+    if (lua_pcall(L, nargs, 0, 0) != LUA_OK) {
+        if (!watchdog.tripped) {
+            LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(L, -1));
+        }
+        lua_pop(L, 1);
+    }
+
+    u64 elapsed = monotonic_ns() - start;
+    system->calls++;
+    system->total_ns += elapsed;
+    if (elapsed > system->max_ns) system->max_ns = elapsed;
+    if (system->budget_ns && elapsed * 2 > system->budget_ns) system->slow++;
+
+    watchdog.running = outer;
+    watchdog.deadline_ns = outer_deadline;
+    watchdog.instructions = outer_instructions;
+    watchdog.tripped = outer_tripped;
+}
+
+// Per event type dispatch counts, read back with Profiler.events().
+struct EventCounts {
+    u64 seen;       // reached a Lovial subscription
+    u64 dispatched; // turned into a Lua call
+    u64 filtered;   // dropped by an action filter
+    u64 coalesced;  // folded into a later call by a policy
+};
+
+DArray<EventCounts> event_counts;
+
+EventCounts &count_event(int type) {
+    u64 index = type < 0 ? 0 : type;
+    if (index >= event_counts.size()) {
+        u64 old_size = event_counts.size();
+        event_counts.resize(halloc, index + 1);
+        for (u64 i = old_size; i <= index; ++i) event_counts[i] = {};
+    }
+    return event_counts[index];
+}
+
+DArray<LuaSystem *> coalescing_systems; // ones holding events for the next flush
+
+const Actions mouse_button_actions[] = {
+    Actions::LeftMouseButton, Actions::RightMouseButton, Actions::MiddleMouseButton,
+    Actions::MouseButtonX1, Actions::MouseButtonX2, Actions::MouseButtonX3, Actions::MouseButtonX4, Actions::MouseButtonX5,
+};
+
+// Jovial's mouse button events don't carry the button, Input's state for this frame
+// says which one went down or up. -1 if none did.
+int event_mouse_button(const Event &event, int wanted = -1) {
+    bool pressed = event.type == Events::MOUSE_BUTTON_PRESSED_ID;
+    for (Actions button : mouse_button_actions) {
+        if (wanted >= 0 && (int) button != wanted) continue;
+        if (pressed ? Input::is_just_pressed(button) : Input::is_just_released(button)) return (int) button;
+    }
+    return -1;
+}
+
+bool event_matches_action(const Event &event, int action) {
+    switch (event.type) {
+    case Events::KEY_PRESSED_ID: return (int) ((const Events::KeyPressed &) event).keycode == action;
+    case Events::KEY_RELEASED_ID: return (int) ((const Events::KeyReleased &) event).keycode == action;
+    case Events::MOUSE_BUTTON_PRESSED_ID:
+    case Events::MOUSE_BUTTON_RELEASED_ID: return event_mouse_button(event, action) >= 0;
+    default: return true;
+    }
+}
+
+// Events that Lovial dispatches itself. Jovial never sends these so the systems
+// listening for them are kept on our side instead of on the viewport.
+enum LovialEvents {
+    FIXED_UPDATE_ID = Events::FIRST_CUSTOM_ID,
+
+    LOVIAL_FIRST_CUSTOM_ID = Events::FIRST_CUSTOM_ID + 32,
+};
+
+struct FixedStep {
+    bool enabled = false;
+    double step = 1.0 / 60.0;
+    int max_steps = 5;
+
+    double accumulator = 0.0;
+    double alpha = 1.0;
+
+    u64 tick = 0;
+    u64 dropped = 0; // ticks thrown away because a frame needed more than max_steps
+    u64 behind = 0;  // times it started falling behind, logged once each
+    bool falling_behind = false;
+    u64 merged = 0;  // ticks that had to run back to back inside a single frame
+
+    DArray<LuaSystem *> systems;
+
+    // Called after every tick, wait_event(Events.FixedUpdate) resumes its coroutines here.
+    void (*on_tick)(void *data) = nullptr;
+    void *on_tick_data = nullptr;
+};
+
+FixedStep fixed_step;
+
+void on_event(void *user_data, Event &event) {
+    LuaSystem *system = (LuaSystem *) user_data;
+    EventCounts &counts = count_event(event.type);
+    counts.seen++;
+
+    if (system->action >= 0 && !event_matches_action(event, system->action)) {
+        counts.filtered++;
+        return;
+    }
+
+    if (system->policy != EVENT_POLICY_ALL) {
+        if (system->pending++ == 0) {
+            coalescing_systems.push(halloc, system);
+        } else {
+            count_event(system->last_type).coalesced++;
+        }
+        system->last_type = event.type;
+        return;
+    }
+
+    counts.dispatched++;
+    lua_rawgeti(system->L, LUA_REGISTRYINDEX, system->func_ref);  // Get the Lua function from the registry
+    
+    lua_newtable(system->L);
+    switch (event.type) {
+        case Events::DRAW_ID: {
+            auto &draw = (Events::Draw &) event;
+            lua_pushinteger(system->L, draw.viewport.id);
+            lua_setfield(system->L, -2, "viewport");
+        }
+        case Events::UPDATE_ID: {
+            auto &update = (Events::Update &) event;
+            lua_pushinteger(system->L, update.viewport.id);
+            lua_setfield(system->L, -2, "viewport");
+        }
+        default: break;
+    }
+
+    call_lua_system(system, 1);
+}
+
+// Calls every coalescing subscription that collected events with {type, count} and
+// the mouse position, aggregating ones also get the frame's mouse delta.
+void flush_coalesced_events(Events::PreUpdate &) {
+    for (LuaSystem *system : coalescing_systems) {
+        lua_State *L = system->L;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, system->func_ref);
+
+        lua_newtable(L);
+        lua_pushinteger(L, system->last_type); lua_setfield(L, -2, "type");
+        lua_pushinteger(L, system->pending); lua_setfield(L, -2, "count");
+
+        Vector2 position = Input::get_mouse_position();
+        lua_newtable(L);
+        lua_pushnumber(L, position.x); lua_setfield(L, -2, "x");
+        lua_pushnumber(L, position.y); lua_setfield(L, -2, "y");
+        lua_setfield(L, -2, "position");
+
+        if (system->policy == EVENT_POLICY_AGGREGATE) {
+            Vector2 delta = Input::get_mouse_delta();
+            lua_newtable(L);
+            lua_pushnumber(L, delta.x); lua_setfield(L, -2, "x");
+            lua_pushnumber(L, delta.y); lua_setfield(L, -2, "y");
+            lua_setfield(L, -2, "delta");
+        }
+
+        system->pending = 0;
+        count_event(system->last_type).dispatched++;
+        call_lua_system(system, 1);
+    }
+    coalescing_systems.resize(halloc, 0);
+}
+
+void call_fixed_system(LuaSystem *system, double delta) {
+    lua_rawgeti(system->L, LUA_REGISTRYINDEX, system->func_ref);
+
+    lua_newtable(system->L);
+    lua_pushinteger(system->L, fixed_step.tick);
+    lua_setfield(system->L, -2, "tick");
+    lua_pushnumber(system->L, delta);
+    lua_setfield(system->L, -2, "delta");
+
+    call_lua_system(system, 1);
+}
+
+void run_fixed_update(Events::PreUpdate &) {
+    if (!fixed_step.enabled) {
+        // Without a tick rate in the config FixedUpdate is just another Update.
+        fixed_step.tick++;
+        for (LuaSystem *system : fixed_step.systems) {
+            call_fixed_system(system, Time::delta());
+        }
+        if (fixed_step.on_tick) fixed_step.on_tick(fixed_step.on_tick_data);
+        return;
+    }
+
+    fixed_step.accumulator += Time::delta();
+
+    int steps = (int) (fixed_step.accumulator / fixed_step.step);
+    if (steps > fixed_step.max_steps) {
+        // Running every owed tick would make this frame even slower and the next one
+        // would owe more, so drop the excess instead of spiralling.
+        int dropped = steps - fixed_step.max_steps;
+        fixed_step.dropped += dropped;
+        fixed_step.accumulator -= dropped * fixed_step.step;
+        steps = fixed_step.max_steps;
+
+        // Logged once per slow stretch, Time.fixed_stats() has the running counts.
+        if (!fixed_step.falling_behind) {
+            fixed_step.falling_behind = true;
+            fixed_step.behind++;
+            JV_LOG_ENGINE(LOG_WARNING, "Fixed update fell behind, dropping ticks");
+        }
+    } else {
+        fixed_step.falling_behind = false;
+    }
+
+    if (steps > 1) {
+        fixed_step.merged += steps - 1;
+    }
+
+    for (int i = 0; i < steps; ++i) {
+        fixed_step.tick++;
+        for (LuaSystem *system : fixed_step.systems) {
+            call_fixed_system(system, fixed_step.step);
+        }
+        if (fixed_step.on_tick) fixed_step.on_tick(fixed_step.on_tick_data);
+        fixed_step.accumulator -= fixed_step.step;
+    }
+
+    fixed_step.alpha = fixed_step.accumulator / fixed_step.step;
+}
+
+// Custom events. emit() packs its arguments into a fixed layout entry of a ring buffer,
+// once per frame after the update systems everything emitted so far is delivered in
+// one pass. Lua subscribers all get the same accessor userdata pointed at the event
+// being delivered, so delivery builds no tables. Native code subscribes with
+// subscribe_event(). Events emitted while delivering go out with the next pass.
+
+#define EVENT_RING_SIZE 4096
+#define EVENT_MAX_VALUES 6
+#define EVENT_ACCESSOR_META "Lovial.Event"
+
+enum EventValueType : u8 {
+    EVENT_NIL,
+    EVENT_BOOLEAN,
+    EVENT_INTEGER,
+    EVENT_NUMBER,
+    EVENT_STRING,
+};
+
+struct EventValue {
+    EventValueType type;
+    union {
+        bool boolean;
+        i64 integer;
+        double number;
+        struct {
+            u32 offset, length; // into the bus' string pool
+        } string;
+    };
+};
+
+struct EmittedEvent {
+    int id;
+    u32 count;
+    EventValue values[EVENT_MAX_VALUES];
+};
+
+typedef void (*EventSubscriberFn)(const EmittedEvent &event, void *data);
+
+struct NativeSubscriber {
+    EventSubscriberFn fn;
+    void *data;
+};
+
+struct EventChannel {
+    int id;
+    DArray<LuaSystem *> lua;
+    DArray<NativeSubscriber> native;
+};
+
+struct EventBus {
+    EmittedEvent ring[EVENT_RING_SIZE];
+    u32 head, tail; // free running, masked on access
+
+    // Strings of the events being delivered live in strings[pool], ones emitted while
+    // delivering go to the other pool which takes over after the pass.
+    DArray<char> strings[2];
+    u32 pool;
+    bool delivering;
+
+    DArray<EventChannel *> channels;
+    u64 emitted, delivered, dropped;
+
+    int accessor_ref = LUA_NOREF;
+    const EmittedEvent *current;
+};
+
+EventBus event_bus;
+
+EventChannel *find_event_channel(int id, bool create) {
+    for (EventChannel *channel : event_bus.channels) {
+        if (channel->id == id) return channel;
+    }
+    if (!create) return nullptr;
+
+    EventChannel *channel = static_new(EventChannel{id, {}, {}});
+    event_bus.channels.push(halloc, channel);
+    return channel;
+}
+
+void subscribe_event(int id, EventSubscriberFn fn, void *data) {
+    find_event_channel(id, true)->native.push(halloc, {fn, data});
+}
+
+// Strings of the event currently being delivered, only valid during delivery.
+const char *event_string(const EventValue &value, u64 *length) {
+    *length = value.string.length;
+    return value.string.length ? &event_bus.strings[event_bus.pool][value.string.offset] : "";
+}
+
+// emit(event_id, ...) with up to EVENT_MAX_VALUES nils, booleans, numbers or strings
+int lua_emit(lua_State *L) {
+    int id = luaL_checkinteger(L, 1);
+    if (id < LOVIAL_FIRST_CUSTOM_ID) {
+        RETURN_ERROR(L, "emit() only takes ids from EventIDs.FirstCustom on");
+    }
+
+    int count = lua_gettop(L) - 1;
+    luaL_argcheck(L, count <= EVENT_MAX_VALUES, EVENT_MAX_VALUES + 2, "too many event values");
+
+    if (event_bus.tail - event_bus.head >= EVENT_RING_SIZE) {
+        if (event_bus.dropped++ == 0) JV_LOG_ENGINE(LOG_WARNING, "Event ring is full, dropping events");
+        return 0;
+    }
+
+    EmittedEvent &event = event_bus.ring[event_bus.tail & (EVENT_RING_SIZE - 1)];
+    event.id = id;
+    event.count = count;
+
+    DArray<char> &strings = event_bus.strings[event_bus.delivering ? event_bus.pool ^ 1 : event_bus.pool];
+    for (int i = 0; i < count; ++i) {
+        EventValue &value = event.values[i];
+        int arg = i + 2;
+
+        switch (lua_type(L, arg)) {
+        case LUA_TNIL:
+            value.type = EVENT_NIL;
+            break;
+        case LUA_TBOOLEAN:
+            value.type = EVENT_BOOLEAN;
+            value.boolean = lua_toboolean(L, arg);
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, arg)) {
+                value.type = EVENT_INTEGER;
+                value.integer = lua_tointeger(L, arg);
+            } else {
+                value.type = EVENT_NUMBER;
+                value.number = lua_tonumber(L, arg);
+            }
+            break;
+        case LUA_TSTRING: {
+            size_t length;
+            const char *string = lua_tolstring(L, arg, &length);
+
+            value.type = EVENT_STRING;
+            value.string.offset = strings.size();
+            value.string.length = length;
+            strings.resize(halloc, strings.size() + length);
+            if (length) memcpy(&strings[value.string.offset], string, length);
+        } break;
+        default:
+            return luaL_argerror(L, arg, "events carry nil, booleans, numbers and strings only");
+        }
+    }
+
+    event_bus.tail++;
+    event_bus.emitted++;
+    return 0;
+}
+
+void push_event_value(lua_State *L, const EventValue &value) {
+    switch (value.type) {
+    case EVENT_NIL: lua_pushnil(L); break;
+    case EVENT_BOOLEAN: lua_pushboolean(L, value.boolean); break;
+    case EVENT_INTEGER: lua_pushinteger(L, value.integer); break;
+    case EVENT_NUMBER: lua_pushnumber(L, value.number); break;
+    case EVENT_STRING: {
+        u64 length;
+        const char *string = event_string(value, &length);
+        lua_pushlstring(L, string, length);
+    } break;
+    }
+}
+
+// event[i] is the i-th emitted value, event.id the event id, #event the value count.
+// The accessor is reused for every event, it is only valid inside the subscriber.
+int lua_event_index(lua_State *L) {
+    const EmittedEvent *event = event_bus.current;
+    if (!event) {
+        RETURN_ERROR(L, "Events can only be read while they are being delivered");
+    }
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer i = lua_tointeger(L, 2);
+        if (i >= 1 && i <= (lua_Integer) event->count) {
+            push_event_value(L, event->values[i - 1]);
+        } else {
+            lua_pushnil(L);
+        }
+        return 1;
+    }
+
+    const char *key = lua_tostring(L, 2);
+    if (key && strcmp(key, "id") == 0) {
+        lua_pushinteger(L, event->id);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+int lua_event_len(lua_State *L) {
+    lua_pushinteger(L, event_bus.current ? event_bus.current->count : 0);
+    return 1;
+}
+
+void deliver_events(Events::PostUpdate &) {
+    if (event_bus.head == event_bus.tail) return;
+
+    event_bus.delivering = true;
+
+    u32 end = event_bus.tail;
+    for (; event_bus.head != end; event_bus.head++) {
+        const EmittedEvent &event = event_bus.ring[event_bus.head & (EVENT_RING_SIZE - 1)];
+        EventChannel *channel = find_event_channel(event.id, false);
+        EventCounts &counts = count_event(event.id);
+        counts.seen++;
+        if (!channel) continue;
+
+        event_bus.current = &event;
+        event_bus.delivered++;
+
+        for (const NativeSubscriber &subscriber : channel->native) {
+            subscriber.fn(event, subscriber.data);
+        }
+
+        counts.dispatched += channel->lua.size();
+        for (LuaSystem *system : channel->lua) {
+            lua_State *L = system->L;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, system->func_ref);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, event_bus.accessor_ref);
+            call_lua_system(system, 1);
+        }
+    }
+
+    event_bus.current = nullptr;
+    event_bus.delivering = false;
+    event_bus.strings[event_bus.pool].resize(halloc, 0);
+    event_bus.pool ^= 1;
+}
+
+void bind_events_to_lua(lua_State *L) {
+    luaL_newmetatable(L, EVENT_ACCESSOR_META);
+    lua_pushcfunction(L, lua_event_index); lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_event_len); lua_setfield(L, -2, "__len");
+    lua_pop(L, 1);
+
+    lua_newuserdatauv(L, 0, 0);
+    luaL_setmetatable(L, EVENT_ACCESSOR_META);
+    event_bus.accessor_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_pushcfunction(L, lua_emit);
+    lua_setglobal(L, "emit");
+}
+
+int lua_push_system(lua_State *L) {
+    if (!lua_isfunction(L, 2)) {
+        RETURN_ERROR(L, "Expected an int and a function as the arguments");
+    }
+
+    // Get the first argument, which should be an int
+    int type = luaL_checkinteger(L, 1);
+
+    // push_system(type, fn, {policy = EventPolicy.Coalesce, action = Actions.Space,
+    //                        budget_ms = 5, instructions = 1000000})
+    // Read before anything is registered, so a bad option leaves nothing behind.
+    int policy = EVENT_POLICY_ALL;
+    int action = -1;
+    bool init = type == Events::INIT_ID;
+    double default_budget_ms = init ? 0.0 : watchdog.time_budget_ms;
+    u64 default_instructions = init ? 0 : watchdog.instruction_budget;
+    u64 budget_ns = (u64) (default_budget_ms * 1e6);
+    u64 instruction_budget = default_instructions;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "policy");
+        policy = luaL_optinteger(L, -1, EVENT_POLICY_ALL);
+        lua_getfield(L, 3, "action");
+        action = luaL_optinteger(L, -1, -1);
+        lua_getfield(L, 3, "budget_ms");
+        budget_ns = (u64) (luaL_optnumber(L, -1, default_budget_ms) * 1e6);
+        lua_getfield(L, 3, "instructions");
+        instruction_budget = luaL_optinteger(L, -1, default_instructions);
+        lua_pop(L, 4);
+
+        if (policy < EVENT_POLICY_ALL || policy > EVENT_POLICY_AGGREGATE) {
+            RETURN_ERROR(L, "'policy' must be one of EventPolicy.All, EventPolicy.Coalesce or EventPolicy.Aggregate");
+        }
+    }
+
+    // Store the Lua function in the registry and get a reference to it
+    lua_pushvalue(L, 2);  // Push the function to the top of the stack
+    int lua_func_ref = luaL_ref(L, LUA_REGISTRYINDEX);  // Get the reference to the Lua function
+
+    LuaSystem *system = static_new(LuaSystem{lua_func_ref, L});
+    system->type = type;
+    system->policy = policy;
+    system->action = action;
+    system->budget_ns = budget_ns;
+    system->instruction_budget = instruction_budget;
+    watchdog.systems.push(halloc, system);
+    if (budget_ns || instruction_budget) arm_watchdog(L);
+
+    if (type == FIXED_UPDATE_ID) {
+        fixed_step.systems.push(halloc, system);
+        return 0;
+    }
+
+    if (type >= LOVIAL_FIRST_CUSTOM_ID) {
+        find_event_channel(type, true)->lua.push(halloc, system);
+        return 0;
+    }
+
+    WM::get_main_window()->get_viewport()->push_system(type, on_event, system);
+
+    return 0;  // No return value to Lua
+}
+
+#define load_v2(L, vector, name, arg)                                                \
+    do {                                                                             \
+    lua_getfield(L, arg, name);                                                      \
+    if (lua_istable(L, -1)) {                                                        \
+        lua_getfield(L, -1, "x");                                                    \
+        vector.x = luaL_checknumber(L, -1);                                          \
+        lua_pop(L, 1);                                                               \
+                                                                                     \
+        lua_getfield(L, -1, "y");                                                    \
+        vector.y = luaL_checknumber(L, -1);                                          \
+        lua_pop(L, 1);                                                               \
+    } else {                                                                         \
+        RETURN_ERROR(L, "'" #vector "' must be a table {x: number, y: number}");\
+    }                                                                                \
+    lua_pop(L, 1);                                                                   \
+    } while(0)
+
+#define load_rect2(L, rect, arg) \
+    load_v2(L, rect.position, "position", arg); \
+    load_v2(L, rect.size, "size", arg);
+
+#define color_from_object(result, L)                                            \
+    if (lua_isnil(L, -1)) {                                                     \
+        /* pass */                                                              \
+    } else if (lua_istable(L, -1)) {                                            \
+        lua_getfield(L, -1, "r");                                               \
+        result.r = luaL_optnumber(L, -1, 0.0);                                  \
+        lua_pop(L, 1);                                                          \
+                                                                                \
+        lua_getfield(L, -1, "g");                                               \
+        result.g = luaL_optnumber(L, -1, 0.0);                                  \
+        lua_pop(L, 1);                                                          \
+                                                                                \
+        lua_getfield(L, -1, "b");                                               \
+        result.b = luaL_optnumber(L, -1, 0.0);                                  \
+        lua_pop(L, 1);                                                          \
+                                                                                \
+        lua_getfield(L, -1, "a");                                               \
+        result.a = luaL_optnumber(L, -1, 1.0);                                  \
+        lua_pop(L, 1);                                                          \
+                                                                                \
+        lua_pop(L, 1);                                                          \
+    } else {                                                                    \
+        RETURN_ERROR(L, "'color' must be an object: {r: 0, g: 0, b: 0, a: 0}"); \
+    } 
+
+// Everything that reaches the renderer goes through submit_cmd so it can be counted,
+// and bounds that miss the view rect are rejected before that. view_rect starts out as
+// the content scaled resolution when content scaling is on and follows the window size
+// otherwise, games that scroll move it with Render.set_view().
+
+struct ZIndexCount {
+    int z_index;
+    u32 submitted;
+};
+
+// Counted on the binding side of Renderer2D. Batches and texture switches follow
+// submission order, the renderer may merge more once it sorts by z_index, so these
+// are upper bounds. Untextured commands count as texture -1.
+struct RenderStats {
+    u32 submitted;
+    u32 culled;
+    u32 vertices;
+    u32 batches;
+    u32 texture_switches;
+    int last_texture;
+    int last_z_index;
+    DArray<ZIndexCount> by_z_index;
+};
+
+RenderStats render_stats;      // the frame being drawn
+RenderStats last_render_stats; // the last complete frame
+
+// Textures by Jovial id. load_texture() loads every path once, loading it again hands
+// out the same id, and keeps the estimated RGBA8 size of what it loaded for culling,
+// Render.textures() and the metrics export. Jovial has no way to unload a texture, so
+// nothing here frees one and the total only grows.
+
+struct TexturePath {
+    const char *path; // in static_arena, a texture is never unloaded
+    u64 hash;
+    TextureID id;
+};
+
+struct TextureTable {
+    DArray<Vector2> sizes; // by texture id, zero when the file type isn't known
+    u64 bytes = 0;
+
+    // Open addressed and kept at most half full, a used slot holds its index in paths + 1.
+    DArray<TexturePath> paths;
+    DArray<u32> slots;
+
+    u64 shared = 0; // load_texture() calls answered with a texture that was already loaded
+};
+
+TextureTable textures;
+
+u64 hash_path(const char *path, u64 length) {
+    u64 hash = 14695981039346656037ull; // FNV-1a
+    for (u64 i = 0; i < length; ++i) {
+        hash = (hash ^ (u8) path[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// The slot holding `path`, or the empty one it would go in.
+u32 *find_texture_slot(const char *path, u64 hash) {
+    u64 mask = textures.slots.size() - 1;
+    for (u64 i = hash & mask;; i = (i + 1) & mask) {
+        u32 *slot = &textures.slots[i];
+        if (*slot == 0) return slot;
+
+        const TexturePath &entry = textures.paths[*slot - 1];
+        if (entry.hash == hash && strcmp(entry.path, path) == 0) return slot;
+    }
+}
+
+void grow_texture_slots() {
+    u64 size = textures.slots.size() ? textures.slots.size() * 2 : 64;
+    textures.slots.resize(halloc, size);
+    for (u64 i = 0; i < size; ++i) textures.slots[i] = 0;
+
+    for (u64 i = 0; i < textures.paths.size(); ++i) {
+        *find_texture_slot(textures.paths[i].path, textures.paths[i].hash) = i + 1;
+    }
+}
+
+// Command lists are flat record streams of submitted commands: kind, z_index, a fixed
+// layout record and for text the bytes after it. Frame captures write one to disk,
+// pipelined rendering fills one every frame and submits it during the next.
+//
+// Render.capture() arms a capture, the next frame's submissions are then recorded and
+// written out when that frame is done. Texture ids are stored as they are, a capture
+// replays within a run that loaded the same textures in the same order.
+
+#define CAPTURE_MAGIC 0x5043564c // "LVCP"
+#define CAPTURE_VERSION 1
+
+enum CapturedKind : u8 {
+    CAPTURED_RECT,
+    CAPTURED_SPRITE,
+    CAPTURED_LINE,
+    CAPTURED_TEXT,
+};
+
+struct CaptureHeader {
+    u32 magic;
+    u32 version;
+    u32 count;
+};
+
+struct CapturedRect {
+    Rect2 rect;
+    Color color;
+    float outline;
+    Color outline_color;
+};
+
+struct CapturedSprite {
+    int texture;
+    Vector2 position, scale;
+    float rotation;
+    Color color;
+    Rect2 region;
+};
+
+struct CapturedLine {
+    Vector2 start, end;
+    float thickness;
+    Color color;
+};
+
+struct CapturedText {
+    Vector2 position;
+    Color color;
+    u32 length; // followed by the text itself
+};
+
+struct CommandList {
+    DArray<u8> bytes;
+    u32 count;
+};
+
+void list_bytes(CommandList &list, const void *data, u64 size) {
+    u64 at = list.bytes.size();
+    list.bytes.resize(halloc, at + size);
+    memcpy(&list.bytes[at], data, size);
+}
+
+template <typename T>
+void list_record(CommandList &list, CapturedKind kind, int z_index, const T &record) {
+    i32 z = z_index;
+    list_bytes(list, &kind, sizeof(kind));
+    list_bytes(list, &z, sizeof(z));
+    list_bytes(list, &record, sizeof(record));
+    list.count++;
+}
+
+void clear_list(CommandList &list) {
+    list.bytes.resize(halloc, 0);
+    list.count = 0;
+}
+
+struct FrameCapture {
+    bool armed;
+    bool recording;
+    char path[512];
+    CommandList commands;
+};
+
+FrameCapture capture;
+
+// Pipelined rendering. Draw calls of frame N only record into one of two lists, the
+// list of frame N-1 is submitted to the renderer once frame N's update is done, so
+// everything shows up one frame late. Submission stays on the main thread: the draw
+// functions of the renderer may touch the GL context, which only that thread owns.
+struct RenderPipeline {
+    bool enabled;
+    CommandList lists[2];
+    u32 recording; // the list this frame's draw calls go into
+
+    std::chrono::steady_clock::time_point recorded_at[2];
+    double submit_seconds;  // time spent submitting, last frame
+    double latency_seconds; // from a frame starting to record to its commands all being submitted
+};
+
+RenderPipeline pipeline;
+
+void write_capture() {
+    FILE *file = fopen(capture.path, "wb");
+    if (!file) {
+        LOG_ERROR("ERROR: could not write frame capture to %\n", capture.path);
+        return;
+    }
+
+    CaptureHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION, capture.commands.count};
+    fwrite(&header, sizeof(header), 1, file);
+    if (capture.commands.bytes.size() > 0) fwrite(&capture.commands.bytes[0], 1, capture.commands.bytes.size(), file);
+    fclose(file);
+
+    JV_LOG_ENGINE(LOG_INFO, "Captured % commands to %", capture.commands.count, capture.path);
+}
+
+void count_submission(int z_index, u32 vertices, int texture) {
+    RenderStats &stats = render_stats;
+    stats.submitted++;
+    stats.vertices += vertices;
+
+    if (stats.submitted == 1 || texture != stats.last_texture || z_index != stats.last_z_index) {
+        stats.batches++;
+        if (stats.submitted > 1 && texture != stats.last_texture) stats.texture_switches++;
+        stats.last_texture = texture;
+        stats.last_z_index = z_index;
+    }
+
+    // Games use a handful of z levels, a linear search beats a map here.
+    ZIndexCount *count = nullptr;
+    for (ZIndexCount &entry : stats.by_z_index) {
+        if (entry.z_index == z_index) {
+            count = &entry;
+            break;
+        }
+    }
+    if (count) {
+        count->submitted++;
+    } else {
+        stats.by_z_index.push(halloc, {z_index, 1});
+    }
+}
+
+// Rect commands can't be read back, so the rect they were set from comes along.
+void submit_cmd(Rect2DCmd &cmd, const Rect2 &rect, int z_index) {
+    CapturedRect record = {rect, cmd.color, cmd.outline, cmd.outline_color};
+    if (capture.recording) list_record(capture.commands, CAPTURED_RECT, z_index, record);
+    count_submission(z_index, cmd.outline > 0.0f ? 20 : 4, -1);
+
+    if (pipeline.enabled) {
+        list_record(pipeline.lists[pipeline.recording], CAPTURED_RECT, z_index, record);
+    } else {
+        cmd.draw(WM::get_main_window()->get_renderers()[0], z_index);
+    }
+}
+
+void submit_cmd(Sprite2DCmd &cmd, int z_index) {
+    CapturedSprite record = {cmd.texture.id, cmd.position, cmd.scale, cmd.rotation, cmd.color, cmd.region};
+    if (capture.recording) list_record(capture.commands, CAPTURED_SPRITE, z_index, record);
+    count_submission(z_index, 4, cmd.texture.id);
+
+    if (pipeline.enabled) {
+        list_record(pipeline.lists[pipeline.recording], CAPTURED_SPRITE, z_index, record);
+    } else {
+        cmd.draw(WM::get_main_window()->get_renderers()[0], z_index);
+    }
+}
+
+void submit_cmd(Line2DCmd &cmd, int z_index) {
+    CapturedLine record = {cmd.start, cmd.end, cmd.thickness, cmd.color};
+    if (capture.recording) list_record(capture.commands, CAPTURED_LINE, z_index, record);
+    count_submission(z_index, 4, -1);
+
+    if (pipeline.enabled) {
+        list_record(pipeline.lists[pipeline.recording], CAPTURED_LINE, z_index, record);
+    } else {
+        cmd.draw(WM::get_main_window()->get_renderers()[0], z_index);
+    }
+}
+
+// `text` is what the command was made from, before the font's upper casing.
+void submit_cmd(Text2DCmd &cmd, const char *text, u64 length, int z_index) {
+    CapturedText record = {cmd.position, cmd.color, (u32) length};
+    if (capture.recording) {
+        list_record(capture.commands, CAPTURED_TEXT, z_index, record);
+        list_bytes(capture.commands, text, length);
+    }
+    count_submission(z_index, length * 4, -1);
+
+    if (pipeline.enabled) {
+        list_record(pipeline.lists[pipeline.recording], CAPTURED_TEXT, z_index, record);
+        list_bytes(pipeline.lists[pipeline.recording], text, length);
+    } else {
+        cmd.draw(WM::get_main_window()->get_renderers()[0], z_index);
+    }
+}
+
+enum ReplayMode {
+    REPLAY_SUBMIT, // through submit_cmd, counted and recorded like any draw call
+    REPLAY_DRAW,   // straight to the renderer
+};
+
+template <typename T>
+bool read_record(const CommandList &list, u64 &at, T &out) {
+    if (at + sizeof(T) > list.bytes.size()) return false;
+    memcpy(&out, &list.bytes[at], sizeof(T));
+    at += sizeof(T);
+    return true;
+}
+
+// Walks a command list, false when it turns out to be truncated.
+bool replay_commands(const CommandList &list, ReplayMode mode) {
+    auto &renderer = WM::get_main_window()->get_renderers()[0];
+
+    u64 at = 0;
+    for (u32 i = 0; i < list.count; ++i) {
+        CapturedKind kind;
+        i32 z_index;
+        if (!read_record(list, at, kind) || !read_record(list, at, z_index)) return false;
+
+        switch (kind) {
+        case CAPTURED_RECT: {
+            CapturedRect record;
+            if (!read_record(list, at, record)) return false;
+
+            Rect2DCmd cmd;
+            cmd.set(record.rect);
+            cmd.color = record.color;
+            cmd.outline = record.outline;
+            cmd.outline_color = record.outline_color;
+            if (mode == REPLAY_SUBMIT) {
+                submit_cmd(cmd, record.rect, z_index);
+            } else {
+                cmd.draw(renderer, z_index);
+            }
+        } break;
+        case CAPTURED_SPRITE: {
+            CapturedSprite record;
+            if (!read_record(list, at, record)) return false;
+
+            Sprite2DCmd cmd;
+            cmd.texture.id = record.texture;
+            cmd.position = record.position;
+            cmd.scale = record.scale;
+            cmd.rotation = record.rotation;
+            cmd.color = record.color;
+            cmd.region = record.region;
+            if (mode == REPLAY_SUBMIT) {
+                submit_cmd(cmd, z_index);
+            } else {
+                cmd.draw(renderer, z_index);
+            }
+        } break;
+        case CAPTURED_LINE: {
+            CapturedLine record;
+            if (!read_record(list, at, record)) return false;
+
+            Line2DCmd cmd;
+            cmd.start = record.start;
+            cmd.end = record.end;
+            cmd.thickness = record.thickness;
+            cmd.color = record.color;
+            if (mode == REPLAY_SUBMIT) {
+                submit_cmd(cmd, z_index);
+            } else {
+                cmd.draw(renderer, z_index);
+            }
+        } break;
+        case CAPTURED_TEXT: {
+            CapturedText record;
+            if (!read_record(list, at, record) || at + record.length > list.bytes.size()) return false;
+
+            const char *text = (const char *) &list.bytes[at];
+            at += record.length;
+
+            Text2DCmd cmd;
+            cmd.bitmap_font = &default_font;
+            cmd.position = record.position;
+            cmd.color = record.color;
+            cmd.text = frame_string({text, record.length}).to_upper();
+            if (mode == REPLAY_SUBMIT) {
+                submit_cmd(cmd, text, record.length, z_index);
+            } else {
+                cmd.draw(renderer, z_index);
+            }
+        } break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+void begin_render_frame(Events::PreUpdate &) {
+    RenderStats finished = render_stats;
+    render_stats = last_render_stats;
+    last_render_stats = finished;
+
+    // Keeps the z_index array of the older frame around instead of freeing it.
+    render_stats.submitted = render_stats.culled = render_stats.vertices = 0;
+    render_stats.batches = render_stats.texture_switches = 0;
+    render_stats.last_texture = render_stats.last_z_index = -1;
+    render_stats.by_z_index.resize(halloc, 0);
+
+    if (capture.recording) {
+        write_capture();
+        capture.recording = false;
+    }
+    if (capture.armed) {
+        capture.armed = false;
+        capture.recording = true;
+        clear_list(capture.commands);
+    }
+
+    if (pipeline.enabled) {
+        pipeline.recording ^= 1;
+        clear_list(pipeline.lists[pipeline.recording]);
+        pipeline.recorded_at[pipeline.recording] = std::chrono::steady_clock::now();
+    }
+}
+
+// Submits the previous frame's list once the update systems have recorded this one.
+void finish_pipelined_frame(Events::PostUpdate &) {
+    if (!pipeline.enabled) return;
+
+    auto start = std::chrono::steady_clock::now();
+    u32 submitted = pipeline.recording ^ 1;
+    replay_commands(pipeline.lists[submitted], REPLAY_DRAW);
+    auto end = std::chrono::steady_clock::now();
+    pipeline.submit_seconds = std::chrono::duration<double>(end - start).count();
+    pipeline.latency_seconds = std::chrono::duration<double>(end - pipeline.recorded_at[submitted]).count();
+}
+
+// False and counted as culled when `bounds` is entirely outside the view rect.
+bool in_view(const Rect2 &bounds) {
+    if (bounds.position.x > view_rect.position.x + view_rect.size.x || bounds.position.y > view_rect.position.y + view_rect.size.y ||
+        bounds.position.x + bounds.size.x < view_rect.position.x || bounds.position.y + bounds.size.y < view_rect.position.y) {
+        render_stats.culled++;
+        return false;
+    }
+    return true;
+}
+
+// Reads the pixel size out of a PNG header, enough to give sprites bounds for culling.
+Vector2 read_image_size(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return {0.0f, 0.0f};
+
+    u8 header[24];
+    bool read = fread(header, 1, sizeof(header), file) == sizeof(header);
+    fclose(file);
+
+    static const u8 png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (!read || memcmp(header, png_signature, sizeof(png_signature)) != 0) return {0.0f, 0.0f};
+
+    u32 width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+    u32 height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+    return {(float) width, (float) height};
+}
+
+Vector2 texture_size(TextureID texture) {
+    if (texture.id < 0 || (u64) texture.id >= textures.sizes.size()) return {0.0f, 0.0f};
+    return textures.sizes[texture.id];
+}
+
+// Sprites may be anchored anywhere inside their frame and rotated, so this is the
+// square their diagonal can sweep around the position.
+Rect2 sprite_bounds(const Sprite2DCmd &cmd, Vector2 size) {
+    float w = size.x * fabsf(cmd.scale.x), h = size.y * fabsf(cmd.scale.y);
+    float extent = sqrtf(w * w + h * h);
+    return {{cmd.position.x - extent, cmd.position.y - extent}, {extent * 2.0f, extent * 2.0f}};
+}
+
+bool sprite_in_view(const Sprite2DCmd &cmd, Vector2 size) {
+    if (size.x <= 0.0f || size.y <= 0.0f) return true;
+    return in_view(sprite_bounds(cmd, size));
+}
+
+// Table draw calls cull unless they pass `cull = false`.
+bool wants_culling(lua_State *L, int arg) {
+    lua_getfield(L, arg, "cull");
+    bool cull = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return cull;
+}
+
+// The one submit path per primitive, both the table draw calls and the positional
+// fast paths end up here.
+void submit_line(Line2DCmd &cmd, int z_index, bool cull) {
+    if (cull) {
+        float left = fminf(cmd.start.x, cmd.end.x) - cmd.thickness, top = fminf(cmd.start.y, cmd.end.y) - cmd.thickness;
+        float right = fmaxf(cmd.start.x, cmd.end.x) + cmd.thickness, bottom = fmaxf(cmd.start.y, cmd.end.y) + cmd.thickness;
+        if (!in_view({{left, top}, {right - left, bottom - top}})) return;
+    }
+    submit_cmd(cmd, z_index);
+}
+
+void submit_rect(Rect2DCmd &cmd, const Rect2 &rect, int z_index, bool cull) {
+    if (cull) {
+        float outline = cmd.outline;
+        if (!in_view({{rect.position.x - outline, rect.position.y - outline}, {rect.size.x + outline * 2.0f, rect.size.y + outline * 2.0f}})) return;
+    }
+    submit_cmd(cmd, rect, z_index);
+}
+
+// `size` is the unscaled size of what gets drawn, zero when it isn't known.
+void submit_sprite(Sprite2DCmd &cmd, Vector2 size, int z_index, bool cull) {
+    if (cull && !sprite_in_view(cmd, size)) return;
+    submit_cmd(cmd, z_index);
+}
+
+// Colors for the positional draw calls are packed 0xRRGGBBAA integers.
+Color unpack_rgba(lua_Integer rgba) {
+    Color color;
+    color.r = ((rgba >> 24) & 0xff) / 255.0f;
+    color.g = ((rgba >> 16) & 0xff) / 255.0f;
+    color.b = ((rgba >> 8) & 0xff) / 255.0f;
+    color.a = (rgba & 0xff) / 255.0f;
+    return color;
+}
+
+// Cheaper than luaL_checknumber/luaL_optnumber for the hot draw calls, a single
+// lua_tonumberx and only touching the error path when it fails.
+inline float number_arg(lua_State *L, int arg) {
+    int is_number;
+    lua_Number n = lua_tonumberx(L, arg, &is_number);
+    if (!is_number) luaL_typeerror(L, arg, "number");
+    return n;
+}
+
+inline float opt_number_arg(lua_State *L, int arg, float fallback) {
+    int is_number;
+    lua_Number n = lua_tonumberx(L, arg, &is_number);
+    if (is_number) return n;
+    if (!lua_isnoneornil(L, arg)) luaL_typeerror(L, arg, "number");
+    return fallback;
+}
+
+inline lua_Integer opt_integer_arg(lua_State *L, int arg, lua_Integer fallback) {
+    int is_integer;
+    lua_Integer n = lua_tointegerx(L, arg, &is_integer);
+    if (is_integer) return n;
+    if (!lua_isnoneornil(L, arg)) luaL_typeerror(L, arg, "integer");
+    return fallback;
+}
+
+int lua_load_texture(lua_State *L) {
+    if (!lua_isstring(L, 1)) {
+        RETURN_ERROR(L, "Expected a string (path to the texture) as the first argument");
+    }
+
+    u64 size = 0;
+    const char *pointer = luaL_checklstring(L, 1, &size);
+
+    // Loading the same path again hands out the texture it already loaded.
+    if ((textures.paths.size() + 1) * 2 > textures.slots.size()) grow_texture_slots();
+    u64 hash = hash_path(pointer, size);
+    u32 *slot = find_texture_slot(pointer, hash);
+    if (*slot) {
+        textures.shared++;
+        lua_pushinteger(L, textures.paths[*slot - 1].id.id);
+        return 1;
+    }
+
+    StrView path = {pointer, size};
+    TextureID id = TextureID::from_file(path);
+    if (id.id < 0) {
+        lua_pushinteger(L, id.id);
+        return 1;
+    }
+
+    u64 old_size = textures.sizes.size();
+    if ((u64) id.id >= old_size) {
+        textures.sizes.resize(halloc, id.id + 1);
+        for (u64 i = old_size; i < textures.sizes.size(); ++i) textures.sizes[i] = {0.0f, 0.0f};
+    }
+    Vector2 image_size = read_image_size(pointer);
+    textures.sizes[id.id] = image_size;
+    textures.bytes += (u64) image_size.x * (u64) image_size.y * 4;
+
+    textures.paths.push(halloc, {path.cstr(static_arena), hash, id});
+    *slot = textures.paths.size();
+
+    lua_pushinteger(L, id.id);
+    return 1;
+}
+
+int lua_load_shader(lua_State *L) {
+    StrView vertex, fragment;
+
+    if (lua_isnil(L, 1)) {
+        vertex = Renderer2D::vertex_shader_code();
+    } else if (lua_isstring(L, 1)) {
+        u64 size = 0;
+        const char *pointer = luaL_checklstring(L, 1, &size);
+        vertex = {pointer, size};
+    } else {
+        RETURN_ERROR(L, "Expected a string (path to the vertex shader) as the first argument");
+    }
+
+    if (lua_isnil(L, 1)) {
+        fragment = Renderer2D::fragment_shader_code();
+    } else if (lua_isstring(L, 1)) {
+        u64 size = 0;
+        const char *pointer = luaL_checklstring(L, 1, &size);
+        fragment = {pointer, size};
+    } else {
+        RETURN_ERROR(L, "Expected a string (path to the fragment shader) as the second argument");
+    }
+
+    Shader shader = Shader::from_path(vertex, fragment);
+
+    auto *r2d = Renderer2D::from(WM::get_main_window()->get_renderers()[0]);
+    r2d->add_shader(shader);
+
+    lua_pushinteger(L, shader.id);
+
+    return 1;
+}
+
+int lua_draw_line(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "Expected a table {start = v2(), end = v2(), color = {}, thickness = 1.0, z_index = 0} as the first argument");
+    }
+
+    Line2DCmd cmd;
+
+    load_v2(L, cmd.start, "start", 1);
+    load_v2(L, cmd.end, "finish", 1);
+
+    lua_getfield(L, 1, "color");
+    color_from_object(cmd.color, L);
+
+    lua_getfield(L, 1, "thickness");  
+    cmd.thickness = luaL_optnumber(L, -1, 1.0);  
+    lua_pop(L, 1);  
+
+    lua_getfield(L, 1, "z_index");  
+    int z_index = luaL_optnumber(L, -1, 0.0);  
+    lua_pop(L, 1);  
+
+    submit_line(cmd, z_index, wants_culling(L, 1));
+    return 0;
+}
+
+#define TEXT_CULL_GLYPH_SIZE 32.0f
+
+int lua_draw_text(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "Expected a table {text = 'Hello, World', position = v2(), color = {}, z_index = 0} as the first argument");
+    }
+
+    Text2DCmd cmd;
+    cmd.bitmap_font = &default_font;
+
+    load_v2(L, cmd.position, "position", 1);
+
+    lua_getfield(L, 1, "text");
+    size_t len = 0;
+    const char *text = luaL_checklstring(L, -1, &len);
+
+    lua_getfield(L, 1, "color");
+    color_from_object(cmd.color, L);
+
+    lua_getfield(L, 1, "z_index");  
+    int z_index = luaL_optnumber(L, -1, 0.0);  
+    lua_pop(L, 1);  
+
+    // The font has no metrics to ask, TEXT_CULL_GLYPH_SIZE is a generous guess at a glyph.
+    if (wants_culling(L, 1) && !in_view({cmd.position, {len * TEXT_CULL_GLYPH_SIZE, TEXT_CULL_GLYPH_SIZE}})) return 0;
+
+    cmd.text = frame_string({text, len}).to_upper();
+    submit_cmd(cmd, text, len, z_index);
+    return 0;
+}
+
+// Fills a rect command from the table at `arg`, shared by draw_rect2 and display lists.
+int read_rect2_cmd(lua_State *L, int arg, Rect2DCmd &cmd, Rect2 &rect, int &z_index) {
+    load_rect2(L, rect, arg);
+    cmd.set(rect);
+
+    lua_getfield(L, arg, "color");
+    color_from_object(cmd.color, L);
+
+    lua_getfield(L, arg, "outline_color");
+    color_from_object(cmd.outline_color, L);
+
+    lua_getfield(L, arg, "outline");  
+    cmd.outline = luaL_optnumber(L, -1, 0.0);  
+    lua_pop(L, 1);  
+
+    lua_getfield(L, arg, "z_index");  
+    z_index = luaL_optnumber(L, -1, 0.0);  
+    lua_pop(L, 1);  
+
+    return 0;
+}
+
+int lua_draw_rect2(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "Expected a table {position = v2(), size = v2(), outline = 0, outline_color = {}, color = {}, z_index = 0} as the first argument");
+    }
+
+    Rect2DCmd cmd;
+    Rect2 rect;
+    int z_index;
+    read_rect2_cmd(L, 1, cmd, rect, z_index);
+
+    submit_rect(cmd, rect, z_index, wants_culling(L, 1));
+    return 0;
+}
+
+// Fills a sprite command from the table at `arg`, shared by draw_sprite and display
+// lists. `region` picks a part of the texture, {position = v2(), size = v2()}.
+int read_sprite_cmd(lua_State *L, int arg, Sprite2DCmd &cmd, int &z_index) {
+    load_v2(L, cmd.position, "position", arg);
+
+    lua_getfield(L, arg, "texture");
+    cmd.texture.id = luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, arg, "color");
+    color_from_object(cmd.color, L);
+
+    lua_getfield(L, arg, "scale");
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "x");
+        cmd.scale.x = luaL_optnumber(L, -1, 1.0);  
+        lua_pop(L, 1);  
+
+        lua_getfield(L, -1, "y");
+        cmd.scale.y = luaL_optnumber(L, -1, 1.0);  
+        lua_pop(L, 1);
+    } else {
+        cmd.scale = {1.0f, 1.0f};  
+    }
+    lua_pop(L, 1);  
+
+    lua_getfield(L, arg, "region");
+    if (lua_istable(L, -1)) {
+        int region_arg = lua_gettop(L);
+        load_rect2(L, cmd.region, region_arg);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, arg, "rotation");  
+    cmd.rotation = luaL_optnumber(L, -1, 0.0);  
+    lua_pop(L, 1);
+
+    lua_getfield(L, arg, "z_index");  
+    z_index = luaL_optnumber(L, -1, 0);  
+    lua_pop(L, 1);  
+
+    return 0;
+}
+
+int lua_draw_sprite(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "Expected a table {position = {x = 0, y = 0}, texture = 0, color = {}, scale = {x = 1, y = 1}, rotation = 0, z_index = 0} as the first argument");
+    }
+
+    Sprite2DCmd cmd;
+    int z_index;
+    read_sprite_cmd(L, 1, cmd, z_index);
+
+    lua_getfield(L, 1, "shader");
+    int shader_id = luaL_optinteger(L, -1, -1);
+    lua_pop(L, 1);
+
+    if (shader_id != -1) {
+        JV_LOG_ENGINE(LOG_WARNING, "Shaders are not yet implemented for lua. Sorry, too lazy.");
+        // auto &renderer = WM::get_main_window()->get_renderers()[0];
+        // Sequence2DCmd seq;
+        //
+        // Shader2DCmd shader;
         // shader.id = shader_id;
         //
         // seq.push(shader.draw(renderer, 2));
@@ -322,567 +2027,5718 @@ int lua_draw_sprite(lua_State *L) {
         // seq.draw(renderer, z_index);
     }
 
-    cmd.draw(renderer, 0);
+    lua_getfield(L, 1, "region");
+    bool has_region = lua_istable(L, -1);
+    lua_pop(L, 1);
+
+    submit_sprite(cmd, has_region ? cmd.region.size : texture_size(cmd.texture), z_index, wants_culling(L, 1));
+    return 0;
+}
+
+// draw_rect(x, y, w, h, [rgba = 0xffffffff], [z_index = 0], [cull = true])
+int lua_draw_rect(lua_State *L) {
+    Rect2 rect = {{number_arg(L, 1), number_arg(L, 2)}, {number_arg(L, 3), number_arg(L, 4)}};
+
+    Rect2DCmd cmd;
+    cmd.set(rect);
+    cmd.color = unpack_rgba(opt_integer_arg(L, 5, 0xffffffff));
+    cmd.outline = 0.0f;
+
+    submit_rect(cmd, rect, opt_integer_arg(L, 6, 0), lua_isnoneornil(L, 7) || lua_toboolean(L, 7));
+    return 0;
+}
+
+// draw_sprite_at(texture, x, y, [sx = 1, sy = sx, rotation = 0, rgba = 0xffffffff, z_index = 0, cull = true])
+int lua_draw_sprite_at(lua_State *L) {
+    Sprite2DCmd cmd;
+    cmd.texture.id = luaL_checkinteger(L, 1);
+    cmd.position = {number_arg(L, 2), number_arg(L, 3)};
+    cmd.scale.x = opt_number_arg(L, 4, 1.0f);
+    cmd.scale.y = opt_number_arg(L, 5, cmd.scale.x);
+    cmd.rotation = opt_number_arg(L, 6, 0.0f);
+    cmd.color = unpack_rgba(opt_integer_arg(L, 7, 0xffffffff));
+
+    submit_sprite(cmd, texture_size(cmd.texture), opt_integer_arg(L, 8, 0), lua_isnoneornil(L, 9) || lua_toboolean(L, 9));
+    return 0;
+}
+
+// draw_line_xy(x1, y1, x2, y2, [rgba = 0xffffffff], [thickness = 1], [z_index = 0], [cull = true])
+int lua_draw_line_xy(lua_State *L) {
+    Line2DCmd cmd;
+    cmd.start = {number_arg(L, 1), number_arg(L, 2)};
+    cmd.end = {number_arg(L, 3), number_arg(L, 4)};
+    cmd.color = unpack_rgba(opt_integer_arg(L, 5, 0xffffffff));
+    cmd.thickness = opt_number_arg(L, 6, 1.0f);
+
+    submit_line(cmd, opt_integer_arg(L, 7, 0), lua_isnoneornil(L, 8) || lua_toboolean(L, 8));
+    return 0;
+}
+
+// rgba(r, g, b, [a = 1]) packs a 0..1 color for the positional draw calls.
+int lua_rgba(lua_State *L) {
+    lua_Integer r = fminf(fmaxf(number_arg(L, 1), 0.0f), 1.0f) * 255.0f + 0.5f;
+    lua_Integer g = fminf(fmaxf(number_arg(L, 2), 0.0f), 1.0f) * 255.0f + 0.5f;
+    lua_Integer b = fminf(fmaxf(number_arg(L, 3), 0.0f), 1.0f) * 255.0f + 0.5f;
+    lua_Integer a = fminf(fmaxf(opt_number_arg(L, 4, 1.0f), 0.0f), 1.0f) * 255.0f + 0.5f;
+    lua_pushinteger(L, (r << 24) | (g << 16) | (b << 8) | a);
+    return 1;
+}
+
+// Render.set_view(x, y, [w, h]) moves the rect draw calls are culled against.
+int lua_render_set_view(lua_State *L) {
+    view_rect.position.x = luaL_checknumber(L, 1);
+    view_rect.position.y = luaL_checknumber(L, 2);
+    if (!lua_isnoneornil(L, 3)) view_follows_window = false;
+    view_rect.size.x = luaL_optnumber(L, 3, view_rect.size.x);
+    view_rect.size.y = luaL_optnumber(L, 4, view_rect.size.y);
+    return 0;
+}
+
+void resize_view_rect(void *, Event &) {
+    if (!view_follows_window) return;
+
+    auto size = WM::get_main_window()->get_size();
+    view_rect.size = {(float) size.x, (float) size.y};
+}
+
+// Render.view() -> x, y, w, h
+int lua_render_view(lua_State *L) {
+    lua_pushnumber(L, view_rect.position.x);
+    lua_pushnumber(L, view_rect.position.y);
+    lua_pushnumber(L, view_rect.size.x);
+    lua_pushnumber(L, view_rect.size.y);
+    return 4;
+}
+
+// Render.stats() -> {submitted, culled, vertices, batches, texture_switches,
+//                    z_index = {[z] = submitted}} for the last complete frame, in
+//                    pipelined mode also pipeline_submit and pipeline_latency
+//                    in seconds. Sprite sizes for culling come from PNG headers, a
+//                    sprite of any other format without a `region` or `size` is
+//                    never culled and always counts as submitted.
+int lua_render_stats(lua_State *L) {
+    const RenderStats &stats = last_render_stats;
+
+    lua_newtable(L);
+    lua_pushinteger(L, stats.submitted); lua_setfield(L, -2, "submitted");
+    lua_pushinteger(L, stats.culled); lua_setfield(L, -2, "culled");
+    lua_pushinteger(L, stats.vertices); lua_setfield(L, -2, "vertices");
+    lua_pushinteger(L, stats.batches); lua_setfield(L, -2, "batches");
+    lua_pushinteger(L, stats.texture_switches); lua_setfield(L, -2, "texture_switches");
+
+    lua_createtable(L, 0, stats.by_z_index.size());
+    for (const ZIndexCount &entry : stats.by_z_index) {
+        lua_pushinteger(L, entry.submitted);
+        lua_rawseti(L, -2, entry.z_index);
+    }
+    lua_setfield(L, -2, "z_index");
+
+    if (pipeline.enabled) {
+        lua_pushnumber(L, pipeline.submit_seconds); lua_setfield(L, -2, "pipeline_submit");
+        lua_pushnumber(L, pipeline.latency_seconds); lua_setfield(L, -2, "pipeline_latency");
+    }
+    return 1;
+}
+
+int format_render_stats(char *buffer, u64 size, const RenderStats &stats) {
+    return snprintf(buffer, size, "cmds %u culled %u verts %u batches %u tex switches %u",
+                    stats.submitted, stats.culled, stats.vertices, stats.batches, stats.texture_switches);
+}
+
+// Render.log_stats() writes the last frame's numbers, z_index breakdown included, to the log.
+int lua_render_log_stats(lua_State *L) {
+    char line[256];
+    format_render_stats(line, sizeof(line), last_render_stats);
+    JV_LOG_ENGINE(LOG_INFO, "Render stats: %", line);
+
+    for (const ZIndexCount &entry : last_render_stats.by_z_index) {
+        JV_LOG_ENGINE(LOG_INFO, "    z_index %: % cmds", entry.z_index, entry.submitted);
+    }
+    return 0;
+}
+
+#define RENDER_OVERLAY_Z_INDEX 1000000
+#define RENDER_OVERLAY_LINE_HEIGHT 12.0f
+
+bool render_overlay;
+
+// Drawn straight to the renderer so the overlay doesn't show up in its own numbers.
+void draw_render_overlay(void *, Event &) {
+    if (!render_overlay) return;
+
+    auto &renderer = WM::get_main_window()->get_renderers()[0];
+    const RenderStats &stats = last_render_stats;
+
+    char line[256];
+    u32 lines = 0;
+    auto draw_line = [&](int length) {
+        if (length <= 0) return;
+        Text2DCmd cmd;
+        cmd.bitmap_font = &default_font;
+        cmd.position = {view_rect.position.x + 4.0f, view_rect.position.y + 4.0f + lines++ * RENDER_OVERLAY_LINE_HEIGHT};
+        cmd.text = frame_string({line, (u64) length}).to_upper();
+        cmd.color = Color();
+        cmd.draw(renderer, RENDER_OVERLAY_Z_INDEX);
+    };
+
+    draw_line(format_render_stats(line, sizeof(line), stats));
+    for (const ZIndexCount &entry : stats.by_z_index) {
+        draw_line(snprintf(line, sizeof(line), "z %d: %u", entry.z_index, entry.submitted));
+    }
+}
+
+// Render.overlay(enabled)
+int lua_render_overlay(lua_State *L) {
+    render_overlay = lua_toboolean(L, 1);
+    return 0;
+}
+
+// Render.capture(path) writes every command of the next frame to `path`.
+int lua_render_capture(lua_State *L) {
+    size_t length = 0;
+    const char *path = luaL_checklstring(L, 1, &length);
+    luaL_argcheck(L, length < sizeof(capture.path), 1, "path too long");
+
+    memcpy(capture.path, path, length + 1);
+    capture.armed = true;
+    return 0;
+}
+
+// The capture last replayed, with the modification time and size it had when read so
+// a capture written over the same path is picked up.
+struct ReplayCache {
+    char path[512];
+    std::filesystem::file_time_type modified;
+    u64 file_size;
+    CommandList commands;
+};
+
+ReplayCache replay_cache;
+
+bool load_replay(const char *path) {
+    std::error_code error;
+    std::filesystem::file_time_type modified = std::filesystem::last_write_time(path, error);
+    if (error) return false;
+    u64 file_size = std::filesystem::file_size(path, error);
+    if (error) return false;
+
+    if (replay_cache.commands.bytes.size() > 0 && strcmp(replay_cache.path, path) == 0 &&
+        replay_cache.modified == modified && replay_cache.file_size == file_size) {
+        return true;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+
+    CaptureHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+        fclose(file);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long end = ftell(file);
+    fseek(file, sizeof(header), SEEK_SET);
+
+    u64 size = end > (long) sizeof(header) ? end - sizeof(header) : 0;
+    replay_cache.commands.bytes.resize(halloc, size);
+    bool read = size == 0 || fread(&replay_cache.commands.bytes[0], 1, size, file) == size;
+    fclose(file);
+    if (!read) {
+        clear_list(replay_cache.commands);
+        return false;
+    }
+
+    replay_cache.commands.count = header.count;
+    replay_cache.modified = modified;
+    replay_cache.file_size = file_size;
+    snprintf(replay_cache.path, sizeof(replay_cache.path), "%s", path);
+    return true;
+}
+
+// Render.replay(path, [times = 1]) -> seconds spent submitting, commands per replay.
+// Call it from a Draw system, the file is only read again when the path, its
+// modification time or its size changes.
+int lua_render_replay(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    lua_Integer times = luaL_optinteger(L, 2, 1);
+
+    if (!load_replay(path)) {
+        LOG_ERROR("ERROR: could not load frame capture %\n", path);
+        return luaL_error(L, "Could not load frame capture %s", path);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (lua_Integer i = 0; i < times; ++i) {
+        if (!replay_commands(replay_cache.commands, REPLAY_SUBMIT)) {
+            LOG_ERROR("ERROR: frame capture % is truncated\n", path);
+            return luaL_error(L, "Frame capture %s is truncated", path);
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    lua_pushnumber(L, elapsed.count());
+    lua_pushinteger(L, replay_cache.commands.count);
+    return 2;
+}
+
+// Render.textures() -> {bytes, loaded, shared}, bytes is the RGBA8 estimate from the
+// PNG headers, other formats count as zero.
+int lua_render_textures(lua_State *L) {
+    lua_newtable(L);
+    lua_pushinteger(L, textures.bytes); lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, textures.paths.size()); lua_setfield(L, -2, "loaded");
+    lua_pushinteger(L, textures.shared); lua_setfield(L, -2, "shared");
+    return 1;
+}
+
+void bind_render_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_render_set_view); lua_setfield(L, -2, "set_view");
+    lua_pushcfunction(L, lua_render_view); lua_setfield(L, -2, "view");
+    lua_pushcfunction(L, lua_render_stats); lua_setfield(L, -2, "stats");
+    lua_pushcfunction(L, lua_render_log_stats); lua_setfield(L, -2, "log_stats");
+    lua_pushcfunction(L, lua_render_overlay); lua_setfield(L, -2, "overlay");
+    lua_pushcfunction(L, lua_render_capture); lua_setfield(L, -2, "capture");
+    lua_pushcfunction(L, lua_render_replay); lua_setfield(L, -2, "replay");
+    lua_pushcfunction(L, lua_render_textures); lua_setfield(L, -2, "textures");
+    lua_setglobal(L, "Render");
+
+    WM::get_main_window()->get_viewport()->push_system(Events::DRAW_ID, draw_render_overlay, nullptr);
+    WM::get_main_window()->get_viewport()->push_system(Events::WINDOW_RESIZE_ID, resize_view_rect, nullptr);
+}
+
+int lua_include(lua_State *L) {
+    const char *pointer = luaL_checklstring(L, 1, nullptr);
+    luaL_dofile(L, pointer);
+    return 0;
+}
+
+void bind_function(lua_State *L, const char* lua_function_name, lua_CFunction fn) {
+    lua_pushcfunction(L, fn);
+    lua_setglobal(L, lua_function_name);
+}
+
+void bind_event_ids_to_lua(lua_State *L) {
+    lua_newtable(L);
+
+    lua_pushinteger(L, Events::ANY_ID); lua_setfield(L, -2, "Any");
+    lua_pushinteger(L, Events::INIT_ID); lua_setfield(L, -2, "Init");
+    lua_pushinteger(L, Events::UPDATE_ID); lua_setfield(L, -2, "Update");
+    lua_pushinteger(L, Events::QUIT_ID); lua_setfield(L, -2, "Quit");
+    lua_pushinteger(L, Events::PRE_UPDATE_ID); lua_setfield(L, -2, "PreUpdate");
+    lua_pushinteger(L, Events::POST_UPDATE_ID); lua_setfield(L, -2, "PostUpdate");
+    lua_pushinteger(L, Events::DRAW_ID); lua_setfield(L, -2, "Draw");
+    lua_pushinteger(L, Events::WINDOW_OPEN_ID); lua_setfield(L, -2, "WindowOpen");
+    lua_pushinteger(L, Events::WINDOW_CLOSE_ID); lua_setfield(L, -2, "WindowClose");
+    lua_pushinteger(L, Events::WINDOW_RESIZE_ID); lua_setfield(L, -2, "WindowResize");
+    lua_pushinteger(L, Events::MOUSE_MOVED_ID); lua_setfield(L, -2, "MouseMoved");
+    lua_pushinteger(L, Events::MOUSE_SCROLLED_ID); lua_setfield(L, -2, "MouseScrolled");
+    lua_pushinteger(L, Events::MOUSE_BUTTON_PRESSED_ID); lua_setfield(L, -2, "MouseButtonPressed");
+    lua_pushinteger(L, Events::MOUSE_BUTTON_RELEASED_ID); lua_setfield(L, -2, "MouseButtonReleased");
+    lua_pushinteger(L, Events::MOUSE_LEAVE_WINDOW_ID); lua_setfield(L, -2, "MouseLeaveWindow");
+    lua_pushinteger(L, Events::MOUSE_ENTER_WINDOW_ID); lua_setfield(L, -2, "MouseEnterWindow");
+    lua_pushinteger(L, Events::KEY_PRESSED_ID); lua_setfield(L, -2, "KeyPressed");
+    lua_pushinteger(L, Events::KEY_RELEASED_ID); lua_setfield(L, -2, "KeyReleased");
+    lua_pushinteger(L, Events::KEY_TYPED_ID); lua_setfield(L, -2, "KeyTyped");
+    lua_pushinteger(L, Events::VIEWPORT_DRAW_ID); lua_setfield(L, -2, "ViewportDraw");
+    lua_pushinteger(L, Events::RENDERER_INIT_ID); lua_setfield(L, -2, "RendererInit");
+    lua_pushinteger(L, FIXED_UPDATE_ID); lua_setfield(L, -2, "FixedUpdate");
+    lua_pushinteger(L, LOVIAL_FIRST_CUSTOM_ID); lua_setfield(L, -2, "FirstCustom");
+
+    lua_setglobal(L, "EventIDs");
+
+    lua_newtable(L);
+    lua_pushinteger(L, EVENT_POLICY_ALL); lua_setfield(L, -2, "All");
+    lua_pushinteger(L, EVENT_POLICY_COALESCE); lua_setfield(L, -2, "Coalesce");
+    lua_pushinteger(L, EVENT_POLICY_AGGREGATE); lua_setfield(L, -2, "Aggregate");
+    lua_setglobal(L, "EventPolicy");
+}
+
+// Profiler.events() -> {[event_id] = {seen, dispatched, filtered, coalesced}} since start
+// or the last Profiler.reset()
+int lua_profiler_events(lua_State *L) {
+    lua_newtable(L);
+    for (u64 type = 0; type < event_counts.size(); ++type) {
+        const EventCounts &counts = event_counts[type];
+        if (counts.seen == 0) continue;
+
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, counts.seen); lua_setfield(L, -2, "seen");
+        lua_pushinteger(L, counts.dispatched); lua_setfield(L, -2, "dispatched");
+        lua_pushinteger(L, counts.filtered); lua_setfield(L, -2, "filtered");
+        lua_pushinteger(L, counts.coalesced); lua_setfield(L, -2, "coalesced");
+        lua_rawseti(L, -2, type);
+    }
+    return 1;
+}
+
+// Profiler.systems() -> array of {event, source, calls, slow, overruns, avg_ms, max_ms,
+// disabled} for every Lua system, so slow ones show up before they hang the game.
+int lua_profiler_systems(lua_State *L) {
+    lua_createtable(L, watchdog.systems.size(), 0);
+    for (u64 i = 0; i < watchdog.systems.size(); ++i) {
+        LuaSystem *system = watchdog.systems[i];
+
+        lua_createtable(L, 0, 8);
+        lua_pushinteger(L, system->type); lua_setfield(L, -2, "event");
+
+        lua_Debug ar;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, system->func_ref);
+        lua_getinfo(L, ">S", &ar);
+        lua_pushfstring(L, "%s:%d", ar.short_src, ar.linedefined); lua_setfield(L, -2, "source");
+
+        lua_pushinteger(L, system->calls); lua_setfield(L, -2, "calls");
+        lua_pushinteger(L, system->slow); lua_setfield(L, -2, "slow");
+        lua_pushinteger(L, system->overruns); lua_setfield(L, -2, "overruns");
+        lua_pushnumber(L, system->calls ? system->total_ns / 1e6 / system->calls : 0.0); lua_setfield(L, -2, "avg_ms");
+        lua_pushnumber(L, system->max_ns / 1e6); lua_setfield(L, -2, "max_ms");
+        lua_pushboolean(L, system->disabled); lua_setfield(L, -2, "disabled");
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+int lua_profiler_reset(lua_State *L) {
+    for (EventCounts &counts : event_counts) counts = {};
+    for (LuaSystem *system : watchdog.systems) {
+        system->calls = 0;
+        system->slow = 0;
+        system->overruns = 0;
+        system->total_ns = 0;
+        system->max_ns = 0;
+    }
+    return 0;
+}
+
+void bind_profiler_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_profiler_events); lua_setfield(L, -2, "events");
+    lua_pushcfunction(L, lua_profiler_systems); lua_setfield(L, -2, "systems");
+    lua_pushcfunction(L, lua_profiler_reset); lua_setfield(L, -2, "reset");
+    lua_setglobal(L, "Profiler");
+
+    if (watchdog.time_budget_ms > 0.0 || watchdog.instruction_budget > 0) arm_watchdog(L);
+}
+
+void bind_input_actions_to_lua(lua_State *L) {
+    lua_newtable(L);
+
+    lua_pushinteger(L, (int) Actions::LeftMouseButton); lua_setfield(L, -2, "LeftMouseButton");
+    lua_pushinteger(L, (int) Actions::RightMouseButton); lua_setfield(L, -2, "RightMouseButton");
+    lua_pushinteger(L, (int) Actions::MiddleMouseButton); lua_setfield(L, -2, "MiddleMouseButton");
+    lua_pushinteger(L, (int) Actions::MouseButtonX1); lua_setfield(L, -2, "MouseButtonX1");
+    lua_pushinteger(L, (int) Actions::MouseButtonX2); lua_setfield(L, -2, "MouseButtonX2");
+    lua_pushinteger(L, (int) Actions::MouseButtonX3); lua_setfield(L, -2, "MouseButtonX3");
+    lua_pushinteger(L, (int) Actions::MouseButtonX4); lua_setfield(L, -2, "MouseButtonX4");
+    lua_pushinteger(L, (int) Actions::MouseButtonX5); lua_setfield(L, -2, "MouseButtonX5");
+    lua_pushinteger(L, (int) Actions::Space); lua_setfield(L, -2, "Space");
+    lua_pushinteger(L, (int) Actions::Apostrophe); lua_setfield(L, -2, "Apostrophe");
+    lua_pushinteger(L, (int) Actions::Comma); lua_setfield(L, -2, "Comma");
+    lua_pushinteger(L, (int) Actions::Minus); lua_setfield(L, -2, "Minus");
+    lua_pushinteger(L, (int) Actions::Period); lua_setfield(L, -2, "Period");
+    lua_pushinteger(L, (int) Actions::Slash); lua_setfield(L, -2, "Slash");
+    lua_pushinteger(L, (int) Actions::Num0); lua_setfield(L, -2, "Num0");
+    lua_pushinteger(L, (int) Actions::Num1); lua_setfield(L, -2, "Num1");
+    lua_pushinteger(L, (int) Actions::Num2); lua_setfield(L, -2, "Num2");
+    lua_pushinteger(L, (int) Actions::Num3); lua_setfield(L, -2, "Num3");
+    lua_pushinteger(L, (int) Actions::Num4); lua_setfield(L, -2, "Num4");
+    lua_pushinteger(L, (int) Actions::Num5); lua_setfield(L, -2, "Num5");
+    lua_pushinteger(L, (int) Actions::Num6); lua_setfield(L, -2, "Num6");
+    lua_pushinteger(L, (int) Actions::Num7); lua_setfield(L, -2, "Num7");
+    lua_pushinteger(L, (int) Actions::Num8); lua_setfield(L, -2, "Num8");
+    lua_pushinteger(L, (int) Actions::Num9); lua_setfield(L, -2, "Num9");
+    lua_pushinteger(L, (int) Actions::Semicolon); lua_setfield(L, -2, "Semicolon");
+    lua_pushinteger(L, (int) Actions::Equal); lua_setfield(L, -2, "Equal");
+    lua_pushinteger(L, (int) Actions::A); lua_setfield(L, -2, "A");
+    lua_pushinteger(L, (int) Actions::B); lua_setfield(L, -2, "B");
+    lua_pushinteger(L, (int) Actions::C); lua_setfield(L, -2, "C");
+    lua_pushinteger(L, (int) Actions::D); lua_setfield(L, -2, "D");
+    lua_pushinteger(L, (int) Actions::E); lua_setfield(L, -2, "E");
+    lua_pushinteger(L, (int) Actions::F); lua_setfield(L, -2, "F");
+    lua_pushinteger(L, (int) Actions::G); lua_setfield(L, -2, "G");
+    lua_pushinteger(L, (int) Actions::H); lua_setfield(L, -2, "H");
+    lua_pushinteger(L, (int) Actions::I); lua_setfield(L, -2, "I");
+    lua_pushinteger(L, (int) Actions::J); lua_setfield(L, -2, "J");
+    lua_pushinteger(L, (int) Actions::K); lua_setfield(L, -2, "K");
+    lua_pushinteger(L, (int) Actions::L); lua_setfield(L, -2, "L");
+    lua_pushinteger(L, (int) Actions::M); lua_setfield(L, -2, "M");
+    lua_pushinteger(L, (int) Actions::N); lua_setfield(L, -2, "N");
+    lua_pushinteger(L, (int) Actions::O); lua_setfield(L, -2, "O");
+    lua_pushinteger(L, (int) Actions::P); lua_setfield(L, -2, "P");
+    lua_pushinteger(L, (int) Actions::Q); lua_setfield(L, -2, "Q");
+    lua_pushinteger(L, (int) Actions::R); lua_setfield(L, -2, "R");
+    lua_pushinteger(L, (int) Actions::S); lua_setfield(L, -2, "S");
+    lua_pushinteger(L, (int) Actions::T); lua_setfield(L, -2, "T");
+    lua_pushinteger(L, (int) Actions::U); lua_setfield(L, -2, "U");
+    lua_pushinteger(L, (int) Actions::V); lua_setfield(L, -2, "V");
+    lua_pushinteger(L, (int) Actions::W); lua_setfield(L, -2, "W");
+    lua_pushinteger(L, (int) Actions::X); lua_setfield(L, -2, "X");
+    lua_pushinteger(L, (int) Actions::Y); lua_setfield(L, -2, "Y");
+    lua_pushinteger(L, (int) Actions::Z); lua_setfield(L, -2, "Z");
+    lua_pushinteger(L, (int) Actions::Left_bracket); lua_setfield(L, -2, "Left_bracket");
+    lua_pushinteger(L, (int) Actions::Backslash); lua_setfield(L, -2, "Backslash");
+    lua_pushinteger(L, (int) Actions::Right_bracket); lua_setfield(L, -2, "Right_bracket");
+    lua_pushinteger(L, (int) Actions::Grave_accent); lua_setfield(L, -2, "Grave_accent");
+    lua_pushinteger(L, (int) Actions::World1); lua_setfield(L, -2, "World1");
+    lua_pushinteger(L, (int) Actions::World2); lua_setfield(L, -2, "World2");
+    lua_pushinteger(L, (int) Actions::Escape); lua_setfield(L, -2, "Escape");
+    lua_pushinteger(L, (int) Actions::Enter); lua_setfield(L, -2, "Enter");
+    lua_pushinteger(L, (int) Actions::Tab); lua_setfield(L, -2, "Tab");
+    lua_pushinteger(L, (int) Actions::Backspace); lua_setfield(L, -2, "Backspace");
+    lua_pushinteger(L, (int) Actions::Insert); lua_setfield(L, -2, "Insert");
+    lua_pushinteger(L, (int) Actions::Delete); lua_setfield(L, -2, "Delete");
+    lua_pushinteger(L, (int) Actions::Right); lua_setfield(L, -2, "Right");
+    lua_pushinteger(L, (int) Actions::Left); lua_setfield(L, -2, "Left");
+    lua_pushinteger(L, (int) Actions::Down); lua_setfield(L, -2, "Down");
+    lua_pushinteger(L, (int) Actions::Up); lua_setfield(L, -2, "Up");
+    lua_pushinteger(L, (int) Actions::PageUp); lua_setfield(L, -2, "PageUp");
+    lua_pushinteger(L, (int) Actions::PageDown); lua_setfield(L, -2, "PageDown");
+    lua_pushinteger(L, (int) Actions::Home); lua_setfield(L, -2, "Home");
+    lua_pushinteger(L, (int) Actions::End); lua_setfield(L, -2, "End");
+    lua_pushinteger(L, (int) Actions::CapsLock); lua_setfield(L, -2, "CapsLock");
+    lua_pushinteger(L, (int) Actions::ScrollLock); lua_setfield(L, -2, "ScrollLock");
+    lua_pushinteger(L, (int) Actions::NumLock); lua_setfield(L, -2, "NumLock");
+    lua_pushinteger(L, (int) Actions::PrintScreen); lua_setfield(L, -2, "PrintScreen");
+    lua_pushinteger(L, (int) Actions::Pause); lua_setfield(L, -2, "Pause");
+    lua_pushinteger(L, (int) Actions::F1); lua_setfield(L, -2, "F1");
+    lua_pushinteger(L, (int) Actions::F2); lua_setfield(L, -2, "F2");
+    lua_pushinteger(L, (int) Actions::F3); lua_setfield(L, -2, "F3");
+    lua_pushinteger(L, (int) Actions::F4); lua_setfield(L, -2, "F4");
+    lua_pushinteger(L, (int) Actions::F5); lua_setfield(L, -2, "F5");
+    lua_pushinteger(L, (int) Actions::F6); lua_setfield(L, -2, "F6");
+    lua_pushinteger(L, (int) Actions::F7); lua_setfield(L, -2, "F7");
+    lua_pushinteger(L, (int) Actions::F8); lua_setfield(L, -2, "F8");
+    lua_pushinteger(L, (int) Actions::F9); lua_setfield(L, -2, "F9");
+    lua_pushinteger(L, (int) Actions::F10); lua_setfield(L, -2, "F10");
+    lua_pushinteger(L, (int) Actions::F11); lua_setfield(L, -2, "F11");
+    lua_pushinteger(L, (int) Actions::F12); lua_setfield(L, -2, "F12");
+    lua_pushinteger(L, (int) Actions::F13); lua_setfield(L, -2, "F13");
+    lua_pushinteger(L, (int) Actions::F14); lua_setfield(L, -2, "F14");
+    lua_pushinteger(L, (int) Actions::F15); lua_setfield(L, -2, "F15");
+    lua_pushinteger(L, (int) Actions::F16); lua_setfield(L, -2, "F16");
+    lua_pushinteger(L, (int) Actions::F17); lua_setfield(L, -2, "F17");
+    lua_pushinteger(L, (int) Actions::F18); lua_setfield(L, -2, "F18");
+    lua_pushinteger(L, (int) Actions::F19); lua_setfield(L, -2, "F19");
+    lua_pushinteger(L, (int) Actions::F20); lua_setfield(L, -2, "F20");
+    lua_pushinteger(L, (int) Actions::F21); lua_setfield(L, -2, "F21");
+    lua_pushinteger(L, (int) Actions::F22); lua_setfield(L, -2, "F22");
+    lua_pushinteger(L, (int) Actions::F23); lua_setfield(L, -2, "F23");
+    lua_pushinteger(L, (int) Actions::F24); lua_setfield(L, -2, "F24");
+    lua_pushinteger(L, (int) Actions::F25); lua_setfield(L, -2, "F25");
+    lua_pushinteger(L, (int) Actions::Kp0); lua_setfield(L, -2, "Kp0");
+    lua_pushinteger(L, (int) Actions::Kp1); lua_setfield(L, -2, "Kp1");
+    lua_pushinteger(L, (int) Actions::Kp2); lua_setfield(L, -2, "Kp2");
+    lua_pushinteger(L, (int) Actions::Kp3); lua_setfield(L, -2, "Kp3");
+    lua_pushinteger(L, (int) Actions::Kp4); lua_setfield(L, -2, "Kp4");
+    lua_pushinteger(L, (int) Actions::Kp5); lua_setfield(L, -2, "Kp5");
+    lua_pushinteger(L, (int) Actions::Kp6); lua_setfield(L, -2, "Kp6");
+    lua_pushinteger(L, (int) Actions::Kp7); lua_setfield(L, -2, "Kp7");
+    lua_pushinteger(L, (int) Actions::Kp8); lua_setfield(L, -2, "Kp8");
+    lua_pushinteger(L, (int) Actions::Kp9); lua_setfield(L, -2, "Kp9");
+    lua_pushinteger(L, (int) Actions::KpDecimal); lua_setfield(L, -2, "KpDecimal");
+    lua_pushinteger(L, (int) Actions::KpDivide); lua_setfield(L, -2, "KpDivide");
+    lua_pushinteger(L, (int) Actions::KpMultiply); lua_setfield(L, -2, "KpMultiply");
+    lua_pushinteger(L, (int) Actions::KpSubtract); lua_setfield(L, -2, "KpSubtract");
+    lua_pushinteger(L, (int) Actions::KpAdd); lua_setfield(L, -2, "KpAdd");
+    lua_pushinteger(L, (int) Actions::KpEnter); lua_setfield(L, -2, "KpEnter");
+    lua_pushinteger(L, (int) Actions::KpEqual); lua_setfield(L, -2, "KpEqual");
+    lua_pushinteger(L, (int) Actions::LeftShift); lua_setfield(L, -2, "LeftShift");
+    lua_pushinteger(L, (int) Actions::LeftControl); lua_setfield(L, -2, "LeftControl");
+    lua_pushinteger(L, (int) Actions::LeftAlt); lua_setfield(L, -2, "LeftAlt");
+    lua_pushinteger(L, (int) Actions::LeftSuper); lua_setfield(L, -2, "LeftSuper");
+    lua_pushinteger(L, (int) Actions::RightShift); lua_setfield(L, -2, "RightShift");
+    lua_pushinteger(L, (int) Actions::RightControl); lua_setfield(L, -2, "RightControl");
+    lua_pushinteger(L, (int) Actions::RightAlt); lua_setfield(L, -2, "RightAlt");
+    lua_pushinteger(L, (int) Actions::RightSuper); lua_setfield(L, -2, "RightSuper");
+    lua_pushinteger(L, (int) Actions::Menu); lua_setfield(L, -2, "Menu");
+
+    lua_setglobal(L, "Actions");
+}
+
+void get_v2_op_args(Vector2 *lhs, Vector2 *rhs, lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_getfield(L, 1, "x");
+    lhs->x = luaL_checknumber(L, -1);
+    lua_getfield(L, 1, "y");
+    lhs->y = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    lua_getfield(L, 2, "x");
+    rhs->x = luaL_checknumber(L, -1);
+    lua_getfield(L, 2, "y");
+    rhs->y = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+}
+
+void push_v2(lua_State *L, const Vector2 &vector) {
+    lua_newtable(L);
+    lua_pushnumber(L, vector.x); lua_setfield(L, -2, "x");
+    lua_pushnumber(L, vector.y); lua_setfield(L, -2, "y");
+}
+
+int lua_v2(lua_State *L) {
+    float x = luaL_checknumber(L, 1);
+    float y = luaL_optnumber(L, 2, x); // default to same as x so you can go: v2(1)
+    push_v2(L, {x, y});
+    return 1;
+}
+
+int lua_v2_add(lua_State *L) {
+    Vector2 lhs, rhs;
+    get_v2_op_args(&lhs, &rhs, L);
+    push_v2(L, lhs + rhs);
+    return 1;
+}
+
+int lua_v2_sub(lua_State *L) {
+    Vector2 lhs, rhs;
+    get_v2_op_args(&lhs, &rhs, L);
+    push_v2(L, lhs - rhs);
+    return 1;
+}
+
+int lua_v2_mul(lua_State *L) {
+    Vector2 lhs, rhs;
+    get_v2_op_args(&lhs, &rhs, L);
+    push_v2(L, lhs * rhs);
+    return 1;
+}
+
+int lua_v2_div(lua_State *L) {
+    Vector2 lhs, rhs;
+    get_v2_op_args(&lhs, &rhs, L);
+    push_v2(L, lhs / rhs);
+    return 1;
+}
+
+int lua_v2_normalize(lua_State *L) {
+    lua_getfield(L, 1, "x");
+    float x = luaL_checknumber(L, -1);
+    lua_getfield(L, 1, "y");
+    float y = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    push_v2(L, Vector2(x, y).normalized());
+    return 1;
+}
+
+int lua_v2_length(lua_State *L) {
+    lua_getfield(L, 1, "x");
+    float x = luaL_checknumber(L, -1);
+    lua_getfield(L, 1, "y");
+    float y = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    lua_pushinteger(L, Vector2(x, y).length());
+    return 1;
+}
+
+int lua_v2_angle(lua_State *L) {
+    lua_getfield(L, 1, "x");
+    float x = luaL_checknumber(L, -1);
+    lua_getfield(L, 1, "y");
+    float y = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    lua_pushinteger(L, Vector2(x, y).angle());
+    return 1;
+}
+
+int lua_rect2s_overlap(lua_State *L) {
+    Rect2 a, b;
+    load_rect2(L, a, 1);
+    load_rect2(L, b, 2);
+    lua_pushboolean(L, a.intersects(b));
+    return 1;
+}
+
+int lua_rect2_has_point(lua_State *L) {
+    Rect2 rect;
+    load_rect2(L, rect, 1);
+
+    lua_getfield(L, 2, "x");
+    float x = luaL_checknumber(L, -1);
+    lua_getfield(L, 2, "y");
+    float y = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    lua_pushboolean(L, rect.has_point({x, y}));
+    return 1;
+}
+
+int lua_get_axis(lua_State *L) {
+    int negitive = luaL_checkinteger(L, 1);
+    int positive = luaL_checkinteger(L, 2);
+    lua_pushnumber(L, Input::get_axis((Actions) negitive, (Actions) positive));
+    return 1;
+}
+
+int lua_get_direction(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "{up: Actions.W, left: Actions.A, down: Actions.S, right: Actions.D} as the first argument");
+    }
+
+    lua_getfield(L, 1, "left");
+    Actions left = (Actions) luaL_checkinteger(L, -1);
+
+    lua_getfield(L, 1, "right");
+    Actions right = (Actions) luaL_checkinteger(L, -1);
+
+    lua_getfield(L, 1, "up");
+    Actions up = (Actions) luaL_checkinteger(L, -1);
+
+    lua_getfield(L, 1, "down");
+    Actions down = (Actions) luaL_checkinteger(L, -1);
+
+    push_v2(L, Input::get_direction(up, down, left, right));
+    return 1;
+}
+
+int lua_mouse_position(lua_State *L) {
+    push_v2(L, Input::get_mouse_position());
+    return 1;
+}
+
+int lua_mouse_delta(lua_State *L) {
+    push_v2(L, Input::get_mouse_delta());
+    return 1;
+}
+
+int lua_is_pressed(lua_State *L) {
+    int action = luaL_checkinteger(L, 1);
+    lua_pushboolean(L, Input::is_pressed((Actions) action));
+    return 1;
+}
+
+int lua_is_typed(lua_State *L) {
+    int action = luaL_checkinteger(L, 1);
+    lua_pushboolean(L, Input::is_typed((Actions) action));
+    return 1;
+}
+
+int lua_is_just_pressed(lua_State *L) {
+    int action = luaL_checkinteger(L, 1);
+    lua_pushboolean(L, Input::is_just_pressed((Actions) action));
+    return 1;
+}
+
+int lua_is_just_released(lua_State *L) {
+    int action = luaL_checkinteger(L, 1);
+    lua_pushboolean(L, Input::is_just_released((Actions) action));
+    return 1;
+}
+
+int lua_string_typed(lua_State *L) {
+    View<char> chars = Input::get_chars_typed();
+    lua_pushlstring(L, chars.ptr(), chars.size());
+    return 1;
+}
+
+int lua_delta(lua_State *L) {
+    lua_pushnumber(L, Time::delta());
+    return 1;
+}
+
+int lua_alpha(lua_State *L) {
+    lua_pushnumber(L, fixed_step.alpha);
+    return 1;
+}
+
+int lua_fixed_delta(lua_State *L) {
+    lua_pushnumber(L, fixed_step.enabled ? fixed_step.step : Time::delta());
+    return 1;
+}
+
+int lua_fixed_stats(lua_State *L) {
+    lua_newtable(L);
+    lua_pushinteger(L, fixed_step.tick); lua_setfield(L, -2, "tick");
+    lua_pushinteger(L, fixed_step.dropped); lua_setfield(L, -2, "dropped");
+    lua_pushinteger(L, fixed_step.behind); lua_setfield(L, -2, "behind");
+    lua_pushboolean(L, fixed_step.falling_behind); lua_setfield(L, -2, "falling_behind");
+    lua_pushinteger(L, fixed_step.merged); lua_setfield(L, -2, "merged");
+    return 1;
+}
+
+int lua_randi_between(lua_State *L) {
+    int low = luaL_checkinteger(L, 1);
+    int high = luaL_checkinteger(L, 2);
+
+    lua_pushinteger(L, rng::between(low, high));
+    return 1;
+}
+
+int lua_randf_between(lua_State *L) {
+    float low = luaL_checknumber(L, 1);
+    float high = luaL_checknumber(L, 2);
+
+    lua_pushnumber(L, rng::between(low, high));
+    return 1;
+}
+
+int lua_randv2_between(lua_State *L) {
+    lua_getfield(L, 1, "x");
+    float x1 = luaL_checknumber(L, -1);
+    lua_getfield(L, 1, "y");
+    float y1 = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    lua_getfield(L, 2, "x");
+    float x2 = luaL_checknumber(L, -1);
+    lua_getfield(L, 2, "y");
+    float y2 = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    push_v2(L, Vector2(rng::between(x1, x2), rng::between(y1, y2)));
+    return 1;
+}
+
+int lua_randf(lua_State *L) {
+    lua_pushnumber(L, rng::randf());
+    return 1;
+}
+
+int lua_randi(lua_State *L) {
+    lua_pushinteger(L, rng::randi());
+    return 1;
+}
+
+int lua_randb(lua_State *L) {
+    lua_pushboolean(L, rng::randb());
+    return 1;
+}
+
+// Counter based random streams. Value n of a stream is word n % 4 of Philox4x32-10
+// applied to block n / 4 under the stream's key, so any value can be computed without
+// the ones before it. Bulk fills split the range across the job system and still give
+// the same output for any number of workers, and a stream can seek() back for replays.
+// Blocks are generated PHILOX_LANES at a time as structure of arrays so the compiler
+// can vectorize the rounds.
+
+#define RNG_STREAM_META "Lovial.RngStream"
+#define RNG_BUFFER_META "Lovial.FloatBuffer"
+#define PHILOX_LANES 8
+#define RNG_PARALLEL_THRESHOLD 16384 // values, below this a fill stays on the calling thread
+#define RNG_FILL_GRAIN 1024          // blocks per job
+
+struct PhiloxStream {
+    u32 key[2];
+    u64 position; // next value
+
+    u64 cached_block;
+    u32 cached[4];
+    bool has_cache;
+};
+
+struct FloatBuffer {
+    u64 count;
+    float values[1]; // allocated with `count` of them
+};
+
+// Writes blocks [first, first + count) as 4 words each.
+void philox_blocks(const u32 key[2], u64 first, u64 count, u32 *out) {
+    for (u64 base = 0; base < count; base += PHILOX_LANES) {
+        u32 c0[PHILOX_LANES], c1[PHILOX_LANES], c2[PHILOX_LANES], c3[PHILOX_LANES];
+        for (int lane = 0; lane < PHILOX_LANES; ++lane) {
+            u64 block = first + base + lane;
+            c0[lane] = (u32) block;
+            c1[lane] = (u32) (block >> 32);
+            c2[lane] = 0;
+            c3[lane] = 0;
+        }
+
+        u32 k0 = key[0], k1 = key[1];
+        for (int round = 0; round < 10; ++round) {
+            for (int lane = 0; lane < PHILOX_LANES; ++lane) {
+                u64 p0 = (u64) 0xD2511F53 * c0[lane];
+                u64 p1 = (u64) 0xCD9E8D57 * c2[lane];
+                u32 n0 = (u32) (p1 >> 32) ^ c1[lane] ^ k0;
+                u32 n2 = (u32) (p0 >> 32) ^ c3[lane] ^ k1;
+                c1[lane] = (u32) p1;
+                c3[lane] = (u32) p0;
+                c0[lane] = n0;
+                c2[lane] = n2;
+            }
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+
+        u64 lanes = count - base < PHILOX_LANES ? count - base : PHILOX_LANES;
+        for (u64 lane = 0; lane < lanes; ++lane) {
+            u32 *words = out + (base + lane) * 4;
+            words[0] = c0[lane];
+            words[1] = c1[lane];
+            words[2] = c2[lane];
+            words[3] = c3[lane];
+        }
+    }
+}
+
+u32 philox_next(PhiloxStream &stream) {
+    u64 block = stream.position / 4;
+    if (!stream.has_cache || stream.cached_block != block) {
+        philox_blocks(stream.key, block, 1, stream.cached);
+        stream.cached_block = block;
+        stream.has_cache = true;
+    }
+    return stream.cached[stream.position++ % 4];
+}
+
+void seed_philox(PhiloxStream &stream, u64 seed) {
+    stream = {};
+    stream.key[0] = (u32) seed;
+    stream.key[1] = (u32) (seed >> 32);
+}
+
+inline float philox_unit(u32 bits) {
+    return (bits >> 8) * (1.0f / 16777216.0f); // [0, 1)
+}
+
+float philox_between(PhiloxStream &stream, float low, float high) {
+    return low + philox_unit(philox_next(stream)) * (high - low);
+}
+
+struct RngFill {
+    u32 key[2];
+    u64 first; // stream position of out[0]
+    u64 count;
+    float *out;
+    float low, scale;
+};
+
+// Covers values [begin * 4, end * 4) of the fill, blocks are relative to its start.
+void run_rng_fill(void *data, u64 begin, u64 end) {
+    RngFill *fill = (RngFill *) data;
+    u32 words[(RNG_FILL_GRAIN + 1) * 4]; // a chunk that starts mid block spills into one more
+
+    for (u64 chunk = begin; chunk < end; chunk += RNG_FILL_GRAIN) {
+        u64 chunk_end = chunk + RNG_FILL_GRAIN < end ? chunk + RNG_FILL_GRAIN : end;
+
+        // The fill may start in the middle of a block, so each value looks up its own word.
+        u64 value_begin = chunk * 4, value_end = chunk_end * 4;
+        if (value_end > fill->count) value_end = fill->count;
+        u64 first_block = (fill->first + value_begin) / 4;
+        u64 last_block = (fill->first + value_end - 1) / 4;
+        philox_blocks(fill->key, first_block, last_block - first_block + 1, words);
+
+        u64 skip = (fill->first + value_begin) % 4;
+        for (u64 i = value_begin; i < value_end; ++i) {
+            fill->out[i] = fill->low + philox_unit(words[skip + i - value_begin]) * fill->scale;
+        }
+    }
+}
+
+// Fills out[0, count) with the stream's next values in [low, high).
+void philox_fill(PhiloxStream &stream, float *out, u64 count, float low, float high) {
+    if (count == 0) return;
+
+    RngFill fill = {{stream.key[0], stream.key[1]}, stream.position, count, out, low, high - low};
+    u64 blocks = (count + 3) / 4;
+    if (count < RNG_PARALLEL_THRESHOLD) {
+        run_rng_fill(&fill, 0, blocks);
+    } else {
+        JobCounter *counter = parallel_for(blocks, RNG_FILL_GRAIN, run_rng_fill, &fill);
+        wait_jobs(counter);
+        free_jobs(counter);
+    }
+    stream.position += count;
+}
+
+PhiloxStream *check_rng_stream(lua_State *L) {
+    return (PhiloxStream *) luaL_checkudata(L, 1, RNG_STREAM_META);
+}
+
+FloatBuffer *check_float_buffer(lua_State *L, int arg) {
+    return (FloatBuffer *) luaL_checkudata(L, arg, RNG_BUFFER_META);
+}
+
+// rng.stream(seed) -> stream, the same seed always gives the same values
+int lua_rng_stream(lua_State *L) {
+    lua_Integer seed = luaL_checkinteger(L, 1);
+    PhiloxStream *stream = (PhiloxStream *) lua_newuserdatauv(L, sizeof(PhiloxStream), 0);
+    seed_philox(*stream, seed);
+    luaL_setmetatable(L, RNG_STREAM_META);
+    return 1;
+}
+
+// rng.buffer(count) -> packed float buffer for fill()/fill_v2(), read with buffer[i]
+int lua_rng_buffer(lua_State *L) {
+    lua_Integer count = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, count >= 0, 1, "count can't be negative");
+
+    u64 size = sizeof(FloatBuffer) + (count > 0 ? count - 1 : 0) * sizeof(float);
+    FloatBuffer *buffer = (FloatBuffer *) lua_newuserdatauv(L, size, 0);
+    buffer->count = count;
+    memset(buffer->values, 0, count * sizeof(float));
+    luaL_setmetatable(L, RNG_BUFFER_META);
+    return 1;
+}
+
+int lua_stream_randf(lua_State *L) {
+    lua_pushnumber(L, philox_unit(philox_next(*check_rng_stream(L))));
+    return 1;
+}
+
+int lua_stream_randi(lua_State *L) {
+    lua_pushinteger(L, philox_next(*check_rng_stream(L)));
+    return 1;
+}
+
+int lua_stream_randb(lua_State *L) {
+    lua_pushboolean(L, philox_next(*check_rng_stream(L)) & 1);
+    return 1;
+}
+
+// stream:randi_between(low, high) -> integer in [low, high]
+int lua_stream_randi_between(lua_State *L) {
+    PhiloxStream *stream = check_rng_stream(L);
+    lua_Integer low = luaL_checkinteger(L, 2);
+    lua_Integer high = luaL_checkinteger(L, 3);
+    if (high < low) {
+        RETURN_ERROR(L, "Expected low <= high");
+    }
+
+    u64 range = (u64) (high - low) + 1;
+    lua_pushinteger(L, low + (lua_Integer) (((u64) philox_next(*stream) * range) >> 32));
+    return 1;
+}
+
+// stream:randf_between(low, high) -> number in [low, high)
+int lua_stream_randf_between(lua_State *L) {
+    PhiloxStream *stream = check_rng_stream(L);
+    float low = luaL_checknumber(L, 2);
+    float high = luaL_checknumber(L, 3);
+    lua_pushnumber(L, philox_between(*stream, low, high));
+    return 1;
+}
+
+// stream:fill(buffer, [low, high], [first, count]) fills buffer[first .. first + count - 1],
+// all of it by default, with numbers in [low, high), 0 to 1 by default.
+int lua_stream_fill(lua_State *L) {
+    PhiloxStream *stream = check_rng_stream(L);
+    FloatBuffer *buffer = check_float_buffer(L, 2);
+    float low = luaL_optnumber(L, 3, 0.0);
+    float high = luaL_optnumber(L, 4, 1.0);
+    lua_Integer first = luaL_optinteger(L, 5, 1);
+    lua_Integer count = luaL_optinteger(L, 6, (lua_Integer) buffer->count - first + 1);
+    if (first < 1 || count < 0 || (u64) (first - 1 + count) > buffer->count) {
+        RETURN_ERROR(L, "The range to fill is outside of the buffer");
+    }
+
+    philox_fill(*stream, buffer->values + first - 1, count, low, high);
+    return 0;
+}
+
+// stream:fill_v2(buffer, min, max) fills the buffer with packed x, y pairs inside the
+// rect from v2 min to v2 max. The buffer needs an even length.
+int lua_stream_fill_v2(lua_State *L) {
+    PhiloxStream *stream = check_rng_stream(L);
+    FloatBuffer *buffer = check_float_buffer(L, 2);
+    if (buffer->count % 2 != 0) {
+        RETURN_ERROR(L, "fill_v2 needs a buffer with an even length");
+    }
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_getfield(L, 3, "x");
+    lua_getfield(L, 3, "y");
+    lua_getfield(L, 4, "x");
+    lua_getfield(L, 4, "y");
+    Vector2 min(luaL_checknumber(L, -4), luaL_checknumber(L, -3));
+    Vector2 max(luaL_checknumber(L, -2), luaL_checknumber(L, -1));
+    lua_pop(L, 4);
+
+    // x and y are filled as 0 to 1 in one pass and then scaled per axis.
+    philox_fill(*stream, buffer->values, buffer->count, 0.0f, 1.0f);
+    float *values = buffer->values;
+    u64 pairs = buffer->count / 2;
+    for (u64 i = 0; i < pairs; ++i) {
+        values[i * 2] = min.x + values[i * 2] * (max.x - min.x);
+        values[i * 2 + 1] = min.y + values[i * 2 + 1] * (max.y - min.y);
+    }
+    return 0;
+}
+
+// stream:seek(position) jumps to the position-th value, 0 is the start of the stream.
+int lua_stream_seek(lua_State *L) {
+    PhiloxStream *stream = check_rng_stream(L);
+    lua_Integer position = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, position >= 0, 2, "position can't be negative");
+    stream->position = position;
+    return 0;
+}
+
+int lua_stream_position(lua_State *L) {
+    lua_pushinteger(L, check_rng_stream(L)->position);
+    return 1;
+}
+
+int lua_float_buffer_len(lua_State *L) {
+    lua_pushinteger(L, check_float_buffer(L, 1)->count);
+    return 1;
+}
+
+int lua_float_buffer_index(lua_State *L) {
+    FloatBuffer *buffer = check_float_buffer(L, 1);
+    int is_integer;
+    lua_Integer index = lua_tointegerx(L, 2, &is_integer);
+    if (!is_integer || index < 1 || (u64) index > buffer->count) return 0;
+    lua_pushnumber(L, buffer->values[index - 1]);
+    return 1;
+}
+
+int lua_float_buffer_newindex(lua_State *L) {
+    FloatBuffer *buffer = check_float_buffer(L, 1);
+    lua_Integer index = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, index >= 1 && (u64) index <= buffer->count, 2, "index out of range");
+    buffer->values[index - 1] = luaL_checknumber(L, 3);
+    return 0;
+}
+
+void bind_rng_to_lua(lua_State *L) {
+    luaL_newmetatable(L, RNG_STREAM_META);
+    lua_pushvalue(L, -1); lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_stream_randf); lua_setfield(L, -2, "randf");
+    lua_pushcfunction(L, lua_stream_randi); lua_setfield(L, -2, "randi");
+    lua_pushcfunction(L, lua_stream_randb); lua_setfield(L, -2, "randb");
+    lua_pushcfunction(L, lua_stream_randi_between); lua_setfield(L, -2, "randi_between");
+    lua_pushcfunction(L, lua_stream_randf_between); lua_setfield(L, -2, "randf_between");
+    lua_pushcfunction(L, lua_stream_fill); lua_setfield(L, -2, "fill");
+    lua_pushcfunction(L, lua_stream_fill_v2); lua_setfield(L, -2, "fill_v2");
+    lua_pushcfunction(L, lua_stream_seek); lua_setfield(L, -2, "seek");
+    lua_pushcfunction(L, lua_stream_position); lua_setfield(L, -2, "position");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, RNG_BUFFER_META);
+    lua_pushcfunction(L, lua_float_buffer_len); lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_float_buffer_index); lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_float_buffer_newindex); lua_setfield(L, -2, "__newindex");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_rng_stream); lua_setfield(L, -2, "stream");
+    lua_pushcfunction(L, lua_rng_buffer); lua_setfield(L, -2, "buffer");
+    lua_setglobal(L, "rng");
+}
+
+int lua_alloc_id(lua_State *L) {
+    lua_pushinteger(L, alloc_id().id);
+    return 1;
+}
+
+// Cast jobs started by Jobs.run() read physics.objects on the workers while Lua holds
+// on to their handle. Everything that changes physics waits for them first.
+DArray<JobCounter *> physics_readers;
+
+void settle_physics_jobs() {
+    for (JobCounter *counter : physics_readers) {
+        wait_jobs(counter);
+    }
+    physics_readers.resize(halloc, 0);
+}
+
+int lua_physics_get(lua_State *L) {
+    ID id;
+    id.id = luaL_checkinteger(L, 1);
+
+    const pp::PhysicsObject *obj = physics.objects.get(id);
+
+    lua_newtable(L);
+    if (obj == nullptr) {
+        push_v2(L, obj->aabb.position); lua_setfield(L, -2, "position");
+        push_v2(L, obj->aabb.size); lua_setfield(L, -2, "size");
+        lua_pushinteger(L, obj->layer); lua_setfield(L, -1, "layer");
+        lua_pushinteger(L, obj->mask); lua_setfield(L, -1, "mask");
+        lua_pushinteger(L, obj->type); lua_setfield(L, -1, "type");
+    }
+
+    return 1;
+}
+
+int lua_physics_move(lua_State *L) {
+    ID id;
+    id.id = luaL_checkinteger(L, 1);
+
+    lua_getfield(L, 2, "x");
+    float x = luaL_checknumber(L, -1);
+    lua_getfield(L, 2, "y");
+    float y = luaL_checknumber(L, -1);
+    lua_pop(L, 2);
+
+    settle_physics_jobs();
+    lua_pushinteger(L, physics.move_actor(id, {x, y}).id);
+    return 1;
+}
+
+int lua_physics_create(lua_State *L) {
+    ID id;
+    lua_getfield(L, 1, "id");
+    id.id = luaL_checkinteger(L, -1);
+
+    Vector2 position, size;
+    load_v2(L, position, "position", 1);
+    load_v2(L, size, "size", 1);
+
+    lua_getfield(L, 1, "layer");
+    int layer = luaL_optinteger(L, -1, 1);
+
+    lua_getfield(L, 1, "mask");
+    int mask = luaL_optinteger(L, -1, 1);
+
+    lua_getfield(L, 1, "type");
+    int type = luaL_optinteger(L, -1, 0);
+
+    settle_physics_jobs();
+    physics.objects.insert(id, {{position, size}, (pp::PhysicsObject::Type) type, mask, layer});
+
+    return 0;
+}
+
+int lua_physics_destroy(lua_State *L) {
+    ID id;
+    id.id = luaL_checkinteger(L, 1);
+
+    settle_physics_jobs();
+    physics.objects.erase(id);
+
+    return 0;
+}
+
+int lua_physics_aabb_cast(lua_State *L) {
+    Vector2 position, size;
+    load_v2(L, position, "position", 1);
+    load_v2(L, size, "size", 1);
+
+    lua_getfield(L, 1, "mask");
+    int mask = luaL_checkinteger(L, -1);
+
+    lua_pushinteger(L, physics.aabb_cast({position, size}, mask).id);
+    return 1;
+}
+
+int lua_physics_ray_cast(lua_State *L) {
+    Vector2 start, finish;
+    load_v2(L, start, "start", 1);
+    load_v2(L, finish, "finish", 1);
+
+    lua_getfield(L, 1, "mask");
+    int mask = luaL_checkinteger(L, -1);
+
+    lua_pushinteger(L, physics.ray_cast(start, finish, mask).id);
+    return 1;
+}
+
+int lua_physics_circle_cast(lua_State *L) {
+    Vector2 center;
+    load_v2(L, center, "center", 1);
+
+    lua_getfield(L, 1, "radius");
+    float radius = luaL_checknumber(L, -1);
+
+    lua_getfield(L, 1, "mask");
+    int mask = luaL_checkinteger(L, -1);
+
+    lua_pushinteger(L, physics.circle_cast(center, radius, mask).id);
+    return 1;
+}
+
+int lua_physics_debug(lua_State *L) {
+    auto &renderer = WM::get_main_window()->get_renderers()[0];
+    physics.debug_draw(renderer);
+    return 0;
+}
+
+// Kernels are the only way Lua can put work on the job system, the Lua state itself
+// never leaves the main thread. `prepare` copies the arguments out of Lua, `run`
+// is called on worker threads and `finish` pushes the results back and frees.
+struct JobKernel {
+    const char *name;
+    u64 grain;
+    bool reads_physics;
+    void *(*prepare)(lua_State *L, int arg, u64 *count);
+    void (*run)(void *data, u64 begin, u64 end);
+    void (*finish)(lua_State *L, void *data);
+};
+
+struct CastQuery {
+    Vector2 start, finish;
+    int mask;
+    u64 hit;
+};
+
+struct CastBatch {
+    DArray<CastQuery> queries;
+};
+
+Vector2 check_v2_field(lua_State *L, int arg, const char *name) {
+    if (lua_getfield(L, arg, name) != LUA_TTABLE) {
+        luaL_error(L, "'%s' must be a table {x: number, y: number}", name);
+    }
+
+    Vector2 vector;
+    lua_getfield(L, -1, "x");
+    vector.x = luaL_checknumber(L, -1);
+    lua_getfield(L, -2, "y");
+    vector.y = luaL_checknumber(L, -1);
+    lua_pop(L, 3);
+    return vector;
+}
+
+CastQuery read_cast_query(lua_State *L, int arg, lua_Integer i) {
+    lua_rawgeti(L, arg, i);
+    int query = lua_gettop(L);
+
+    CastQuery q = {};
+    if (lua_getfield(L, query, "start") == LUA_TTABLE) {
+        q.start = check_v2_field(L, query, "start");
+        q.finish = check_v2_field(L, query, "finish");
+    } else {
+        q.start = check_v2_field(L, query, "position");
+        q.finish = check_v2_field(L, query, "size");
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, query, "mask");
+    q.mask = luaL_optinteger(L, -1, 1);
+    lua_pop(L, 2);
+    return q;
+}
+
+void *prepare_cast_batch(lua_State *L, int arg, u64 *count) {
+    luaL_checktype(L, arg, LUA_TTABLE);
+
+    // Every query is checked before the batch exists, a Lua error would leak it.
+    lua_Integer len = luaL_len(L, arg);
+    for (lua_Integer i = 1; i <= len; ++i) {
+        read_cast_query(L, arg, i);
+    }
+
+    CastBatch *batch = new CastBatch;
+    for (lua_Integer i = 1; i <= len; ++i) {
+        batch->queries.push(halloc, read_cast_query(L, arg, i));
+    }
+
+    *count = batch->queries.size();
+    return batch;
+}
+
+void run_ray_casts(void *data, u64 begin, u64 end) {
+    CastBatch *batch = (CastBatch *) data;
+    for (u64 i = begin; i < end; ++i) {
+        CastQuery &q = batch->queries[i];
+        q.hit = physics.ray_cast(q.start, q.finish, q.mask).id;
+    }
+}
+
+void run_aabb_casts(void *data, u64 begin, u64 end) {
+    CastBatch *batch = (CastBatch *) data;
+    for (u64 i = begin; i < end; ++i) {
+        CastQuery &q = batch->queries[i];
+        q.hit = physics.aabb_cast({q.start, q.finish}, q.mask).id;
+    }
+}
+
+void finish_cast_batch(lua_State *L, void *data) {
+    CastBatch *batch = (CastBatch *) data;
+
+    lua_createtable(L, batch->queries.size(), 0);
+    for (u64 i = 0; i < batch->queries.size(); ++i) {
+        lua_pushinteger(L, batch->queries[i].hit);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    batch->queries.free();
+    delete batch;
+}
+
+static const JobKernel job_kernels[] = {
+    {"ray_cast", 64, true, prepare_cast_batch, run_ray_casts, finish_cast_batch},
+    {"aabb_cast", 64, true, prepare_cast_batch, run_aabb_casts, finish_cast_batch},
+};
+
+const JobKernel *find_job_kernel(const char *name) {
+    for (const JobKernel &kernel : job_kernels) {
+        if (strcmp(kernel.name, name) == 0) return &kernel;
+    }
+    return nullptr;
+}
+
+#define JOB_HANDLE_META "Lovial.JobHandle"
+
+struct LuaJob {
+    JobCounter *counter;
+    const JobKernel *kernel;
+    void *data;
+};
+
+// Waits for the job and stores the results as the handle's user value so wait() can
+// be called any number of times.
+void settle_lua_job(lua_State *L, int handle) {
+    LuaJob *job = (LuaJob *) luaL_checkudata(L, handle, JOB_HANDLE_META);
+    if (!job->counter) return;
+
+    wait_jobs(job->counter);
+    for (u64 i = 0; i < physics_readers.size(); ++i) {
+        if (physics_readers[i] == job->counter) {
+            physics_readers[i] = physics_readers.back();
+            physics_readers.pop();
+            break;
+        }
+    }
+    free_jobs(job->counter);
+    job->counter = nullptr;
+
+    job->kernel->finish(L, job->data);
+    lua_setiuservalue(L, handle, 1);
+}
+
+int lua_job_wait(lua_State *L) {
+    settle_lua_job(L, 1);
+    lua_getiuservalue(L, 1, 1);
+    return 1;
+}
+
+int lua_job_done(lua_State *L) {
+    LuaJob *job = (LuaJob *) luaL_checkudata(L, 1, JOB_HANDLE_META);
+    lua_pushboolean(L, !job->counter || jobs_done(job->counter));
+    return 1;
+}
+
+int lua_job_gc(lua_State *L) {
+    settle_lua_job(L, 1);
+    return 0;
+}
+
+int lua_jobs_run(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    const JobKernel *kernel = find_job_kernel(name);
+    if (!kernel) {
+        LOG_ERROR("No job kernel named '%'", name);
+        return luaL_error(L, "No job kernel named '%s'", name);
+    }
+
+    u64 count = 0;
+    void *data = kernel->prepare(L, 2, &count);
+
+    LuaJob *job = (LuaJob *) lua_newuserdatauv(L, sizeof(LuaJob), 1);
+    job->counter = parallel_for(count, kernel->grain, kernel->run, data);
+    if (kernel->reads_physics) physics_readers.push(halloc, job->counter);
+    job->kernel = kernel;
+    job->data = data;
+    luaL_setmetatable(L, JOB_HANDLE_META);
+
+    return 1;
+}
+
+int lua_jobs_stats(lua_State *L) {
+    i64 depth = 0;
+    for (int i = 0; jobs.deques && i < jobs.thread_count; ++i) {
+        depth += jobs.deques[i].depth();
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, jobs.thread_count - 1); lua_setfield(L, -2, "workers");
+    lua_pushinteger(L, jobs.jobs_run.load()); lua_setfield(L, -2, "jobs");
+    lua_pushinteger(L, jobs.steals.load()); lua_setfield(L, -2, "steals");
+    lua_pushnumber(L, jobs.idle_ns.load() / 1e9); lua_setfield(L, -2, "idle");
+    lua_pushinteger(L, depth); lua_setfield(L, -2, "queue_depth");
+    lua_pushinteger(L, jobs.max_depth.load()); lua_setfield(L, -2, "max_queue_depth");
+    return 1;
+}
+
+// Physics.ray_cast_many{{start = v2(), finish = v2(), mask = 1}, ...} -> {hit_id, ...}
+int lua_physics_ray_cast_many(lua_State *L) {
+    u64 count = 0;
+    void *data = prepare_cast_batch(L, 1, &count);
+
+    JobCounter *counter = parallel_for(count, 64, run_ray_casts, data);
+    wait_jobs(counter);
+    free_jobs(counter);
+
+    finish_cast_batch(L, data);
+    return 1;
+}
+
+// Physics.aabb_cast_many{{position = v2(), size = v2(), mask = 1}, ...} -> {hit_id, ...}
+int lua_physics_aabb_cast_many(lua_State *L) {
+    u64 count = 0;
+    void *data = prepare_cast_batch(L, 1, &count);
+
+    JobCounter *counter = parallel_for(count, 64, run_aabb_casts, data);
+    wait_jobs(counter);
+    free_jobs(counter);
+
+    finish_cast_batch(L, data);
+    return 1;
+}
+
+void bind_physics_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_physics_get); lua_setfield(L, -2, "get");
+    lua_pushcfunction(L, lua_physics_move); lua_setfield(L, -2, "move");
+    lua_pushcfunction(L, lua_physics_create); lua_setfield(L, -2, "create");
+    lua_pushcfunction(L, lua_physics_destroy); lua_setfield(L, -2, "destroy");
+    lua_pushcfunction(L, lua_physics_aabb_cast); lua_setfield(L, -2, "aabb_cast");
+    lua_pushcfunction(L, lua_physics_ray_cast); lua_setfield(L, -2, "ray_cast");
+    lua_pushcfunction(L, lua_physics_circle_cast); lua_setfield(L, -2, "circle_cast");
+    lua_pushcfunction(L, lua_physics_ray_cast_many); lua_setfield(L, -2, "ray_cast_many");
+    lua_pushcfunction(L, lua_physics_aabb_cast_many); lua_setfield(L, -2, "aabb_cast_many");
+    lua_pushcfunction(L, lua_physics_debug); lua_setfield(L, -2, "debug");
+
+    lua_pushinteger(L, (int) pp::PhysicsObject::Type::Actor); lua_setfield(L, -2, "Actor");
+    lua_pushinteger(L, (int) pp::PhysicsObject::Type::Solid); lua_setfield(L, -2, "Solid");
+
+    lua_setglobal(L, "Physics");
+}
+
+void bind_jobs_to_lua(lua_State *L) {
+    luaL_newmetatable(L, JOB_HANDLE_META);
+    lua_pushvalue(L, -1); lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_job_wait); lua_setfield(L, -2, "wait");
+    lua_pushcfunction(L, lua_job_done); lua_setfield(L, -2, "done");
+    lua_pushcfunction(L, lua_job_gc); lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_jobs_run); lua_setfield(L, -2, "run");
+    lua_pushcfunction(L, lua_jobs_stats); lua_setfield(L, -2, "stats");
+    lua_setglobal(L, "Jobs");
+}
+
+// Raw input events with the time Lovial saw them, so inputs between frames keep their
+// order and spacing. Events collect while the window dispatches them and move to the
+// readable buffer when the frame's simulation starts.
+
+struct InputEvent {
+    int type;
+    int action; // key or button, -1 for mouse movement and scrolling
+    float x, y; // mouse position
+    u64 time_ns;
+};
+
+#define INPUT_EVENT_STRIDE 5
+
+struct InputStream {
+    DArray<InputEvent> incoming;
+    DArray<InputEvent> frame;
+
+    int table_ref = LUA_NOREF;
+    u64 table_length;
+    bool table_filled;
+
+    double latency_avg, latency_max; // last frame, seconds
+    double latency_total;
+    u64 latency_events;
+};
+
+InputStream input_stream;
+
+void record_input_event(void *, Event &event) {
+    InputEvent input;
+    input.type = event.type;
+    input.action = -1;
+    input.time_ns = monotonic_ns();
+
+    switch (event.type) {
+    case Events::KEY_PRESSED_ID: input.action = (int) ((Events::KeyPressed &) event).keycode; break;
+    case Events::KEY_RELEASED_ID: input.action = (int) ((Events::KeyReleased &) event).keycode; break;
+    case Events::MOUSE_BUTTON_PRESSED_ID:
+    case Events::MOUSE_BUTTON_RELEASED_ID: input.action = event_mouse_button(event); break;
+    default: break;
+    }
+
+    Vector2 position = Input::get_mouse_position();
+    input.x = position.x;
+    input.y = position.y;
+    input_stream.incoming.push(halloc, input);
+}
+
+void poll_input_events(Events::PreUpdate &) {
+    DArray<InputEvent> frame = input_stream.frame;
+    input_stream.frame = input_stream.incoming;
+    input_stream.incoming = frame;
+    input_stream.incoming.resize(halloc, 0);
+    input_stream.table_filled = false;
+}
+
+// Measured when a script first reads the frame's events, that's when they're consumed.
+void measure_input_latency() {
+    u64 now = monotonic_ns();
+    input_stream.latency_avg = input_stream.latency_max = 0.0;
+    for (const InputEvent &input : input_stream.frame) {
+        double latency = (now - input.time_ns) * 1e-9;
+        input_stream.latency_avg += latency;
+        if (latency > input_stream.latency_max) input_stream.latency_max = latency;
+    }
+
+    if (input_stream.frame.size() > 0) {
+        input_stream.latency_total += input_stream.latency_avg;
+        input_stream.latency_events += input_stream.frame.size();
+        input_stream.latency_avg /= input_stream.frame.size();
+    }
+}
+
+// Input.events() -> events, count. `events` is one flat table reused every frame,
+// event i (from 0) is at [i * 5 + 1] .. [i * 5 + 5] as type, action, x, y, time_ns.
+int lua_input_events(lua_State *L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, input_stream.table_ref);
+
+    if (!input_stream.table_filled) {
+        measure_input_latency();
+
+        u64 length = 0;
+        for (const InputEvent &input : input_stream.frame) {
+            lua_pushinteger(L, input.type); lua_rawseti(L, -2, ++length);
+            lua_pushinteger(L, input.action); lua_rawseti(L, -2, ++length);
+            lua_pushnumber(L, input.x); lua_rawseti(L, -2, ++length);
+            lua_pushnumber(L, input.y); lua_rawseti(L, -2, ++length);
+            lua_pushinteger(L, input.time_ns); lua_rawseti(L, -2, ++length);
+        }
+
+        for (u64 i = length + 1; i <= input_stream.table_length; ++i) {
+            lua_pushnil(L);
+            lua_rawseti(L, -2, i);
+        }
+        input_stream.table_length = length;
+        input_stream.table_filled = true;
+    }
+
+    lua_pushinteger(L, input_stream.frame.size());
+    return 2;
+}
+
+// Input.now() -> the monotonic clock events are stamped with, in nanoseconds
+int lua_input_now(lua_State *L) {
+    lua_pushinteger(L, monotonic_ns());
+    return 1;
+}
+
+// Input.latency() -> {avg, max, overall} seconds from an event arriving to the first
+// Input.events() call that returns it, for the last frame and averaged over the whole run
+int lua_input_latency(lua_State *L) {
+    lua_createtable(L, 0, 3);
+    lua_pushnumber(L, input_stream.latency_avg); lua_setfield(L, -2, "avg");
+    lua_pushnumber(L, input_stream.latency_max); lua_setfield(L, -2, "max");
+    lua_pushnumber(L, input_stream.latency_events ? input_stream.latency_total / input_stream.latency_events : 0.0);
+    lua_setfield(L, -2, "overall");
+    return 1;
+}
+
+void bind_input_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_is_pressed); lua_setfield(L, -2, "is_pressed");
+    lua_pushcfunction(L, lua_is_typed); lua_setfield(L, -2, "is_typed");
+    lua_pushcfunction(L, lua_is_just_pressed); lua_setfield(L, -2, "is_just_pressed");
+    lua_pushcfunction(L, lua_is_just_released); lua_setfield(L, -2, "is_just_released");
+    lua_pushcfunction(L, lua_string_typed); lua_setfield(L, -2, "string_typed");
+    lua_pushcfunction(L, lua_get_axis); lua_setfield(L, -2, "get_axis");
+    lua_pushcfunction(L, lua_get_direction); lua_setfield(L, -2, "get_direction");
+    lua_pushcfunction(L, lua_mouse_position); lua_setfield(L, -2, "mouse_position");
+    lua_pushcfunction(L, lua_mouse_delta); lua_setfield(L, -2, "mouse_delta");
+    lua_pushcfunction(L, lua_input_events); lua_setfield(L, -2, "events");
+    lua_pushcfunction(L, lua_input_now); lua_setfield(L, -2, "now");
+    lua_pushcfunction(L, lua_input_latency); lua_setfield(L, -2, "latency");
+    lua_setglobal(L, "Input");
+
+    lua_newtable(L);
+    input_stream.table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    int recorded[] = {
+        Events::KEY_PRESSED_ID, Events::KEY_RELEASED_ID,
+        Events::MOUSE_BUTTON_PRESSED_ID, Events::MOUSE_BUTTON_RELEASED_ID,
+        Events::MOUSE_MOVED_ID, Events::MOUSE_SCROLLED_ID,
+    };
+    for (int type : recorded) {
+        WM::get_main_window()->get_viewport()->push_system(type, record_input_event, nullptr);
+    }
+}
+
+void bind_time_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_delta); lua_setfield(L, -2, "delta");
+    lua_pushcfunction(L, lua_alpha); lua_setfield(L, -2, "alpha");
+    lua_pushcfunction(L, lua_fixed_delta); lua_setfield(L, -2, "fixed_delta");
+    lua_pushcfunction(L, lua_fixed_stats); lua_setfield(L, -2, "fixed_stats");
+    lua_setglobal(L, "Time");
+}
+
+// Coroutine scheduler. spawn() runs a function as a coroutine that may call wait(),
+// wait_frames() or wait_event() to sleep. Sleepers sit in the timer wheel or in a
+// per-frame bucket, so a frame only costs as much as the coroutines that wake up.
+// Finished threads are reset and handed out again by the next spawn().
+
+#define FRAME_BUCKETS 64 // must be a power of two
+
+struct Coroutine {
+    lua_State *thread;
+    int ref; // keeps the thread alive in the registry
+    bool alive;
+    bool parked; // set by the wait functions right before they yield
+};
+
+struct EventWaiters {
+    int event;
+    DArray<u32> waiting;
+};
+
+struct Scheduler {
+    lua_State *L = nullptr;
+    DArray<Coroutine> coroutines;
+    DArray<u32> free_coroutines;
+
+    TimerWheel sleeping;
+    double clock = 0.0;
+
+    u64 frame = 0;
+    DArray<u32> frame_buckets[FRAME_BUCKETS];
+    DArray<u64> frame_targets[FRAME_BUCKETS];
+
+    DArray<EventWaiters *> event_waiters;
+
+    DArray<u32> ready; // reused every frame
+};
+
+Scheduler scheduler;
+
+u32 coroutine_of(lua_State *L) {
+    return (u32) *(intptr_t *) lua_getextraspace(L);
+}
+
+// Logs the error if there was one and hands the thread back to the pool.
+void finish_coroutine(u32 index, int status) {
+    lua_State *L = scheduler.L;
+    lua_State *co = scheduler.coroutines[index].thread;
+
+    if (status != LUA_OK) {
+        luaL_traceback(L, co, lua_tostring(co, -1), 0);
+        LOG_ERROR("ERROR: coroutine failed: %", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+
+    lua_closethread(co, L);
+    scheduler.coroutines[index].alive = false;
+    scheduler.free_coroutines.push(halloc, index);
+}
+
+u32 acquire_coroutine(lua_State *L) {
+    u32 index;
+    if (scheduler.free_coroutines.size() > 0) {
+        index = scheduler.free_coroutines.back();
+        scheduler.free_coroutines.pop();
+    } else {
+        index = scheduler.coroutines.size();
+
+        lua_State *thread = lua_newthread(L);
+        int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        *(intptr_t *) lua_getextraspace(thread) = index + 1;
+        scheduler.coroutines.push(halloc, {thread, ref, false, false});
+    }
+
+    scheduler.coroutines[index].alive = true;
+    return index;
+}
+
+void resume_coroutine(u32 index, int nargs) {
+    lua_State *L = scheduler.L;
+    lua_State *co = scheduler.coroutines[index].thread;
+
+    scheduler.coroutines[index].parked = false;
+
+    int nresults = 0;
+    int status = lua_resume(co, L, nargs, &nresults);
+    if (status == LUA_YIELD) {
+        lua_pop(co, nresults);
+        if (!scheduler.coroutines[index].parked) {
+            // A plain coroutine.yield() just sleeps until the next frame.
+            u32 bucket = (scheduler.frame + 1) & (FRAME_BUCKETS - 1);
+            scheduler.frame_buckets[bucket].push(halloc, index);
+            scheduler.frame_targets[bucket].push(halloc, scheduler.frame + 1);
+        }
+        return;
+    }
+
+    finish_coroutine(index, status);
+}
+
+u32 check_waiting_coroutine(lua_State *L, const char *fn) {
+    u32 index = coroutine_of(L);
+    if (index == 0 || !lua_isyieldable(L)) {
+        luaL_error(L, "%s() can only be called from a coroutine started with spawn()", fn);
+    }
+    scheduler.coroutines[index - 1].parked = true;
+    return index - 1;
+}
+
+int lua_spawn(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int nargs = lua_gettop(L) - 1;
+
+    u32 index = acquire_coroutine(L);
+    lua_xmove(L, scheduler.coroutines[index].thread, nargs + 1);
+    resume_coroutine(index, nargs);
+    return 0;
+}
+
+int lua_wait(lua_State *L) {
+    u32 index = check_waiting_coroutine(L, "wait");
+    double seconds = luaL_checknumber(L, 1);
+
+    u64 wake = seconds_to_wheel_ticks(scheduler.clock + seconds);
+    scheduler.sleeping.add(wake, index);
+    return lua_yield(L, 0);
+}
+
+int lua_wait_frames(lua_State *L) {
+    u32 index = check_waiting_coroutine(L, "wait_frames");
+    lua_Integer frames = luaL_optinteger(L, 1, 1);
+    if (frames < 1) frames = 1;
+
+    u64 target = scheduler.frame + frames;
+    u32 bucket = target & (FRAME_BUCKETS - 1);
+    scheduler.frame_buckets[bucket].push(halloc, index);
+    scheduler.frame_targets[bucket].push(halloc, target);
+    return lua_yield(L, 0);
+}
+
+void wake_event_waiters(EventWaiters *waiters, int type) {
+    if (waiters->waiting.size() == 0) return;
+
+    // Swap the list out first, a woken coroutine may wait on this event again.
+    DArray<u32> waking = waiters->waiting;
+    waiters->waiting = {};
+
+    for (u32 index : waking) {
+        lua_pushinteger(scheduler.coroutines[index].thread, type);
+        resume_coroutine(index, 1);
+    }
+    waking.free();
+}
+
+void on_wait_event(void *user_data, Event &event) {
+    wake_event_waiters((EventWaiters *) user_data, event.type);
+}
+
+// Custom events come from emit() rather than the viewport.
+void on_wait_emitted(const EmittedEvent &event, void *user_data) {
+    wake_event_waiters((EventWaiters *) user_data, event.id);
+}
+
+// FixedUpdate is ticked by run_fixed_update, the viewport never sends it.
+void on_wait_fixed_tick(void *user_data) {
+    wake_event_waiters((EventWaiters *) user_data, FIXED_UPDATE_ID);
+}
+
+int lua_wait_event(lua_State *L) {
+    u32 index = check_waiting_coroutine(L, "wait_event");
+    int event = luaL_checkinteger(L, 1);
+
+    EventWaiters *waiters = nullptr;
+    for (EventWaiters *it : scheduler.event_waiters) {
+        if (it->event == event) waiters = it;
+    }
+
+    if (!waiters) {
+        waiters = static_new(EventWaiters{event, {}});
+        scheduler.event_waiters.push(halloc, waiters);
+        if (event == FIXED_UPDATE_ID) {
+            fixed_step.on_tick = on_wait_fixed_tick;
+            fixed_step.on_tick_data = waiters;
+        } else if (event >= LOVIAL_FIRST_CUSTOM_ID) {
+            subscribe_event(event, on_wait_emitted, waiters);
+        } else {
+            WM::get_main_window()->get_viewport()->push_system(event, on_wait_event, waiters);
+        }
+    }
+
+    waiters->waiting.push(halloc, index);
+    return lua_yield(L, 0);
+}
+
+void run_scheduler(Events::PreUpdate &) {
+    scheduler.frame++;
+    scheduler.clock += Time::delta();
+
+    scheduler.ready.resize(halloc, 0);
+    scheduler.sleeping.advance(seconds_to_wheel_ticks(scheduler.clock), scheduler.ready);
+
+    // Waits longer than the bucket ring go around again until their frame comes up.
+    u32 bucket = scheduler.frame & (FRAME_BUCKETS - 1);
+    DArray<u32> &waiting = scheduler.frame_buckets[bucket];
+    DArray<u64> &targets = scheduler.frame_targets[bucket];
+    for (u64 i = 0; i < waiting.size(); ++i) {
+        if (targets[i] <= scheduler.frame) {
+            scheduler.ready.push(halloc, waiting[i]);
+            waiting[i] = waiting.back();
+            targets[i] = targets.back();
+            waiting.pop();
+            targets.pop();
+            i--;
+        }
+    }
+
+    for (u32 index : scheduler.ready) {
+        resume_coroutine(index, 0);
+    }
+}
+
+int lua_coroutine_stats(lua_State *L) {
+    u64 waiting_events = 0;
+    for (EventWaiters *it : scheduler.event_waiters) {
+        waiting_events += it->waiting.size();
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, scheduler.coroutines.size() - scheduler.free_coroutines.size()); lua_setfield(L, -2, "alive");
+    lua_pushinteger(L, scheduler.free_coroutines.size()); lua_setfield(L, -2, "pooled");
+    lua_pushinteger(L, scheduler.sleeping.active); lua_setfield(L, -2, "sleeping");
+    lua_pushinteger(L, waiting_events); lua_setfield(L, -2, "waiting_events");
+    return 1;
+}
+
+void bind_scheduler_to_lua(lua_State *L) {
+    scheduler.L = L;
+
+    // Threads copy the main thread's extra space, zero means "not one of ours".
+    *(intptr_t *) lua_getextraspace(L) = 0;
+
+    bind_function(L, "spawn", lua_spawn);
+    bind_function(L, "wait", lua_wait);
+    bind_function(L, "wait_frames", lua_wait_frames);
+    bind_function(L, "wait_event", lua_wait_event);
+    bind_function(L, "coroutine_stats", lua_coroutine_stats);
+}
+
+// Deferred work. Schedule.idle() tasks are coroutines from the spawn() pool that run
+// after the frame's update, until the frame's idle budget is spent. A count hook
+// checks the clock every IDLE_HOOK_INSTRUCTIONS instructions and yields a task that
+// runs past the budget, it picks up where it left off next frame. Schedule.stagger()
+// calls a function for a slice of a list every frame so the whole list is covered
+// once every n frames.
+
+#define IDLE_HOOK_INSTRUCTIONS 1000
+
+struct IdleTask {
+    u32 coroutine;
+    int nargs; // only the first resume passes arguments
+};
+
+struct StaggeredJob {
+    int list_ref, fn_ref;
+    u32 frames;
+    u64 cursor; // next 1 based index into the list
+    u32 generation;
+    bool active;
+};
+
+struct DeferredWork {
+    lua_State *L = nullptr;
+    double budget_ms = 2.0;
+    u64 deadline_ns = 0;
+
+    DArray<IdleTask> idle;
+    u64 idle_head = 0;
+
+    DArray<StaggeredJob> staggered;
+    DArray<u32> free_staggered;
+
+    double used_ms = 0.0;   // idle time spent last frame
+    u64 hook_yields = 0;    // tasks stopped by the budget, over the whole run
+    u64 completed = 0;
+};
+
+DeferredWork deferred;
+
+void idle_budget_hook(lua_State *L, lua_Debug *) {
+    if (monotonic_ns() >= deferred.deadline_ns && lua_isyieldable(L)) {
+        deferred.hook_yields++;
+        lua_yield(L, 0);
+    }
+}
+
+// Schedule.idle(fn, ...) runs fn(...) in leftover frame time, possibly over several frames.
+int lua_schedule_idle(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    int nargs = lua_gettop(L) - 1;
+
+    u32 index = acquire_coroutine(L);
+    lua_xmove(L, scheduler.coroutines[index].thread, nargs + 1);
+    deferred.idle.push(halloc, {index, nargs});
+    return 0;
+}
+
+lua_Integer staggered_to_lua(u32 index) {
+    return ((lua_Integer) deferred.staggered[index].generation << 32) | index;
+}
+
+// Schedule.stagger(list, fn, n) -> handle, calls fn(item, i) for every item of list
+// once every n frames. The list is read live, items can be added and removed.
+int lua_schedule_stagger(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_Integer frames = luaL_optinteger(L, 3, 1);
+    if (frames < 1) frames = 1;
+
+    u32 index;
+    if (deferred.free_staggered.size() > 0) {
+        index = deferred.free_staggered.back();
+        deferred.free_staggered.pop();
+    } else {
+        index = deferred.staggered.size();
+        deferred.staggered.push(halloc, {});
+    }
+
+    StaggeredJob &job = deferred.staggered[index];
+    lua_pushvalue(L, 1);
+    job.list_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 2);
+    job.fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    job.frames = frames;
+    job.cursor = 1;
+    job.active = true;
+
+    lua_pushinteger(L, staggered_to_lua(index));
+    return 1;
+}
+
+int lua_schedule_cancel(lua_State *L) {
+    lua_Integer handle = luaL_checkinteger(L, 1);
+    u32 index = handle & 0xffffffff;
+
+    bool found = index < deferred.staggered.size() && deferred.staggered[index].active &&
+                 deferred.staggered[index].generation == (u32) (handle >> 32);
+    if (found) {
+        StaggeredJob &job = deferred.staggered[index];
+        luaL_unref(L, LUA_REGISTRYINDEX, job.list_ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, job.fn_ref);
+        job.active = false;
+        job.generation++;
+        deferred.free_staggered.push(halloc, index);
+    }
+
+    lua_pushboolean(L, found);
+    return 1;
+}
+
+int lua_schedule_set_budget(lua_State *L) {
+    double ms = luaL_checknumber(L, 1);
+    deferred.budget_ms = ms > 0.0 ? ms : 0.0;
+    return 0;
+}
+
+// Schedule.pending() -> table with how much deferred work is still queued.
+int lua_schedule_pending(lua_State *L) {
+    u64 items = 0;
+    u64 jobs = 0;
+    for (StaggeredJob &job : deferred.staggered) {
+        if (!job.active) continue;
+        jobs++;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, job.list_ref);
+        u64 length = lua_rawlen(L, -1);
+        lua_pop(L, 1);
+        if (length >= job.cursor) items += length - job.cursor + 1;
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, deferred.idle.size() - deferred.idle_head); lua_setfield(L, -2, "idle");
+    lua_pushinteger(L, jobs); lua_setfield(L, -2, "staggered");
+    lua_pushinteger(L, items); lua_setfield(L, -2, "stagger_items");
+    lua_pushnumber(L, deferred.used_ms); lua_setfield(L, -2, "used_ms");
+    lua_pushnumber(L, deferred.budget_ms); lua_setfield(L, -2, "budget_ms");
+    lua_pushinteger(L, deferred.hook_yields); lua_setfield(L, -2, "budget_yields");
+    lua_pushinteger(L, deferred.completed); lua_setfield(L, -2, "completed");
+    return 1;
+}
+
+void run_staggered_jobs(lua_State *L) {
+    for (u64 i = 0; i < deferred.staggered.size(); ++i) {
+        // Copied, a callback may cancel its own job or start new ones.
+        StaggeredJob job = deferred.staggered[i];
+        if (!job.active) continue;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, job.list_ref);
+        u64 length = lua_rawlen(L, -1);
+        u64 slice = (length + job.frames - 1) / job.frames;
+        u64 end = job.cursor + slice;
+        if (end > length + 1) end = length + 1;
+
+        for (u64 item = job.cursor; item < end; ++item) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, job.fn_ref);
+            lua_rawgeti(L, -2, item);
+            lua_pushinteger(L, item);
+            if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+                LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+
+        StaggeredJob &live = deferred.staggered[i];
+        if (live.active && live.generation == job.generation) {
+            live.cursor = end > length ? 1 : end;
+        }
+    }
+}
+
+void run_idle_tasks(lua_State *L) {
+    u64 start = monotonic_ns();
+    deferred.deadline_ns = start + (u64) (deferred.budget_ms * 1e6);
+
+    // Tasks that yield on their own go to the back, so one task can't starve the rest.
+    u64 end = deferred.idle.size();
+    while (deferred.idle_head < end && monotonic_ns() < deferred.deadline_ns) {
+        IdleTask task = deferred.idle[deferred.idle_head++];
+        lua_State *co = scheduler.coroutines[task.coroutine].thread;
+        scheduler.coroutines[task.coroutine].parked = false;
+
+        u64 yields = deferred.hook_yields;
+        lua_sethook(co, idle_budget_hook, LUA_MASKCOUNT, IDLE_HOOK_INSTRUCTIONS);
+        int nresults = 0;
+        int status = lua_resume(co, L, task.nargs, &nresults);
+        lua_sethook(co, lua_gethook(L), lua_gethookmask(L), lua_gethookcount(L));
+
+        if (status == LUA_YIELD) {
+            lua_pop(co, nresults);
+            // A task that called wait() belongs to the coroutine scheduler from now on.
+            if (scheduler.coroutines[task.coroutine].parked) continue;
+
+            task.nargs = 0;
+            if (deferred.hook_yields != yields) {
+                // Out of budget, it goes first next frame.
+                deferred.idle[--deferred.idle_head] = task;
+                break;
+            }
+            deferred.idle.push(halloc, task);
+            continue;
+        }
+
+        finish_coroutine(task.coroutine, status);
+        deferred.completed++;
+    }
+
+    // Drop the finished front of the queue.
+    u64 remaining = deferred.idle.size() - deferred.idle_head;
+    for (u64 i = 0; i < remaining; ++i) {
+        deferred.idle[i] = deferred.idle[deferred.idle_head + i];
+    }
+    deferred.idle.resize(halloc, remaining);
+    deferred.idle_head = 0;
+
+    deferred.used_ms = (monotonic_ns() - start) / 1e6;
+}
+
+// Runs after the update systems so idle tasks only get the time the frame has left.
+void run_deferred_work(Events::PostUpdate &) {
+    lua_State *L = deferred.L;
+    run_staggered_jobs(L);
+    if (deferred.idle.size() > 0) {
+        run_idle_tasks(L);
+    } else {
+        deferred.used_ms = 0.0;
+    }
+}
+
+void bind_deferred_work_to_lua(lua_State *L) {
+    deferred.L = L;
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_schedule_idle); lua_setfield(L, -2, "idle");
+    lua_pushcfunction(L, lua_schedule_stagger); lua_setfield(L, -2, "stagger");
+    lua_pushcfunction(L, lua_schedule_cancel); lua_setfield(L, -2, "cancel");
+    lua_pushcfunction(L, lua_schedule_set_budget); lua_setfield(L, -2, "set_budget");
+    lua_pushcfunction(L, lua_schedule_pending); lua_setfield(L, -2, "pending");
+    lua_setglobal(L, "Schedule");
+}
+
+// Timer service. Timers live in their own wheel and only the ones that expire cost
+// anything, their callbacks are all called in one pass during PreUpdate.
+
+struct Timer {
+    int fn_ref;
+    u64 period; // in wheel ticks, zero for one shot timers
+    u64 started, expires;
+    TimerHandle node;
+    u32 generation;
+    bool active;
+};
+
+struct TimerService {
+    lua_State *L = nullptr;
+    TimerWheel wheel;
+    double clock = 0.0;
+
+    DArray<Timer> timers;
+    DArray<u32> free_timers;
+    DArray<u32> fired;   // reused every frame
+    DArray<u32> retired; // freed once the current batch is done
+    bool dispatching = false;
+};
+
+TimerService timer_service;
+
+lua_Integer timer_to_lua(u32 index) {
+    return ((lua_Integer) timer_service.timers[index].generation << 32) | index;
+}
+
+Timer *timer_from_lua(lua_State *L, int arg) {
+    lua_Integer handle = luaL_checkinteger(L, arg);
+    u32 index = handle & 0xffffffff;
+    if (index >= timer_service.timers.size()) return nullptr;
+
+    Timer *timer = &timer_service.timers[index];
+    if (!timer->active || timer->generation != (u32) (handle >> 32)) return nullptr;
+    return timer;
+}
+
+void retire_timer(u32 index) {
+    Timer &timer = timer_service.timers[index];
+    timer_service.wheel.remove(timer.node);
+    luaL_unref(timer_service.L, LUA_REGISTRYINDEX, timer.fn_ref);
+    timer.active = false;
+    timer.generation++;
+
+    // A slot can't be handed out again while the fired list may still point at it.
+    if (timer_service.dispatching) {
+        timer_service.retired.push(halloc, index);
+    } else {
+        timer_service.free_timers.push(halloc, index);
+    }
+}
+
+int create_timer(lua_State *L, bool repeat) {
+    double seconds = luaL_checknumber(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    u32 index;
+    if (timer_service.free_timers.size() > 0) {
+        index = timer_service.free_timers.back();
+        timer_service.free_timers.pop();
+    } else {
+        index = timer_service.timers.size();
+        timer_service.timers.push(halloc, {});
+    }
+
+    lua_pushvalue(L, 2);
+    int fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    u64 ticks = seconds_to_wheel_ticks(seconds);
+    Timer &timer = timer_service.timers[index];
+    timer.fn_ref = fn_ref;
+    timer.period = repeat ? (ticks > 0 ? ticks : 1) : 0;
+    timer.started = timer_service.wheel.now;
+    timer.expires = timer.started + ticks;
+    timer.node = timer_service.wheel.add(timer.expires, index);
+    timer.active = true;
+
+    lua_pushinteger(L, timer_to_lua(index));
+    return 1;
+}
+
+// Timers.after(seconds, fn) -> handle, calls fn(handle) once
+int lua_timers_after(lua_State *L) {
+    return create_timer(L, false);
+}
+
+// Timers.every(seconds, fn) -> handle, calls fn(handle) every `seconds` until cancelled
+int lua_timers_every(lua_State *L) {
+    return create_timer(L, true);
+}
+
+int lua_timers_cancel(lua_State *L) {
+    Timer *timer = timer_from_lua(L, 1);
+    if (timer) retire_timer(timer - &timer_service.timers[0]);
+    lua_pushboolean(L, timer != nullptr);
+    return 1;
+}
+
+// Timers.restart(handle, [seconds]) starts the timer over, optionally with a new length.
+int lua_timers_restart(lua_State *L) {
+    Timer *timer = timer_from_lua(L, 1);
+    if (!timer) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    // One shot timers remember their length through the time they were started at.
+    u64 length = timer->period ? timer->period : timer->expires - timer->started;
+    if (!lua_isnoneornil(L, 2)) {
+        length = seconds_to_wheel_ticks(luaL_checknumber(L, 2));
+        if (timer->period) timer->period = length > 0 ? length : 1;
+    }
+
+    timer_service.wheel.remove(timer->node);
+    timer->started = timer_service.wheel.now;
+    timer->expires = timer->started + length;
+    timer->node = timer_service.wheel.add(timer->expires, timer - &timer_service.timers[0]);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+int lua_timers_remaining(lua_State *L) {
+    Timer *timer = timer_from_lua(L, 1);
+    if (!timer || timer->expires <= timer_service.wheel.now) {
+        lua_pushnumber(L, 0.0);
+        return 1;
+    }
+
+    lua_pushnumber(L, (timer->expires - timer_service.wheel.now) / 1000.0);
+    return 1;
+}
+
+int lua_timers_now(lua_State *L) {
+    lua_pushnumber(L, timer_service.clock);
+    return 1;
+}
+
+int lua_timers_count(lua_State *L) {
+    lua_pushinteger(L, timer_service.wheel.active);
+    return 1;
+}
+
+void run_timers(Events::PreUpdate &) {
+    lua_State *L = timer_service.L;
+    timer_service.clock += Time::delta();
+
+    timer_service.fired.resize(halloc, 0);
+    timer_service.wheel.advance(seconds_to_wheel_ticks(timer_service.clock), timer_service.fired);
+    if (timer_service.fired.size() == 0) return;
+
+    timer_service.dispatching = true;
+    for (u32 index : timer_service.fired) {
+        Timer &timer = timer_service.timers[index];
+        if (!timer.active) continue;
+
+        lua_Integer handle = timer_to_lua(index);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, timer.fn_ref);
+
+        if (timer.period) {
+            // Rescheduled off the last expiry rather than now so repeats don't drift.
+            // A frame longer than the period skips the missed repeats instead of firing
+            // them one frame at a time until it has caught up.
+            timer.started = timer.expires;
+            timer.expires += timer.period;
+            if (timer.expires <= timer_service.wheel.now) {
+                u64 missed = (timer_service.wheel.now - timer.expires) / timer.period + 1;
+                timer.started += missed * timer.period;
+                timer.expires += missed * timer.period;
+            }
+            timer.node = timer_service.wheel.add(timer.expires, index);
+        } else {
+            retire_timer(index);
+        }
+
+        lua_pushinteger(L, handle);
+        if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+            LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    timer_service.dispatching = false;
+
+    for (u32 index : timer_service.retired) {
+        timer_service.free_timers.push(halloc, index);
+    }
+    timer_service.retired.resize(halloc, 0);
+}
+
+void bind_timers_to_lua(lua_State *L) {
+    timer_service.L = L;
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_timers_after); lua_setfield(L, -2, "after");
+    lua_pushcfunction(L, lua_timers_every); lua_setfield(L, -2, "every");
+    lua_pushcfunction(L, lua_timers_cancel); lua_setfield(L, -2, "cancel");
+    lua_pushcfunction(L, lua_timers_restart); lua_setfield(L, -2, "restart");
+    lua_pushcfunction(L, lua_timers_remaining); lua_setfield(L, -2, "remaining");
+    lua_pushcfunction(L, lua_timers_now); lua_setfield(L, -2, "now");
+    lua_pushcfunction(L, lua_timers_count); lua_setfield(L, -2, "count");
+    lua_setglobal(L, "Timers");
+}
+
+// Asynchronous file I/O. fs.read_async() and fs.write_async() queue requests for a
+// dedicated I/O thread, so scripts never block a frame on the disk. The job workers
+// aren't used for this, a slow disk would hold up everything queued behind it. Finished
+// requests wait in a completion list and their callbacks are called during PreUpdate,
+// right after the timers.
+//
+// Reads can be handed to Lua as a byte buffer that takes over the I/O thread's memory
+// instead of copying it into a string. Writes go to "<path>.tmp", are flushed and then
+// renamed over the target, so a crash mid-save never leaves a truncated file behind.
+
+#define BYTES_META "Lovial.Bytes"
+
+enum IORequestKind {
+    IO_READ,
+    IO_WRITE,
+};
+
+struct IORequest {
+    int kind;
+    char *path;
+    u8 *data; // what to write, or what was read
+    u64 size;
+    int fn_ref; // LUA_NOREF when there's no callback
+    bool as_bytes;
+    int error; // errno, zero when it worked
+};
+
+struct ByteBuffer {
+    u8 *data;
+    u64 size;
+};
+
+struct IOQueue {
+    lua_State *L = nullptr;
+    std::thread thread;
+    bool started = false;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    bool running = false;
+    DArray<IORequest *> queued;
+    DArray<IORequest *> done;
+
+    DArray<IORequest *> completed; // swapped with done every frame
+    u64 in_flight = 0;
+
+    ~IOQueue() {
+        stop();
+    }
+
+    void stop() {
+        if (!started) return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running = false;
+        }
+        wake.notify_one();
+        thread.join();
+        started = false;
+    }
+};
+
+IOQueue io_queue;
+
+void read_file_request(IORequest *request) {
+    FILE *file = fopen(request->path, "rb");
+    if (!file) {
+        request->error = errno;
+        return;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < 0) {
+        request->error = errno;
+        fclose(file);
+        return;
+    }
+
+    request->data = (u8 *) malloc(size > 0 ? size : 1);
+    request->size = fread(request->data, 1, size, file);
+    if (request->size != (u64) size) request->error = ferror(file) ? EIO : 0;
+    fclose(file);
+}
+
+void write_file_request(IORequest *request) {
+    char temp[1024];
+    int length = snprintf(temp, sizeof(temp), "%s.tmp", request->path);
+    if (length < 0 || (u64) length >= sizeof(temp)) {
+        request->error = ENAMETOOLONG;
+        return;
+    }
+
+    FILE *file = fopen(temp, "wb");
+    if (!file) {
+        request->error = errno;
+        return;
+    }
+
+    errno = 0;
+    bool written = fwrite(request->data, 1, request->size, file) == request->size && fflush(file) == 0;
+#ifndef _WIN32
+    // Make sure the bytes are on disk before the rename makes them the real file.
+    if (written) written = fsync(fileno(file)) == 0;
+#endif
+    if (!written) request->error = errno ? errno : EIO;
+    fclose(file);
+
+    if (request->error) {
+        remove(temp);
+        return;
+    }
+
+    // Replaces an existing file in one step on Windows too, unlike rename().
+    std::error_code error;
+    std::filesystem::rename(temp, request->path, error);
+    if (error) {
+        request->error = error.value();
+        remove(temp);
+    }
+}
+
+void io_thread_main() {
+    DArray<IORequest *> batch = {};
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(io_queue.lock);
+            io_queue.wake.wait(guard, [] { return !io_queue.running || io_queue.queued.size() > 0; });
+            if (!io_queue.running) break;
+
+            DArray<IORequest *> swap = io_queue.queued;
+            io_queue.queued = batch;
+            batch = swap;
+        }
+
+        for (IORequest *request : batch) {
+            if (request->kind == IO_READ) {
+                read_file_request(request);
+            } else {
+                write_file_request(request);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(io_queue.lock);
+            for (IORequest *request : batch) io_queue.done.push(halloc, request);
+        }
+        batch.resize(halloc, 0);
+    }
+    batch.free();
+}
+
+void submit_io_request(IORequest *request) {
+    if (!io_queue.started) {
+        io_queue.running = true;
+        io_queue.started = true;
+        io_queue.thread = std::thread(io_thread_main);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(io_queue.lock);
+        io_queue.queued.push(halloc, request);
+    }
+    io_queue.in_flight++;
+    io_queue.wake.notify_one();
+}
+
+IORequest *new_io_request(lua_State *L, int kind, const char *path, int fn_arg) {
+    // Checked before allocating, the type error would leak the request.
+    bool has_fn = !lua_isnoneornil(L, fn_arg);
+    if (has_fn) luaL_checktype(L, fn_arg, LUA_TFUNCTION);
+
+    IORequest *request = (IORequest *) calloc(1, sizeof(IORequest));
+    request->kind = kind;
+    request->path = strdup(path);
+    request->fn_ref = LUA_NOREF;
+    if (has_fn) {
+        lua_pushvalue(L, fn_arg);
+        request->fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    return request;
+}
+
+void free_io_request(IORequest *request) {
+    free(request->path);
+    free(request->data);
+    free(request);
+}
+
+// fs.read_async(path, fn, [{bytes = true}]) calls fn(data) once the file is read, or
+// fn(nil, error). With bytes the data is a byte buffer instead of a string.
+int lua_fs_read_async(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    bool as_bytes = false;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "bytes");
+        as_bytes = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    IORequest *request = new_io_request(L, IO_READ, path, 2);
+    request->as_bytes = as_bytes;
+    submit_io_request(request);
+    return 0;
+}
+
+// fs.write_async(path, data, [fn]) replaces the file with data, a string or byte buffer,
+// then calls fn(true) or fn(false, error).
+int lua_fs_write_async(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+
+    const u8 *data;
+    size_t size;
+    ByteBuffer *buffer = (ByteBuffer *) luaL_testudata(L, 2, BYTES_META);
+    if (buffer) {
+        data = buffer->data;
+        size = buffer->size;
+    } else {
+        data = (const u8 *) luaL_checklstring(L, 2, &size);
+    }
+
+    // Lua may collect or change the data before the I/O thread gets to it.
+    IORequest *request = new_io_request(L, IO_WRITE, path, 3);
+    request->data = (u8 *) malloc(size > 0 ? size : 1);
+    memcpy(request->data, data, size);
+    request->size = size;
+    submit_io_request(request);
+    return 0;
+}
+
+// fs.pending() -> requests that haven't had their callback called yet
+int lua_fs_pending(lua_State *L) {
+    lua_pushinteger(L, io_queue.in_flight);
+    return 1;
+}
+
+void push_io_result(lua_State *L, IORequest *request) {
+    if (request->error) {
+        if (request->kind == IO_READ) {
+            lua_pushnil(L);
+        } else {
+            lua_pushboolean(L, false);
+        }
+        lua_pushfstring(L, "%s: %s", request->path, strerror(request->error));
+        return;
+    }
+
+    if (request->kind == IO_WRITE) {
+        lua_pushboolean(L, true);
+        lua_pushnil(L);
+        return;
+    }
+
+    if (request->as_bytes) {
+        ByteBuffer *buffer = (ByteBuffer *) lua_newuserdatauv(L, sizeof(ByteBuffer), 0);
+        buffer->data = request->data;
+        buffer->size = request->size;
+        request->data = nullptr; // the buffer owns it now
+        luaL_setmetatable(L, BYTES_META);
+    } else {
+        lua_pushlstring(L, (const char *) request->data, request->size);
+    }
+    lua_pushnil(L);
+}
+
+void deliver_io_completions(Events::PreUpdate &) {
+    if (io_queue.in_flight == 0) return;
+
+    {
+        std::lock_guard<std::mutex> guard(io_queue.lock);
+        DArray<IORequest *> swap = io_queue.done;
+        io_queue.done = io_queue.completed;
+        io_queue.completed = swap;
+    }
+
+    lua_State *L = io_queue.L;
+    for (IORequest *request : io_queue.completed) {
+        io_queue.in_flight--;
+
+        if (request->fn_ref != LUA_NOREF) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, request->fn_ref);
+            luaL_unref(L, LUA_REGISTRYINDEX, request->fn_ref);
+            push_io_result(L, request);
+            if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+                LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        } else if (request->error) {
+            LOG_ERROR("ERROR: could not write '%': %", request->path, strerror(request->error));
+        }
+
+        free_io_request(request);
+    }
+    io_queue.completed.resize(halloc, 0);
+}
+
+ByteBuffer *check_bytes(lua_State *L) {
+    return (ByteBuffer *) luaL_checkudata(L, 1, BYTES_META);
+}
+
+int lua_bytes_len(lua_State *L) {
+    lua_pushinteger(L, check_bytes(L)->size);
+    return 1;
+}
+
+int lua_bytes_gc(lua_State *L) {
+    ByteBuffer *buffer = check_bytes(L);
+    free(buffer->data);
+    buffer->data = nullptr;
+    buffer->size = 0;
+    return 0;
+}
+
+// bytes:byte(i) -> the unsigned byte at 1 based index i, nil past the end
+int lua_bytes_byte(lua_State *L) {
+    ByteBuffer *buffer = check_bytes(L);
+    lua_Integer index = luaL_checkinteger(L, 2);
+    if (index < 1 || (u64) index > buffer->size) return 0;
+    lua_pushinteger(L, buffer->data[index - 1]);
+    return 1;
+}
+
+// bytes:string([i], [j]) -> copy of bytes i to j as a string, like string.sub
+int lua_bytes_string(lua_State *L) {
+    ByteBuffer *buffer = check_bytes(L);
+    lua_Integer size = buffer->size;
+    lua_Integer first = luaL_optinteger(L, 2, 1);
+    lua_Integer last = luaL_optinteger(L, 3, -1);
+    if (first < 0) first = size + first + 1;
+    if (last < 0) last = size + last + 1;
+    if (first < 1) first = 1;
+    if (last > size) last = size;
+
+    if (first > last) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, (const char *) buffer->data + first - 1, last - first + 1);
+    }
+    return 1;
+}
+
+void bind_fs_to_lua(lua_State *L) {
+    io_queue.L = L;
+
+    luaL_newmetatable(L, BYTES_META);
+    lua_pushvalue(L, -1); lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_bytes_len); lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lua_bytes_gc); lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, lua_bytes_byte); lua_setfield(L, -2, "byte");
+    lua_pushcfunction(L, lua_bytes_string); lua_setfield(L, -2, "string");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_fs_read_async); lua_setfield(L, -2, "read_async");
+    lua_pushcfunction(L, lua_fs_write_async); lua_setfield(L, -2, "write_async");
+    lua_pushcfunction(L, lua_fs_pending); lua_setfield(L, -2, "pending");
+    lua_setglobal(L, "fs");
+}
+
+// Tweens. A tween is a group of one or more segments that all animate the same
+// native value, a plain tween has one segment while sequences and keyframed tracks
+// have one per step. Segments are stored as structure of arrays and evaluated in
+// branch free passes so the compiler can vectorize them. Lua only creates, cancels
+// and reads tweens, completion callbacks are called in one batch per frame.
+
+enum TweenEase : u8 {
+    EASE_LINEAR,
+    EASE_IN,
+    EASE_OUT,
+    EASE_IN_OUT,
+};
+
+struct TweenGroup {
+    float value;
+    float length; // sum of the segment durations, used when looping
+    u32 generation;
+    int on_done_ref;
+    bool active;
+    bool loop;
+    bool looped;
+    bool finished;
+};
+
+struct TweenSystem {
+    lua_State *L = nullptr;
+
+    // Segments, one entry per array.
+    DArray<float> from, to, elapsed, duration, t, out;
+    DArray<u8> ease, last;
+    DArray<u32> group, group_generation;
+
+    DArray<TweenGroup> groups;
+    DArray<u32> free_groups;
+    DArray<u32> completed;  // finished this frame, callbacks pending
+    DArray<u64> retiring;   // handles that finished last frame, released this frame
+};
+
+TweenSystem tweens;
+
+u64 tween_segment_count() {
+    return tweens.from.size();
+}
+
+void push_tween_segment(u32 group, float from, float to, float delay, float duration, TweenEase ease) {
+    tweens.from.push(halloc, from);
+    tweens.to.push(halloc, to);
+    tweens.elapsed.push(halloc, -delay);
+    tweens.duration.push(halloc, duration > 0.0f ? duration : 1e-6f);
+    tweens.t.push(halloc, 0.0f);
+    tweens.out.push(halloc, from);
+    tweens.ease.push(halloc, ease);
+    tweens.last.push(halloc, 0);
+    tweens.group.push(halloc, group);
+    tweens.group_generation.push(halloc, tweens.groups[group].generation);
+}
+
+u32 alloc_tween_group(float value) {
+    u32 index;
+    if (tweens.free_groups.size() > 0) {
+        index = tweens.free_groups.back();
+        tweens.free_groups.pop();
+    } else {
+        index = tweens.groups.size();
+        tweens.groups.push(halloc, {});
+    }
+
+    TweenGroup &group = tweens.groups[index];
+    group.value = value;
+    group.length = 0.0f;
+    group.on_done_ref = LUA_NOREF;
+    group.active = true;
+    group.loop = false;
+    group.looped = false;
+    group.finished = false;
+    return index;
+}
+
+void release_tween_group(u32 index) {
+    TweenGroup &group = tweens.groups[index];
+    if (!group.active) return;
+
+    luaL_unref(tweens.L, LUA_REGISTRYINDEX, group.on_done_ref);
+    group.active = false;
+    group.generation++; // orphans its segments, they are dropped on the next update
+    tweens.free_groups.push(halloc, index);
+}
+
+// Drops the segments of released groups while keeping each group's segments in order.
+void compact_tween_segments() {
+    u64 count = tween_segment_count();
+    u64 kept = 0;
+    for (u64 i = 0; i < count; ++i) {
+        const TweenGroup &group = tweens.groups[tweens.group[i]];
+        if (!group.active || group.finished || group.generation != tweens.group_generation[i]) continue;
+
+        if (kept != i) {
+            tweens.from[kept] = tweens.from[i];
+            tweens.to[kept] = tweens.to[i];
+            tweens.elapsed[kept] = tweens.elapsed[i];
+            tweens.duration[kept] = tweens.duration[i];
+            tweens.ease[kept] = tweens.ease[i];
+            tweens.last[kept] = tweens.last[i];
+            tweens.group[kept] = tweens.group[i];
+            tweens.group_generation[kept] = tweens.group_generation[i];
+        }
+        kept++;
+    }
+
+    if (kept == count) return;
+    tweens.from.resize(halloc, kept);
+    tweens.to.resize(halloc, kept);
+    tweens.elapsed.resize(halloc, kept);
+    tweens.duration.resize(halloc, kept);
+    tweens.t.resize(halloc, kept);
+    tweens.out.resize(halloc, kept);
+    tweens.ease.resize(halloc, kept);
+    tweens.last.resize(halloc, kept);
+    tweens.group.resize(halloc, kept);
+    tweens.group_generation.resize(halloc, kept);
+}
+
+float apply_ease(u8 ease, float t) {
+    switch (ease) {
+        case EASE_IN: return easers::in(t);
+        case EASE_OUT: return easers::out(t);
+        case EASE_IN_OUT: return easers::in_out(t);
+        default: return t;
+    }
+}
+
+void run_tweens(Events::PreUpdate &) {
+    lua_State *L = tweens.L;
+
+    // Finished tweens stay readable for the rest of the frame they finished in.
+    for (u64 handle : tweens.retiring) {
+        u32 index = handle & 0xffffffff;
+        if (tweens.groups[index].generation == (u32) (handle >> 32)) release_tween_group(index);
+    }
+    tweens.retiring.resize(halloc, 0);
+
+    compact_tween_segments();
+
+    u64 count = tween_segment_count();
+    if (count == 0) return;
+
+    float dt = Time::delta();
+
+    float *elapsed = &tweens.elapsed[0];
+    float *duration = &tweens.duration[0];
+    float *from = &tweens.from[0];
+    float *to = &tweens.to[0];
+    float *t = &tweens.t[0];
+    float *out = &tweens.out[0];
+
+    for (u64 i = 0; i < count; ++i) {
+        elapsed[i] += dt;
+        float x = elapsed[i] / duration[i];
+        t[i] = x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x);
+    }
+
+    for (u64 i = 0; i < count; ++i) {
+        if (tweens.ease[i] != EASE_LINEAR) t[i] = apply_ease(tweens.ease[i], t[i]);
+    }
+
+    for (u64 i = 0; i < count; ++i) {
+        out[i] = from[i] + (to[i] - from[i]) * t[i];
+    }
+
+    // Segments of a group are stored in order, so the latest one that has started wins.
+    bool any_looped = false;
+    for (u64 i = 0; i < count; ++i) {
+        if (elapsed[i] < 0.0f) continue;
+
+        TweenGroup &group = tweens.groups[tweens.group[i]];
+        group.value = out[i];
+
+        if (tweens.last[i] && elapsed[i] >= duration[i]) {
+            if (group.loop) {
+                group.looped = true;
+                any_looped = true;
+            } else {
+                group.finished = true;
+                tweens.completed.push(halloc, tweens.group[i]);
+            }
+        }
+    }
+
+    if (any_looped) {
+        for (u64 i = 0; i < count; ++i) {
+            TweenGroup &group = tweens.groups[tweens.group[i]];
+            if (group.looped) elapsed[i] -= group.length;
+        }
+        for (u64 i = 0; i < count; ++i) {
+            tweens.groups[tweens.group[i]].looped = false;
+        }
+    }
+
+    for (u32 index : tweens.completed) {
+        TweenGroup &group = tweens.groups[index];
+        u64 handle = ((u64) group.generation << 32) | index;
+        tweens.retiring.push(halloc, handle);
+        if (group.on_done_ref == LUA_NOREF) continue;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, group.on_done_ref);
+        lua_pushinteger(L, handle);
+        lua_pushnumber(L, group.value);
+        if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+            LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    tweens.completed.resize(halloc, 0);
+}
+
+TweenGroup *tween_from_lua(lua_State *L, int arg, u32 *out_index = nullptr) {
+    lua_Integer handle = luaL_checkinteger(L, arg);
+    u32 index = handle & 0xffffffff;
+    if (index >= tweens.groups.size()) return nullptr;
+
+    TweenGroup *group = &tweens.groups[index];
+    if (!group->active || group->generation != (u32) (handle >> 32)) return nullptr;
+    if (out_index) *out_index = index;
+    return group;
+}
+
+// Reads the options shared by every kind of tween and pushes the handle.
+int finish_tween(lua_State *L, u32 index, int options) {
+    TweenGroup &group = tweens.groups[index];
+
+    // New segments always go at the end, so the group's final one is the last one.
+    u64 count = tween_segment_count();
+    if (count == 0 || tweens.group[count - 1] != index || tweens.group_generation[count - 1] != group.generation) {
+        release_tween_group(index);
+        RETURN_ERROR(L, "A tween needs at least one step");
+    }
+    tweens.last[count - 1] = 1;
+
+    lua_getfield(L, options, "loop");
+    group.loop = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, options, "on_done");
+    if (lua_isfunction(L, -1)) {
+        group.on_done_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    lua_pushinteger(L, ((lua_Integer) group.generation << 32) | index);
+    return 1;
+}
+
+TweenEase check_ease(lua_State *L, int index) {
+    lua_Integer ease = luaL_optinteger(L, index, EASE_LINEAR);
+    if (ease < EASE_LINEAR || ease > EASE_IN_OUT) luaL_error(L, "Unknown ease %d", (int) ease);
+    return (TweenEase) ease;
+}
+
+// Tween.to{from = 0, to = 1, duration = 1, delay = 0, ease = Tween.Out, loop = false, on_done = fn} -> handle
+int lua_tween_to(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "from");
+    float from = luaL_optnumber(L, -1, 0.0);
+    lua_getfield(L, 1, "to");
+    float to = luaL_checknumber(L, -1);
+    lua_getfield(L, 1, "duration");
+    float duration = luaL_optnumber(L, -1, 1.0);
+    lua_getfield(L, 1, "delay");
+    float delay = luaL_optnumber(L, -1, 0.0);
+    lua_getfield(L, 1, "ease");
+    TweenEase ease = check_ease(L, -1);
+    lua_pop(L, 5);
+
+    u32 index = alloc_tween_group(from);
+    tweens.groups[index].length = delay + duration;
+    push_tween_segment(index, from, to, delay, duration, ease);
+    return finish_tween(L, index, 1);
+}
+
+struct TweenStep {
+    float to, duration, delay;
+    TweenEase ease;
+};
+
+// Reads step i of a sequence, raising a Lua error if it's malformed.
+TweenStep read_tween_step(lua_State *L, lua_Integer i) {
+    TweenStep step;
+    lua_rawgeti(L, 1, i);
+    luaL_checktype(L, -1, LUA_TTABLE);
+
+    lua_getfield(L, -1, "to");
+    step.to = luaL_checknumber(L, -1);
+    lua_getfield(L, -2, "duration");
+    step.duration = luaL_optnumber(L, -1, 1.0);
+    lua_getfield(L, -3, "delay");
+    step.delay = luaL_optnumber(L, -1, 0.0);
+    lua_getfield(L, -4, "ease");
+    step.ease = check_ease(L, -1);
+    lua_pop(L, 5);
+    return step;
+}
+
+// Tween.sequence{from = 0, {to = 1, duration = 0.2}, {to = 0, duration = 0.5, ease = Tween.In}, loop = true}
+// Every step starts where the previous one ended.
+int lua_tween_sequence(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "from");
+    float value = luaL_optnumber(L, -1, 0.0);
+    lua_pop(L, 1);
+
+    // Check every step before taking a group, an error halfway through would leak it.
+    lua_Integer steps = luaL_len(L, 1);
+    for (lua_Integer i = 1; i <= steps; ++i) {
+        read_tween_step(L, i);
+    }
+
+    u32 index = alloc_tween_group(value);
+    float start = 0.0f;
+
+    for (lua_Integer i = 1; i <= steps; ++i) {
+        TweenStep step = read_tween_step(L, i);
+
+        push_tween_segment(index, value, step.to, start + step.delay, step.duration, step.ease);
+        start += step.delay + step.duration;
+        value = step.to;
+    }
+
+    tweens.groups[index].length = start;
+    return finish_tween(L, index, 1);
+}
+
+// Tween.track{keys = {{0, 0}, {0.25, 1, Tween.Out}, {1, 0}}, loop = true}
+// Each key is {time, value, ease}, the ease shapes the curve leading into that key.
+int lua_tween_track(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (lua_getfield(L, 1, "keys") != LUA_TTABLE) {
+        RETURN_ERROR(L, "Expected a table {keys = {{time, value, ease}, ...}, loop = false} as the first argument");
+    }
+    int keys = lua_gettop(L);
+
+    lua_Integer count = luaL_len(L, keys);
+    if (count < 2) {
+        RETURN_ERROR(L, "A track needs at least two keys");
+    }
+
+    // Check every key before taking a group, an error halfway through would leak it.
+    lua_Number last_time = 0.0;
+    for (lua_Integer i = 1; i <= count; ++i) {
+        lua_rawgeti(L, keys, i);
+        luaL_checktype(L, -1, LUA_TTABLE);
+        lua_rawgeti(L, -1, 1);
+        lua_Number time = luaL_checknumber(L, -1);
+        if (i > 1 && time <= last_time) {
+            RETURN_ERROR(L, "Track key times must be strictly increasing");
+        }
+        last_time = time;
+        lua_rawgeti(L, -2, 2);
+        luaL_checknumber(L, -1);
+        lua_rawgeti(L, -3, 3);
+        check_ease(L, -1);
+        lua_pop(L, 4);
+    }
+
+    float previous_time = 0.0f, previous_value = 0.0f;
+    u32 index = 0;
+
+    for (lua_Integer i = 1; i <= count; ++i) {
+        lua_rawgeti(L, keys, i);
+        lua_rawgeti(L, -1, 1);
+        float time = lua_tonumber(L, -1);
+        lua_rawgeti(L, -2, 2);
+        float value = lua_tonumber(L, -1);
+        lua_rawgeti(L, -3, 3);
+        TweenEase ease = (TweenEase) luaL_optinteger(L, -1, EASE_LINEAR);
+        lua_pop(L, 4);
+
+        if (i == 1) {
+            index = alloc_tween_group(value);
+        } else {
+            push_tween_segment(index, previous_value, value, previous_time, time - previous_time, ease);
+        }
+        previous_time = time;
+        previous_value = value;
+    }
+    lua_pop(L, 1);
+
+    tweens.groups[index].length = previous_time;
+    return finish_tween(L, index, 1);
+}
+
+int lua_tween_value(lua_State *L) {
+    TweenGroup *group = tween_from_lua(L, 1);
+    if (!group) {
+        lua_pushvalue(L, 2); // the optional fallback, nil if not given
+        return 1;
+    }
+    lua_pushnumber(L, group->value);
+    return 1;
+}
+
+int lua_tween_done(lua_State *L) {
+    TweenGroup *group = tween_from_lua(L, 1);
+    lua_pushboolean(L, !group || group->finished);
+    return 1;
+}
+
+int lua_tween_cancel(lua_State *L) {
+    u32 index;
+    if (tween_from_lua(L, 1, &index)) release_tween_group(index);
+    return 0;
+}
+
+int lua_tween_count(lua_State *L) {
+    lua_pushinteger(L, tween_segment_count());
+    return 1;
+}
+
+void bind_tweens_to_lua(lua_State *L) {
+    tweens.L = L;
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_tween_to); lua_setfield(L, -2, "to");
+    lua_pushcfunction(L, lua_tween_sequence); lua_setfield(L, -2, "sequence");
+    lua_pushcfunction(L, lua_tween_track); lua_setfield(L, -2, "track");
+    lua_pushcfunction(L, lua_tween_value); lua_setfield(L, -2, "value");
+    lua_pushcfunction(L, lua_tween_done); lua_setfield(L, -2, "done");
+    lua_pushcfunction(L, lua_tween_cancel); lua_setfield(L, -2, "cancel");
+    lua_pushcfunction(L, lua_tween_count); lua_setfield(L, -2, "count");
+
+    lua_pushinteger(L, EASE_LINEAR); lua_setfield(L, -2, "Linear");
+    lua_pushinteger(L, EASE_IN); lua_setfield(L, -2, "In");
+    lua_pushinteger(L, EASE_OUT); lua_setfield(L, -2, "Out");
+    lua_pushinteger(L, EASE_IN_OUT); lua_setfield(L, -2, "InOut");
+
+    lua_setglobal(L, "Tween");
+}
+
+// Particles. Every emitter keeps its particles as structure of arrays, they are
+// integrated on the job system and drawn straight from native memory during Draw
+// without a single Lua call.
+
+#define PARTICLE_GRAIN 4096
+
+struct ParticleEmitter {
+    u32 generation;
+    bool active;
+
+    Vector2 position;
+    float rate; // particles per second, zero for bursts only
+    float spawn_accumulator;
+    float lifetime_min, lifetime_max;
+    float speed_min, speed_max;
+    float angle, spread; // radians
+    Vector2 gravity;
+    float drag;
+    Color color_start, color_end;
+    float size_start, size_end;
+    TextureID texture; // zero draws plain rects, otherwise size is the sprite's scale
+    int z_index;
+    u32 max_particles;
+    float dt; // the step the current integration pass runs with
+    PhiloxStream rng; // its own stream, so other random draws don't change its particles
+
+    DArray<float> x, y, vx, vy, age, lifetime;
+};
+
+u64 next_emitter_seed = 1;
+
+DArray<ParticleEmitter *> emitters;
+DArray<u32> free_emitters;
+
+u64 live_particles(ParticleEmitter *emitter) {
+    return emitter->x.size();
+}
+
+void spawn_particles(ParticleEmitter *emitter, u32 count, Vector2 position) {
+    u64 live = live_particles(emitter);
+    if (live + count > emitter->max_particles) {
+        count = emitter->max_particles > live ? emitter->max_particles - live : 0;
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+        float angle = emitter->angle + philox_between(emitter->rng, -emitter->spread * 0.5f, emitter->spread * 0.5f);
+        float speed = philox_between(emitter->rng, emitter->speed_min, emitter->speed_max);
+
+        emitter->x.push(halloc, position.x);
+        emitter->y.push(halloc, position.y);
+        emitter->vx.push(halloc, cosf(angle) * speed);
+        emitter->vy.push(halloc, sinf(angle) * speed);
+        emitter->age.push(halloc, 0.0f);
+        emitter->lifetime.push(halloc, philox_between(emitter->rng, emitter->lifetime_min, emitter->lifetime_max));
+    }
+}
+
+void integrate_particles(void *data, u64 begin, u64 end) {
+    ParticleEmitter *emitter = (ParticleEmitter *) data;
+    float dt = emitter->dt;
+    float gx = emitter->gravity.x * dt, gy = emitter->gravity.y * dt;
+    float damping = 1.0f - emitter->drag * dt;
+
+    float *x = &emitter->x[0], *y = &emitter->y[0];
+    float *vx = &emitter->vx[0], *vy = &emitter->vy[0];
+    float *age = &emitter->age[0];
+
+    for (u64 i = begin; i < end; ++i) {
+        vx[i] = (vx[i] + gx) * damping;
+        vy[i] = (vy[i] + gy) * damping;
+        x[i] += vx[i] * dt;
+        y[i] += vy[i] * dt;
+        age[i] += dt;
+    }
+}
+
+// Swap removes dead particles, order doesn't matter for drawing.
+void remove_dead_particles(ParticleEmitter *emitter) {
+    u64 count = live_particles(emitter);
+    for (u64 i = 0; i < count;) {
+        if (emitter->age[i] < emitter->lifetime[i]) {
+            ++i;
+            continue;
+        }
+
+        count--;
+        emitter->x[i] = emitter->x[count];
+        emitter->y[i] = emitter->y[count];
+        emitter->vx[i] = emitter->vx[count];
+        emitter->vy[i] = emitter->vy[count];
+        emitter->age[i] = emitter->age[count];
+        emitter->lifetime[i] = emitter->lifetime[count];
+    }
+
+    emitter->x.resize(halloc, count);
+    emitter->y.resize(halloc, count);
+    emitter->vx.resize(halloc, count);
+    emitter->vy.resize(halloc, count);
+    emitter->age.resize(halloc, count);
+    emitter->lifetime.resize(halloc, count);
+}
+
+void update_particles(Events::PreUpdate &) {
+    float dt = Time::delta();
+
+    // Start every emitter's integration before waiting on any of them.
+    DArray<JobCounter *> running;
+    for (ParticleEmitter *emitter : emitters) {
+        if (!emitter->active) continue;
+
+        if (emitter->rate > 0.0f) {
+            emitter->spawn_accumulator += emitter->rate * dt;
+            u32 spawn = (u32) emitter->spawn_accumulator;
+            emitter->spawn_accumulator -= spawn;
+            spawn_particles(emitter, spawn, emitter->position);
+        }
+
+        emitter->dt = dt;
+        if (live_particles(emitter) > 0) {
+            running.push(halloc, parallel_for(live_particles(emitter), PARTICLE_GRAIN, integrate_particles, emitter));
+        }
+    }
+
+    for (JobCounter *counter : running) {
+        wait_jobs(counter);
+        free_jobs(counter);
+    }
+    running.free();
+
+    for (ParticleEmitter *emitter : emitters) {
+        if (emitter->active) remove_dead_particles(emitter);
+    }
+}
+
+Color lerp_color(const Color &a, const Color &b, float t) {
+    Color result;
+    result.r = a.r + (b.r - a.r) * t;
+    result.g = a.g + (b.g - a.g) * t;
+    result.b = a.b + (b.b - a.b) * t;
+    result.a = a.a + (b.a - a.a) * t;
+    return result;
+}
+
+void draw_particles(void *, Event &) {
+    for (ParticleEmitter *emitter : emitters) {
+        if (!emitter->active) continue;
+
+        u64 count = live_particles(emitter);
+        for (u64 i = 0; i < count; ++i) {
+            float t = emitter->age[i] / emitter->lifetime[i];
+            float size = emitter->size_start + (emitter->size_end - emitter->size_start) * t;
+            float x = emitter->x[i], y = emitter->y[i];
+
+            if (!in_view({{x - size, y - size}, {size * 2.0f, size * 2.0f}})) continue;
+
+            if (emitter->texture.id) {
+                Sprite2DCmd cmd;
+                cmd.position = {x, y};
+                cmd.texture = emitter->texture;
+                cmd.color = lerp_color(emitter->color_start, emitter->color_end, t);
+                cmd.scale = {size, size};
+                cmd.rotation = 0.0f;
+                submit_cmd(cmd, emitter->z_index);
+            } else {
+                Rect2 rect = {{x - size * 0.5f, y - size * 0.5f}, {size, size}};
+                Rect2DCmd cmd;
+                cmd.set(rect);
+                cmd.color = lerp_color(emitter->color_start, emitter->color_end, t);
+                submit_cmd(cmd, rect, emitter->z_index);
+            }
+        }
+    }
+}
+
+ParticleEmitter *emitter_from_lua(lua_State *L, int arg) {
+    lua_Integer handle = luaL_checkinteger(L, arg);
+    u32 index = handle & 0xffffffff;
+    if (index >= emitters.size()) return nullptr;
+
+    ParticleEmitter *emitter = emitters[index];
+    if (!emitter->active || emitter->generation != (u32) (handle >> 32)) return nullptr;
+    return emitter;
+}
+
+void read_number_range(lua_State *L, int arg, const char *name, float *min, float *max, float fallback) {
+    lua_getfield(L, arg, name);
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        *min = luaL_checknumber(L, -1);
+        lua_rawgeti(L, -2, 2);
+        *max = luaL_checknumber(L, -1);
+        lua_pop(L, 2);
+    } else {
+        *min = *max = luaL_optnumber(L, -1, fallback);
+    }
+    lua_pop(L, 1);
+}
+
+// Particles.emitter{position = v2(), rate = 100, lifetime = {0.5, 1}, speed = {50, 100},
+//                   angle = 0, spread = math.pi * 2, gravity = v2(0, 200), drag = 0,
+//                   color_start = {}, color_end = {a = 0}, size_start = 4, size_end = 0,
+//                   texture = nil, z_index = 0, max = 10000, seed = nil} -> handle
+int lua_particles_emitter(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "Expected a table {position = v2(), rate = 0, lifetime = 1, speed = 100, ...} as the first argument");
+    }
+
+    // Everything is read before a slot is taken, any of it can raise an error and a
+    // half set up emitter would keep emitting with no handle to destroy it by.
+    ParticleEmitter parsed = {};
+    lua_getfield(L, 1, "position");
+    bool has_position = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (has_position) {
+        load_v2(L, parsed.position, "position", 1);
+    } else {
+        parsed.position = {0.0f, 0.0f};
+    }
+
+    lua_getfield(L, 1, "gravity");
+    bool has_gravity = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (has_gravity) {
+        load_v2(L, parsed.gravity, "gravity", 1);
+    } else {
+        parsed.gravity = {0.0f, 0.0f};
+    }
+
+    lua_getfield(L, 1, "rate");
+    parsed.rate = luaL_optnumber(L, -1, 0.0);
+    lua_getfield(L, 1, "angle");
+    parsed.angle = luaL_optnumber(L, -1, 0.0);
+    lua_getfield(L, 1, "spread");
+    parsed.spread = luaL_optnumber(L, -1, 6.2831853);
+    lua_getfield(L, 1, "drag");
+    parsed.drag = luaL_optnumber(L, -1, 0.0);
+    lua_getfield(L, 1, "size_start");
+    parsed.size_start = luaL_optnumber(L, -1, 4.0);
+    lua_getfield(L, 1, "size_end");
+    parsed.size_end = luaL_optnumber(L, -1, parsed.size_start);
+    lua_getfield(L, 1, "texture");
+    parsed.texture.id = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 1, "z_index");
+    parsed.z_index = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 1, "max");
+    parsed.max_particles = luaL_optinteger(L, -1, 10000);
+    lua_getfield(L, 1, "seed");
+    // Unseeded emitters are numbered in creation order, which is the same every run.
+    seed_philox(parsed.rng, luaL_optinteger(L, -1, next_emitter_seed++));
+    lua_pop(L, 10);
+
+    read_number_range(L, 1, "lifetime", &parsed.lifetime_min, &parsed.lifetime_max, 1.0);
+    read_number_range(L, 1, "speed", &parsed.speed_min, &parsed.speed_max, 100.0);
+
+    parsed.color_start = Color();
+    lua_getfield(L, 1, "color_start");
+    color_from_object(parsed.color_start, L);
+
+    parsed.color_end = parsed.color_start;
+    lua_getfield(L, 1, "color_end");
+    color_from_object(parsed.color_end, L);
+
+    u32 index;
+    if (free_emitters.size() > 0) {
+        index = free_emitters.back();
+        free_emitters.pop();
+    } else {
+        index = emitters.size();
+        emitters.push(halloc, new ParticleEmitter{});
+    }
+
+    // A reused slot keeps its generation and the (emptied) particle arrays it owns.
+    ParticleEmitter *emitter = emitters[index];
+    parsed.generation = emitter->generation;
+    parsed.x = emitter->x;
+    parsed.y = emitter->y;
+    parsed.vx = emitter->vx;
+    parsed.vy = emitter->vy;
+    parsed.age = emitter->age;
+    parsed.lifetime = emitter->lifetime;
+    parsed.active = true;
+    *emitter = parsed;
+
+    lua_pushinteger(L, ((lua_Integer) emitter->generation << 32) | index);
+    return 1;
+}
+
+// Particles.burst(emitter, count, [position])
+int lua_particles_burst(lua_State *L) {
+    ParticleEmitter *emitter = emitter_from_lua(L, 1);
+    if (!emitter) return 0;
+
+    u32 count = luaL_checkinteger(L, 2);
+    Vector2 position = emitter->position;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "x");
+        position.x = luaL_checknumber(L, -1);
+        lua_getfield(L, 3, "y");
+        position.y = luaL_checknumber(L, -1);
+        lua_pop(L, 2);
+    }
+
+    spawn_particles(emitter, count, position);
+    return 0;
+}
+
+int lua_particles_set_position(lua_State *L) {
+    ParticleEmitter *emitter = emitter_from_lua(L, 1);
+    if (!emitter) return 0;
+
+    emitter->position.x = luaL_checknumber(L, 2);
+    emitter->position.y = luaL_checknumber(L, 3);
+    return 0;
+}
+
+int lua_particles_set_rate(lua_State *L) {
+    ParticleEmitter *emitter = emitter_from_lua(L, 1);
+    if (!emitter) return 0;
+
+    emitter->rate = luaL_checknumber(L, 2);
+    return 0;
+}
+
+int lua_particles_destroy(lua_State *L) {
+    ParticleEmitter *emitter = emitter_from_lua(L, 1);
+    if (!emitter) return 0;
+
+    emitter->active = false;
+    emitter->generation++;
+    emitter->x.resize(halloc, 0);
+    emitter->y.resize(halloc, 0);
+    emitter->vx.resize(halloc, 0);
+    emitter->vy.resize(halloc, 0);
+    emitter->age.resize(halloc, 0);
+    emitter->lifetime.resize(halloc, 0);
+    free_emitters.push(halloc, luaL_checkinteger(L, 1) & 0xffffffff);
+    return 0;
+}
+
+// Particles.count([emitter]) -> live particles in one emitter or all of them
+int lua_particles_count(lua_State *L) {
+    if (!lua_isnoneornil(L, 1)) {
+        ParticleEmitter *emitter = emitter_from_lua(L, 1);
+        lua_pushinteger(L, emitter ? live_particles(emitter) : 0);
+        return 1;
+    }
+
+    u64 total = 0;
+    for (ParticleEmitter *emitter : emitters) {
+        if (emitter->active) total += live_particles(emitter);
+    }
+    lua_pushinteger(L, total);
+    return 1;
+}
+
+void bind_particles_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_particles_emitter); lua_setfield(L, -2, "emitter");
+    lua_pushcfunction(L, lua_particles_burst); lua_setfield(L, -2, "burst");
+    lua_pushcfunction(L, lua_particles_set_position); lua_setfield(L, -2, "set_position");
+    lua_pushcfunction(L, lua_particles_set_rate); lua_setfield(L, -2, "set_rate");
+    lua_pushcfunction(L, lua_particles_destroy); lua_setfield(L, -2, "destroy");
+    lua_pushcfunction(L, lua_particles_count); lua_setfield(L, -2, "count");
+    lua_setglobal(L, "Particles");
+
+    WM::get_main_window()->get_viewport()->push_system(Events::DRAW_ID, draw_particles, nullptr);
+}
+
+// Entity components. Entities are the plain IDs from alloc_id(), every component
+// type lives in its own sparse set so its data stays packed. The built in systems
+// walk those packed arrays natively, Lua gets iterators and accessors that read
+// straight out of them instead of building tables.
+
+enum ComponentType {
+    COMPONENT_POSITION = 1 << 0,
+    COMPONENT_VELOCITY = 1 << 1,
+    COMPONENT_SPRITE = 1 << 2,
+    COMPONENT_COLLIDER = 1 << 3,
+};
+
+struct PositionComponent {
+    float x, y;
+};
+
+struct VelocityComponent {
+    float x, y;
+};
+
+struct SpriteComponent {
+    TextureID texture;
+    Vector2 scale;
+    float rotation;
+    Color color;
+    int z_index;
+    Rect2 region; // part of the texture to draw, set by animators
+    bool has_region;
+};
+
+struct ColliderComponent {
+    Vector2 size;
+};
+
+#define COMPONENT_NONE 0xffffffff
+
+template <typename T>
+struct ComponentPool {
+    DArray<u32> sparse; // id -> index into the packed arrays
+    DArray<u64> ids;
+    DArray<T> data;
+
+    u64 size() const {
+        return ids.size();
+    }
+
+    T *get(u64 id) {
+        if (id >= sparse.size() || sparse[id] == COMPONENT_NONE) return nullptr;
+        return &data[sparse[id]];
+    }
+
+    T &add(u64 id, const T &value) {
+        if (T *existing = get(id)) {
+            *existing = value;
+            return *existing;
+        }
+
+        // IDs come from alloc_id() which counts up, so this stays about as big as the
+        // number of entities ever made.
+        u64 old_size = sparse.size();
+        if (id >= old_size) {
+            sparse.resize(halloc, id + 1);
+            for (u64 i = old_size; i <= id; ++i) sparse[i] = COMPONENT_NONE;
+        }
+
+        sparse[id] = ids.size();
+        ids.push(halloc, id);
+        data.push(halloc, value);
+        return data.back();
+    }
+
+    void remove(u64 id) {
+        if (!get(id)) return;
+
+        u32 index = sparse[id];
+        u64 moved = ids.back();
+        ids[index] = moved;
+        data[index] = data.back();
+        sparse[moved] = index;
+        ids.pop();
+        data.pop();
+        sparse[id] = COMPONENT_NONE;
+    }
+};
+
+struct World {
+    ComponentPool<PositionComponent> positions;
+    ComponentPool<VelocityComponent> velocities;
+    ComponentPool<SpriteComponent> sprites;
+    ComponentPool<ColliderComponent> colliders;
+};
+
+World world;
+
+bool entity_has(u64 id, int mask) {
+    if ((mask & COMPONENT_POSITION) && !world.positions.get(id)) return false;
+    if ((mask & COMPONENT_VELOCITY) && !world.velocities.get(id)) return false;
+    if ((mask & COMPONENT_SPRITE) && !world.sprites.get(id)) return false;
+    if ((mask & COMPONENT_COLLIDER) && !world.colliders.get(id)) return false;
+    return true;
+}
+
+// The packed id list of the smallest pool in `mask`, a query only has to walk that one.
+DArray<u64> *smallest_pool(int mask) {
+    DArray<u64> *best = nullptr;
+    u64 best_size = (u64) -1;
+
+    if ((mask & COMPONENT_POSITION) && world.positions.size() < best_size) {
+        best = &world.positions.ids, best_size = world.positions.size();
+    }
+    if ((mask & COMPONENT_VELOCITY) && world.velocities.size() < best_size) {
+        best = &world.velocities.ids, best_size = world.velocities.size();
+    }
+    if ((mask & COMPONENT_SPRITE) && world.sprites.size() < best_size) {
+        best = &world.sprites.ids, best_size = world.sprites.size();
+    }
+    if ((mask & COMPONENT_COLLIDER) && world.colliders.size() < best_size) {
+        best = &world.colliders.ids, best_size = world.colliders.size();
+    }
+    return best;
+}
+
+// Moves everything with a position and velocity. Entities with a collider are moved
+// through physics so they stop at solids, the rest are just integrated.
+void run_ecs_systems(Events::PostUpdate &) {
+    float dt = Time::delta();
+    settle_physics_jobs();
+
+    for (u64 i = 0; i < world.velocities.size(); ++i) {
+        u64 id = world.velocities.ids[i];
+        VelocityComponent &velocity = world.velocities.data[i];
+
+        PositionComponent *position = world.positions.get(id);
+        if (!position) continue;
+
+        if (world.colliders.get(id)) {
+            ID entity;
+            entity.id = id;
+            physics.move_actor(entity, {velocity.x * dt, velocity.y * dt});
+
+            if (const pp::PhysicsObject *obj = physics.objects.get(entity)) {
+                position->x = obj->aabb.position.x;
+                position->y = obj->aabb.position.y;
+            }
+        } else {
+            position->x += velocity.x * dt;
+            position->y += velocity.y * dt;
+        }
+    }
+}
+
+void draw_ecs_sprites(void *, Event &) {
+    for (u64 i = 0; i < world.sprites.size(); ++i) {
+        PositionComponent *position = world.positions.get(world.sprites.ids[i]);
+        if (!position) continue;
+
+        const SpriteComponent &sprite = world.sprites.data[i];
+        Sprite2DCmd cmd;
+        cmd.position = {position->x, position->y};
+        cmd.texture = sprite.texture;
+        cmd.scale = sprite.scale;
+        cmd.rotation = sprite.rotation;
+        cmd.color = sprite.color;
+        if (sprite.has_region) cmd.region = sprite.region;
+
+        if (!sprite_in_view(cmd, sprite.has_region ? sprite.region.size : texture_size(sprite.texture))) continue;
+        submit_cmd(cmd, sprite.z_index);
+    }
+}
+
+u64 check_entity(lua_State *L, int arg) {
+    lua_Integer id = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, id >= 0, arg, "not an entity id");
+    return id;
+}
+
+int lua_ecs_add_position(lua_State *L) {
+    u64 id = check_entity(L, 1);
+    PositionComponent position = {(float) luaL_checknumber(L, 2), (float) luaL_checknumber(L, 3)};
+    world.positions.add(id, position);
+
+    // Keep physics in step when an entity with a collider is teleported.
+    ID entity;
+    entity.id = id;
+    if (world.colliders.get(id)) {
+        settle_physics_jobs();
+        if (pp::PhysicsObject *obj = physics.objects.get(entity)) {
+            obj->aabb.position = {position.x, position.y};
+        }
+    }
+    return 0;
+}
+
+int lua_ecs_add_velocity(lua_State *L) {
+    u64 id = check_entity(L, 1);
+    world.velocities.add(id, {(float) luaL_optnumber(L, 2, 0.0), (float) luaL_optnumber(L, 3, 0.0)});
+    return 0;
+}
+
+// ECS.add_sprite(id, {texture = tex, scale = v2(1), rotation = 0, color = {}, z_index = 0})
+int lua_ecs_add_sprite(lua_State *L) {
+    u64 id = check_entity(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    SpriteComponent sprite = {};
+    lua_getfield(L, 2, "texture");
+    sprite.texture.id = luaL_checkinteger(L, -1);
+    lua_getfield(L, 2, "rotation");
+    sprite.rotation = luaL_optnumber(L, -1, 0.0);
+    lua_getfield(L, 2, "z_index");
+    sprite.z_index = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 3);
+
+    sprite.scale = {1.0f, 1.0f};
+    lua_getfield(L, 2, "scale");
+    if (lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        load_v2(L, sprite.scale, "scale", 2);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    sprite.color = Color();
+    lua_getfield(L, 2, "color");
+    color_from_object(sprite.color, L);
+
+    world.sprites.add(id, sprite);
+    return 0;
+}
+
+// ECS.add_collider(id, {size = v2(), type = Physics.Actor, layer = 1, mask = 1})
+// Needs a position first, the collider is registered with physics right away.
+int lua_ecs_add_collider(lua_State *L) {
+    u64 id = check_entity(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    PositionComponent *position = world.positions.get(id);
+    if (!position) {
+        RETURN_ERROR(L, "An entity needs a position before it can get a collider");
+    }
+
+    ColliderComponent collider;
+    load_v2(L, collider.size, "size", 2);
+
+    lua_getfield(L, 2, "layer");
+    int layer = luaL_optinteger(L, -1, 1);
+    lua_getfield(L, 2, "mask");
+    int mask = luaL_optinteger(L, -1, 1);
+    lua_getfield(L, 2, "type");
+    int type = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 3);
+
+    world.colliders.add(id, collider);
+
+    ID entity;
+    entity.id = id;
+    settle_physics_jobs();
+    physics.objects.insert(entity, {{{position->x, position->y}, collider.size}, (pp::PhysicsObject::Type) type, mask, layer});
+    return 0;
+}
+
+void remove_components(u64 id, int mask) {
+    if (mask & COMPONENT_POSITION) world.positions.remove(id);
+    if (mask & COMPONENT_VELOCITY) world.velocities.remove(id);
+    if (mask & COMPONENT_SPRITE) world.sprites.remove(id);
+    if ((mask & COMPONENT_COLLIDER) && world.colliders.get(id)) {
+        world.colliders.remove(id);
+
+        ID entity;
+        entity.id = id;
+        settle_physics_jobs();
+        physics.objects.erase(entity);
+    }
+}
+
+// ECS.remove(id, ECS.Velocity | ECS.Sprite)
+int lua_ecs_remove(lua_State *L) {
+    remove_components(check_entity(L, 1), luaL_checkinteger(L, 2));
+    return 0;
+}
+
+int lua_ecs_destroy(lua_State *L) {
+    remove_components(check_entity(L, 1), ~0);
+    return 0;
+}
+
+int lua_ecs_has(lua_State *L) {
+    lua_pushboolean(L, entity_has(check_entity(L, 1), luaL_checkinteger(L, 2)));
+    return 1;
+}
+
+// ECS.position(id) -> x, y
+int lua_ecs_position(lua_State *L) {
+    PositionComponent *position = world.positions.get(check_entity(L, 1));
+    if (!position) return 0;
+
+    lua_pushnumber(L, position->x);
+    lua_pushnumber(L, position->y);
+    return 2;
+}
+
+// ECS.velocity(id) -> x, y
+int lua_ecs_velocity(lua_State *L) {
+    VelocityComponent *velocity = world.velocities.get(check_entity(L, 1));
+    if (!velocity) return 0;
+
+    lua_pushnumber(L, velocity->x);
+    lua_pushnumber(L, velocity->y);
+    return 2;
+}
+
+int lua_ecs_set_velocity(lua_State *L) {
+    VelocityComponent *velocity = world.velocities.get(check_entity(L, 1));
+    if (!velocity) return 0;
+
+    velocity->x = luaL_checknumber(L, 2);
+    velocity->y = luaL_checknumber(L, 3);
+    return 0;
+}
+
+int ecs_query_next(lua_State *L) {
+    int mask = lua_tointeger(L, lua_upvalueindex(1));
+    lua_Integer index = lua_tointeger(L, lua_upvalueindex(2));
+    DArray<u64> *ids = (DArray<u64> *) lua_touserdata(L, lua_upvalueindex(3));
+
+    // Walks backwards so removing the current entity's components is safe.
+    if (!ids) return 0;
+    if (index > (lua_Integer) ids->size()) index = ids->size();
+
+    while (--index >= 0) {
+        u64 id = (*ids)[index];
+        if (!entity_has(id, mask)) continue;
+
+        lua_pushinteger(L, index);
+        lua_replace(L, lua_upvalueindex(2));
+        lua_pushinteger(L, id);
+        return 1;
+    }
+
+    return 0;
+}
+
+// for id in ECS.query(ECS.Position, ECS.Velocity) do ... end
+int lua_ecs_query(lua_State *L) {
+    int mask = 0;
+    for (int i = 1; i <= lua_gettop(L); ++i) {
+        mask |= luaL_checkinteger(L, i);
+    }
+
+    // The pool is picked once, the pools are globals so the pointer stays valid.
+    DArray<u64> *ids = smallest_pool(mask);
+    lua_pushinteger(L, mask);
+    lua_pushinteger(L, ids ? ids->size() : 0);
+    lua_pushlightuserdata(L, ids);
+    lua_pushcclosure(L, ecs_query_next, 3);
+    return 1;
+}
+
+int lua_ecs_count(lua_State *L) {
+    int mask = luaL_checkinteger(L, 1);
+    DArray<u64> *ids = smallest_pool(mask);
+
+    u64 count = 0;
+    for (u64 i = 0; ids && i < ids->size(); ++i) {
+        if (entity_has((*ids)[i], mask)) count++;
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+void bind_ecs_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_ecs_add_position); lua_setfield(L, -2, "add_position");
+    lua_pushcfunction(L, lua_ecs_add_velocity); lua_setfield(L, -2, "add_velocity");
+    lua_pushcfunction(L, lua_ecs_add_sprite); lua_setfield(L, -2, "add_sprite");
+    lua_pushcfunction(L, lua_ecs_add_collider); lua_setfield(L, -2, "add_collider");
+    lua_pushcfunction(L, lua_ecs_remove); lua_setfield(L, -2, "remove");
+    lua_pushcfunction(L, lua_ecs_destroy); lua_setfield(L, -2, "destroy");
+    lua_pushcfunction(L, lua_ecs_has); lua_setfield(L, -2, "has");
+    lua_pushcfunction(L, lua_ecs_position); lua_setfield(L, -2, "position");
+    lua_pushcfunction(L, lua_ecs_add_position); lua_setfield(L, -2, "set_position");
+    lua_pushcfunction(L, lua_ecs_velocity); lua_setfield(L, -2, "velocity");
+    lua_pushcfunction(L, lua_ecs_set_velocity); lua_setfield(L, -2, "set_velocity");
+    lua_pushcfunction(L, lua_ecs_query); lua_setfield(L, -2, "query");
+    lua_pushcfunction(L, lua_ecs_count); lua_setfield(L, -2, "count");
+
+    lua_pushinteger(L, COMPONENT_POSITION); lua_setfield(L, -2, "Position");
+    lua_pushinteger(L, COMPONENT_VELOCITY); lua_setfield(L, -2, "Velocity");
+    lua_pushinteger(L, COMPONENT_SPRITE); lua_setfield(L, -2, "Sprite");
+    lua_pushinteger(L, COMPONENT_COLLIDER); lua_setfield(L, -2, "Collider");
+
+    lua_setglobal(L, "ECS");
+
+    WM::get_main_window()->get_viewport()->push_system(Events::DRAW_ID, draw_ecs_sprites, nullptr);
+}
+
+// Tile maps keep their tiles in 32x32 chunks per layer. Every chunk caches the sprite
+// commands for its tiles and only rebuilds them after a tile in it changed, drawing
+// then just submits the cached commands of the chunks the view rect touches.
+// Animated tile ranges only swap the source region of their cached commands.
+
+#define TILE_CHUNK_SIZE 32
+
+struct TileAnimation {
+    u16 first, count; // tiles first .. first + count - 1 cycle through each other
+    float frame_time;
+};
+
+struct TileChunk {
+    u16 tiles[TILE_CHUNK_SIZE * TILE_CHUNK_SIZE]; // zero is empty, otherwise tileset index + 1
+    bool dirty;
+
+    DArray<Sprite2DCmd> cmds; // positions are relative to the map
+    DArray<u32> animated;     // indices into cmds
+    DArray<u16> animated_tiles;
+};
+
+struct TileMap {
+    u32 generation;
+    bool active;
+
+    Vector2 position;
+    float tile_size;
+    Vector2 source_size; // size of one tile in the tileset texture
+    TextureID texture;
+    u32 columns;         // tiles per row in the tileset
+    int z_index;         // layer n draws at z_index + n - 1
+
+    u32 width, height; // in tiles
+    u32 chunks_x, chunks_y, layers;
+    DArray<TileChunk *> chunks; // layer major, null until something is set in it
+    DArray<TileAnimation> animations;
+};
+
+DArray<TileMap *> tilemaps;
+DArray<u32> free_tilemaps;
+float tile_clock;
+
+TileChunk **tile_chunk_slot(TileMap *map, u32 layer, u32 x, u32 y) {
+    u32 cx = x / TILE_CHUNK_SIZE, cy = y / TILE_CHUNK_SIZE;
+    return &map->chunks[(layer * map->chunks_y + cy) * map->chunks_x + cx];
+}
+
+Rect2 tile_region(TileMap *map, u16 tile) {
+    u32 index = tile - 1;
+    float x = (index % map->columns) * map->source_size.x;
+    float y = (index / map->columns) * map->source_size.y;
+    return {{x, y}, map->source_size};
+}
+
+const TileAnimation *find_tile_animation(TileMap *map, u16 tile) {
+    for (const TileAnimation &animation : map->animations) {
+        if (tile >= animation.first && tile < animation.first + animation.count) return &animation;
+    }
+    return nullptr;
+}
+
+u16 animated_tile(const TileAnimation &animation, u16 tile) {
+    u32 frame = (u32) (tile_clock / animation.frame_time);
+    return animation.first + (tile - animation.first + frame) % animation.count;
+}
+
+void rebuild_tile_chunk(TileMap *map, TileChunk *chunk, u32 cx, u32 cy) {
+    chunk->cmds.resize(halloc, 0);
+    chunk->animated.resize(halloc, 0);
+    chunk->animated_tiles.resize(halloc, 0);
+
+    Vector2 scale = {map->tile_size / map->source_size.x, map->tile_size / map->source_size.y};
+
+    for (u32 y = 0; y < TILE_CHUNK_SIZE; ++y) {
+        for (u32 x = 0; x < TILE_CHUNK_SIZE; ++x) {
+            u16 tile = chunk->tiles[y * TILE_CHUNK_SIZE + x];
+            if (tile == 0) continue;
+
+            Sprite2DCmd cmd;
+            cmd.position = {(cx * TILE_CHUNK_SIZE + x) * map->tile_size, (cy * TILE_CHUNK_SIZE + y) * map->tile_size};
+            cmd.texture = map->texture;
+            cmd.region = tile_region(map, tile);
+            cmd.scale = scale;
+            cmd.rotation = 0.0f;
+            cmd.color = Color();
+
+            if (find_tile_animation(map, tile)) {
+                chunk->animated.push(halloc, chunk->cmds.size());
+                chunk->animated_tiles.push(halloc, tile);
+            }
+            chunk->cmds.push(halloc, cmd);
+        }
+    }
+
+    chunk->dirty = false;
+}
+
+void draw_tilemaps(void *, Event &) {
+    tile_clock += Time::delta();
+
+    for (TileMap *map : tilemaps) {
+        if (!map->active) continue;
+
+        // Chunk range overlapping the view rect.
+        float chunk_extent = map->tile_size * TILE_CHUNK_SIZE;
+        float left = (view_rect.position.x - map->position.x) / chunk_extent;
+        float top = (view_rect.position.y - map->position.y) / chunk_extent;
+        float right = left + view_rect.size.x / chunk_extent;
+        float bottom = top + view_rect.size.y / chunk_extent;
+        if (right < 0.0f || bottom < 0.0f || left >= map->chunks_x || top >= map->chunks_y) continue;
+
+        u32 x0 = left > 0.0f ? (u32) left : 0;
+        u32 y0 = top > 0.0f ? (u32) top : 0;
+        u32 x1 = right < map->chunks_x - 1 ? (u32) right : map->chunks_x - 1;
+        u32 y1 = bottom < map->chunks_y - 1 ? (u32) bottom : map->chunks_y - 1;
+
+        for (u32 layer = 0; layer < map->layers; ++layer) {
+            for (u32 cy = y0; cy <= y1; ++cy) {
+                for (u32 cx = x0; cx <= x1; ++cx) {
+                    TileChunk *chunk = map->chunks[(layer * map->chunks_y + cy) * map->chunks_x + cx];
+                    if (!chunk) continue;
+                    if (chunk->dirty) rebuild_tile_chunk(map, chunk, cx, cy);
+
+                    for (u64 i = 0; i < chunk->animated.size(); ++i) {
+                        u16 tile = chunk->animated_tiles[i];
+                        const TileAnimation *animation = find_tile_animation(map, tile);
+                        if (animation) chunk->cmds[chunk->animated[i]].region = tile_region(map, animated_tile(*animation, tile));
+                    }
+
+                    for (Sprite2DCmd cmd : chunk->cmds) {
+                        cmd.position.x += map->position.x;
+                        cmd.position.y += map->position.y;
+                        submit_cmd(cmd, map->z_index + layer);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TileMap *tilemap_from_lua(lua_State *L, int arg) {
+    lua_Integer handle = luaL_checkinteger(L, arg);
+    u32 index = handle & 0xffffffff;
+    if (index >= tilemaps.size()) return nullptr;
+
+    TileMap *map = tilemaps[index];
+    if (!map->active || map->generation != (u32) (handle >> 32)) return nullptr;
+    return map;
+}
+
+void free_tile_chunks(TileMap *map) {
+    for (TileChunk *chunk : map->chunks) {
+        if (!chunk) continue;
+        chunk->cmds.free();
+        chunk->animated.free();
+        chunk->animated_tiles.free();
+        delete chunk;
+    }
+    map->chunks.resize(halloc, 0);
+}
+
+// TileMap.new{width = 100, height = 100, tile_size = 16, texture = tex, columns = 8,
+//             source_size = v2(16), layers = 1, position = v2(), z_index = 0} -> handle
+int lua_tilemap_new(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "Expected a table {width = 0, height = 0, tile_size = 16, texture = 0, columns = 1, ...} as the first argument");
+    }
+
+    lua_getfield(L, 1, "width");
+    lua_Integer width = luaL_checkinteger(L, -1);
+    lua_getfield(L, 1, "height");
+    lua_Integer height = luaL_checkinteger(L, -1);
+    lua_getfield(L, 1, "layers");
+    lua_Integer layers = luaL_optinteger(L, -1, 1);
+    lua_getfield(L, 1, "columns");
+    lua_Integer columns = luaL_optinteger(L, -1, 1);
+    lua_getfield(L, 1, "tile_size");
+    float tile_size = luaL_optnumber(L, -1, 16.0);
+    lua_getfield(L, 1, "texture");
+    lua_Integer texture = luaL_checkinteger(L, -1);
+    lua_getfield(L, 1, "z_index");
+    int z_index = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 7);
+
+    if (width <= 0 || height <= 0 || layers <= 0 || columns <= 0 || tile_size <= 0.0f) {
+        RETURN_ERROR(L, "TileMap width, height, layers, columns and tile_size must be positive");
+    }
+
+    u32 index;
+    if (free_tilemaps.size() > 0) {
+        index = free_tilemaps.back();
+        free_tilemaps.pop();
+    } else {
+        index = tilemaps.size();
+        tilemaps.push(halloc, new TileMap{});
+    }
+
+    TileMap *map = tilemaps[index];
+    map->active = true;
+    map->width = width;
+    map->height = height;
+    map->layers = layers;
+    map->columns = columns;
+    map->tile_size = tile_size;
+    map->texture.id = texture;
+    map->z_index = z_index;
+    map->chunks_x = (width + TILE_CHUNK_SIZE - 1) / TILE_CHUNK_SIZE;
+    map->chunks_y = (height + TILE_CHUNK_SIZE - 1) / TILE_CHUNK_SIZE;
+    map->animations.resize(halloc, 0);
+
+    map->chunks.resize(halloc, map->layers * map->chunks_y * map->chunks_x);
+    for (TileChunk *&chunk : map->chunks) chunk = nullptr;
+
+    map->source_size = {tile_size, tile_size};
+    lua_getfield(L, 1, "source_size");
+    bool has_source_size = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (has_source_size) {
+        load_v2(L, map->source_size, "source_size", 1);
+    }
+
+    map->position = {0.0f, 0.0f};
+    lua_getfield(L, 1, "position");
+    bool has_position = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (has_position) {
+        load_v2(L, map->position, "position", 1);
+    }
+
+    lua_pushinteger(L, ((lua_Integer) map->generation << 32) | index);
+    return 1;
+}
+
+bool set_tile(TileMap *map, u32 layer, u32 x, u32 y, u16 tile) {
+    if (layer >= map->layers || x >= map->width || y >= map->height) return false;
+
+    TileChunk **slot = tile_chunk_slot(map, layer, x, y);
+    if (!*slot) {
+        if (tile == 0) return true;
+        *slot = new TileChunk{};
+    }
+
+    u16 &current = (*slot)->tiles[(y % TILE_CHUNK_SIZE) * TILE_CHUNK_SIZE + x % TILE_CHUNK_SIZE];
+    if (current != tile) {
+        current = tile;
+        (*slot)->dirty = true;
+    }
+    return true;
+}
+
+// TileMap.set(map, layer, x, y, tile). Layers count from 1, tile coordinates from 0,
+// tile 0 clears the cell.
+int lua_tilemap_set(lua_State *L) {
+    TileMap *map = tilemap_from_lua(L, 1);
+    if (!map) return 0;
+
+    lua_Integer layer = luaL_checkinteger(L, 2) - 1;
+    lua_Integer x = luaL_checkinteger(L, 3), y = luaL_checkinteger(L, 4);
+    lua_Integer tile = luaL_checkinteger(L, 5);
+    luaL_argcheck(L, tile >= 0 && tile <= 0xffff, 5, "tile index out of range");
+
+    if (layer < 0 || x < 0 || y < 0) return 0;
+    set_tile(map, layer, x, y, tile);
+    return 0;
+}
+
+int lua_tilemap_get(lua_State *L) {
+    TileMap *map = tilemap_from_lua(L, 1);
+    if (!map) return 0;
+
+    lua_Integer layer = luaL_checkinteger(L, 2) - 1;
+    lua_Integer x = luaL_checkinteger(L, 3), y = luaL_checkinteger(L, 4);
+    if (layer < 0 || layer >= map->layers || x < 0 || x >= map->width || y < 0 || y >= map->height) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    TileChunk *chunk = *tile_chunk_slot(map, layer, x, y);
+    lua_pushinteger(L, chunk ? chunk->tiles[(y % TILE_CHUNK_SIZE) * TILE_CHUNK_SIZE + x % TILE_CHUNK_SIZE] : 0);
+    return 1;
+}
+
+// TileMap.fill(map, layer, {tiles...}) with width * height tiles, row by row.
+int lua_tilemap_fill(lua_State *L) {
+    TileMap *map = tilemap_from_lua(L, 1);
+    if (!map) return 0;
+
+    lua_Integer layer = luaL_checkinteger(L, 2) - 1;
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_argcheck(L, layer >= 0 && layer < map->layers, 2, "layer out of range");
+
+    u64 count = (u64) map->width * map->height;
+    for (u64 i = 0; i < count; ++i) {
+        lua_rawgeti(L, 3, i + 1);
+        lua_Integer tile = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (tile < 0 || tile > 0xffff) tile = 0;
+
+        set_tile(map, layer, i % map->width, i / map->width, tile);
+    }
+    return 0;
+}
+
+// TileMap.animate(map, first_tile, count, frame_time)
+int lua_tilemap_animate(lua_State *L) {
+    TileMap *map = tilemap_from_lua(L, 1);
+    if (!map) return 0;
+
+    TileAnimation animation;
+    animation.first = luaL_checkinteger(L, 2);
+    animation.count = luaL_checkinteger(L, 3);
+    animation.frame_time = luaL_checknumber(L, 4);
+    luaL_argcheck(L, animation.count > 0, 3, "count must be positive");
+    luaL_argcheck(L, animation.frame_time > 0.0f, 4, "frame_time must be positive");
+    map->animations.push(halloc, animation);
+
+    // Chunks need to know which of their commands are animated now.
+    for (TileChunk *chunk : map->chunks) {
+        if (chunk) chunk->dirty = true;
+    }
     return 0;
 }
 
-int lua_include(lua_State *L) {
-    const char *pointer = luaL_checklstring(L, 1, nullptr);
-    luaL_dofile(L, pointer);
+int lua_tilemap_set_position(lua_State *L) {
+    TileMap *map = tilemap_from_lua(L, 1);
+    if (!map) return 0;
+
+    map->position.x = luaL_checknumber(L, 2);
+    map->position.y = luaL_checknumber(L, 3);
     return 0;
 }
 
-void bind_function(lua_State *L, const char* lua_function_name, lua_CFunction fn) {
-    lua_pushcfunction(L, fn);
-    lua_setglobal(L, lua_function_name);
+int lua_tilemap_destroy(lua_State *L) {
+    TileMap *map = tilemap_from_lua(L, 1);
+    if (!map) return 0;
+
+    map->active = false;
+    map->generation++;
+    free_tile_chunks(map);
+    free_tilemaps.push(halloc, luaL_checkinteger(L, 1) & 0xffffffff);
+    return 0;
 }
 
-void bind_event_ids_to_lua(lua_State *L) {
+void bind_tilemaps_to_lua(lua_State *L) {
     lua_newtable(L);
+    lua_pushcfunction(L, lua_tilemap_new); lua_setfield(L, -2, "new");
+    lua_pushcfunction(L, lua_tilemap_set); lua_setfield(L, -2, "set");
+    lua_pushcfunction(L, lua_tilemap_get); lua_setfield(L, -2, "get");
+    lua_pushcfunction(L, lua_tilemap_fill); lua_setfield(L, -2, "fill");
+    lua_pushcfunction(L, lua_tilemap_animate); lua_setfield(L, -2, "animate");
+    lua_pushcfunction(L, lua_tilemap_set_position); lua_setfield(L, -2, "set_position");
+    lua_pushcfunction(L, lua_tilemap_destroy); lua_setfield(L, -2, "destroy");
+    lua_setglobal(L, "TileMap");
+
+    WM::get_main_window()->get_viewport()->push_system(Events::DRAW_ID, draw_tilemaps, nullptr);
+}
 
-    lua_pushinteger(L, Events::ANY_ID); lua_setfield(L, -2, "Any");
-    lua_pushinteger(L, Events::INIT_ID); lua_setfield(L, -2, "Init");
-    lua_pushinteger(L, Events::UPDATE_ID); lua_setfield(L, -2, "Update");
-    lua_pushinteger(L, Events::QUIT_ID); lua_setfield(L, -2, "Quit");
-    lua_pushinteger(L, Events::PRE_UPDATE_ID); lua_setfield(L, -2, "PreUpdate");
-    lua_pushinteger(L, Events::POST_UPDATE_ID); lua_setfield(L, -2, "PostUpdate");
-    lua_pushinteger(L, Events::DRAW_ID); lua_setfield(L, -2, "Draw");
-    lua_pushinteger(L, Events::WINDOW_OPEN_ID); lua_setfield(L, -2, "WindowOpen");
-    lua_pushinteger(L, Events::WINDOW_CLOSE_ID); lua_setfield(L, -2, "WindowClose");
-    lua_pushinteger(L, Events::WINDOW_RESIZE_ID); lua_setfield(L, -2, "WindowResize");
-    lua_pushinteger(L, Events::MOUSE_MOVED_ID); lua_setfield(L, -2, "MouseMoved");
-    lua_pushinteger(L, Events::MOUSE_SCROLLED_ID); lua_setfield(L, -2, "MouseScrolled");
-    lua_pushinteger(L, Events::MOUSE_BUTTON_PRESSED_ID); lua_setfield(L, -2, "MouseButtonPressed");
-    lua_pushinteger(L, Events::MOUSE_BUTTON_RELEASED_ID); lua_setfield(L, -2, "MouseButtonReleased");
-    lua_pushinteger(L, Events::MOUSE_LEAVE_WINDOW_ID); lua_setfield(L, -2, "MouseLeaveWindow");
-    lua_pushinteger(L, Events::MOUSE_ENTER_WINDOW_ID); lua_setfield(L, -2, "MouseEnterWindow");
-    lua_pushinteger(L, Events::KEY_PRESSED_ID); lua_setfield(L, -2, "KeyPressed");
-    lua_pushinteger(L, Events::KEY_RELEASED_ID); lua_setfield(L, -2, "KeyReleased");
-    lua_pushinteger(L, Events::KEY_TYPED_ID); lua_setfield(L, -2, "KeyTyped");
-    lua_pushinteger(L, Events::VIEWPORT_DRAW_ID); lua_setfield(L, -2, "ViewportDraw");
-    lua_pushinteger(L, Events::RENDERER_INIT_ID); lua_setfield(L, -2, "RendererInit");
-    lua_pushinteger(L, Events::FIRST_CUSTOM_ID); lua_setfield(L, -2, "FirstCustom");
+// Flipbook animation. Clips are frame regions and durations cut out of a sprite sheet,
+// every animator is a row in a set of packed arrays that get stepped in one native
+// pass per frame. Animators bound to an entity write their current frame straight
+// into its sprite component, Lua only hears about frame events.
 
-    lua_setglobal(L, "EventIDs");
+enum AnimationLoop {
+    ANIMATION_LOOP,
+    ANIMATION_ONCE,
+    ANIMATION_PING_PONG,
+};
+
+enum AnimatorState : u8 {
+    ANIMATOR_FREE,
+    ANIMATOR_PLAYING,
+    ANIMATOR_PAUSED,
+    ANIMATOR_FINISHED,
+};
+
+#define NO_ENTITY ((u64) -1)
+
+struct AnimationClip {
+    TextureID texture;
+    u32 first, count; // range in the per frame arrays
+    AnimationLoop loop;
+};
+
+struct AnimationEvent {
+    u32 animator, generation;
+    int name_ref; // LUA_NOREF for a finished clip
+};
+
+struct AnimatorSystem {
+    lua_State *L = nullptr;
+
+    DArray<AnimationClip> clips;
+    DArray<Rect2> frames;
+    DArray<float> durations;
+    DArray<int> frame_events; // string ref or LUA_NOREF
+
+    DArray<u32> clip, frame, generation;
+    DArray<float> time, speed;
+    DArray<i32> direction;
+    DArray<AnimatorState> state;
+    DArray<u64> entity;
+    DArray<int> on_event_ref;
+    DArray<u32> free;
+
+    DArray<AnimationEvent> pending; // reused every frame
+};
+
+AnimatorSystem animators;
+
+void queue_frame_event(u32 index) {
+    int ref = animators.frame_events[animators.clips[animators.clip[index]].first + animators.frame[index]];
+    if (ref != LUA_NOREF && animators.on_event_ref[index] != LUA_NOREF) {
+        animators.pending.push(halloc, {index, animators.generation[index], ref});
+    }
 }
 
-void bind_input_actions_to_lua(lua_State *L) {
+// Moves an animator one frame along its clip, false once a non looping clip ran out.
+bool advance_frame(u32 index) {
+    const AnimationClip &clip = animators.clips[animators.clip[index]];
+    u32 &frame = animators.frame[index];
+
+    switch (clip.loop) {
+    case ANIMATION_LOOP:
+        frame = (frame + 1) % clip.count;
+        return true;
+    case ANIMATION_ONCE:
+        if (frame + 1 >= clip.count) return false;
+        frame++;
+        return true;
+    case ANIMATION_PING_PONG:
+        if (clip.count == 1) return true;
+        if ((frame == clip.count - 1 && animators.direction[index] > 0) || (frame == 0 && animators.direction[index] < 0)) {
+            animators.direction[index] = -animators.direction[index];
+        }
+        frame += animators.direction[index];
+        return true;
+    }
+    return true;
+}
+
+void sync_animator_sprite(u32 index) {
+    if (animators.entity[index] == NO_ENTITY) return;
+
+    SpriteComponent *sprite = world.sprites.get(animators.entity[index]);
+    if (!sprite) return;
+
+    const AnimationClip &clip = animators.clips[animators.clip[index]];
+    sprite->texture = clip.texture;
+    sprite->region = animators.frames[clip.first + animators.frame[index]];
+    sprite->has_region = true;
+}
+
+void step_animators(Events::PreUpdate &) {
+    float dt = Time::delta();
+
+    for (u32 i = 0; i < animators.state.size(); ++i) {
+        if (animators.state[i] != ANIMATOR_PLAYING) continue;
+
+        const AnimationClip &clip = animators.clips[animators.clip[i]];
+        animators.time[i] += dt * animators.speed[i];
+
+        float duration;
+        while (animators.time[i] >= (duration = animators.durations[clip.first + animators.frame[i]])) {
+            animators.time[i] -= duration;
+
+            if (!advance_frame(i)) {
+                animators.state[i] = ANIMATOR_FINISHED;
+                animators.time[i] = 0.0f;
+                if (animators.on_event_ref[i] != LUA_NOREF) animators.pending.push(halloc, {i, animators.generation[i], LUA_NOREF});
+                break;
+            }
+            queue_frame_event(i);
+        }
+
+        sync_animator_sprite(i);
+    }
+
+    if (animators.pending.size() == 0) return;
+
+    lua_State *L = animators.L;
+    for (u64 i = 0; i < animators.pending.size(); ++i) {
+        // An earlier callback may have destroyed the animator and a new one taken its slot.
+        AnimationEvent event = animators.pending[i];
+        if (animators.state[event.animator] == ANIMATOR_FREE) continue;
+        if (animators.generation[event.animator] != event.generation) continue;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, animators.on_event_ref[event.animator]);
+        lua_pushinteger(L, ((lua_Integer) animators.generation[event.animator] << 32) | event.animator);
+        if (event.name_ref == LUA_NOREF) {
+            lua_pushstring(L, "finished");
+        } else {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, event.name_ref);
+        }
+
+        if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+            LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    animators.pending.resize(halloc, 0);
+}
+
+i64 animator_from_lua(lua_State *L, int arg) {
+    lua_Integer handle = luaL_checkinteger(L, arg);
+    u32 index = handle & 0xffffffff;
+    if (index >= animators.state.size()) return -1;
+    if (animators.state[index] == ANIMATOR_FREE || animators.generation[index] != (u32) (handle >> 32)) return -1;
+    return index;
+}
+
+u32 check_clip(lua_State *L, int arg) {
+    lua_Integer clip = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, clip >= 0 && clip < (lua_Integer) animators.clips.size(), arg, "not an animation clip");
+    return clip;
+}
+
+// Reads one clip out of the table on top of the stack, frame indices count cells of
+// the sheet grid from 0, left to right and top to bottom.
+void load_clip(lua_State *L, TextureID texture, Vector2 frame_size, u32 columns) {
+    int clip_arg = lua_gettop(L);
+
+    AnimationClip clip;
+    clip.texture = texture;
+    clip.first = animators.frames.size();
+
+    lua_getfield(L, clip_arg, "loop");
+    clip.loop = (AnimationLoop) luaL_optinteger(L, -1, ANIMATION_LOOP);
+    lua_getfield(L, clip_arg, "frame_time");
+    float frame_time = luaL_optnumber(L, -1, 0.1);
+    lua_pop(L, 2);
+
+    lua_getfield(L, clip_arg, "frames");
+    int frames_arg = lua_gettop(L);
+    bool listed = lua_istable(L, frames_arg);
+
+    lua_Integer start = 0, count;
+    if (listed) {
+        count = luaL_len(L, frames_arg);
+    } else {
+        lua_getfield(L, clip_arg, "start");
+        start = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, clip_arg, "count");
+        count = luaL_checkinteger(L, -1);
+        lua_pop(L, 2);
+    }
+    if (count <= 0) luaL_error(L, "Animation clips need at least one frame");
+
+    lua_getfield(L, clip_arg, "durations");
+    int durations_arg = lua_gettop(L);
+    lua_getfield(L, clip_arg, "events");
+    int events_arg = lua_gettop(L);
+
+    // Every frame is checked before anything is pushed or referenced, an error halfway
+    // through would leave frames without a clip and leak the event refs.
+    for (lua_Integer i = 0; i < count; ++i) {
+        if (listed) {
+            lua_rawgeti(L, frames_arg, i + 1);
+            luaL_checkinteger(L, -1);
+            lua_pop(L, 1);
+        }
+        if (lua_istable(L, durations_arg)) {
+            lua_rawgeti(L, durations_arg, i + 1);
+            float duration = luaL_optnumber(L, -1, frame_time);
+            lua_pop(L, 1);
+            if (duration <= 0.0f) luaL_error(L, "Animation frame durations must be positive");
+        } else if (frame_time <= 0.0f) {
+            luaL_error(L, "Animation frame durations must be positive");
+        }
+    }
+
+    for (lua_Integer i = 0; i < count; ++i) {
+        lua_Integer cell = start + i;
+        if (listed) {
+            lua_rawgeti(L, frames_arg, i + 1);
+            cell = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+        }
+        animators.frames.push(halloc, {{(cell % columns) * frame_size.x, (cell / columns) * frame_size.y}, frame_size});
+
+        float duration = frame_time;
+        if (lua_istable(L, durations_arg)) {
+            lua_rawgeti(L, durations_arg, i + 1);
+            duration = luaL_optnumber(L, -1, frame_time);
+            lua_pop(L, 1);
+        }
+        animators.durations.push(halloc, duration);
+
+        int event_ref = LUA_NOREF;
+        if (lua_istable(L, events_arg)) {
+            lua_rawgeti(L, events_arg, i + 1);
+            if (lua_isstring(L, -1)) {
+                event_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            } else {
+                lua_pop(L, 1);
+            }
+        }
+        animators.frame_events.push(halloc, event_ref);
+    }
+
+    lua_settop(L, clip_arg);
+    clip.count = count;
+    animators.clips.push(halloc, clip);
+}
+
+// Animator.sheet{texture = tex, frame_size = v2(16), columns = 8, clips = {
+//     walk = {start = 0, count = 6, frame_time = 0.1, events = {[3] = "step"}},
+//     attack = {frames = {8, 9, 10}, durations = {0.05, 0.05, 0.2}, loop = Animator.Once},
+// }} -> {walk = clip, attack = clip}
+int lua_animator_sheet(lua_State *L) {
+    if (!lua_istable(L, 1)) {
+        RETURN_ERROR(L, "Expected a table {texture = 0, frame_size = {x = 0, y = 0}, columns = 1, clips = {}} as the first argument");
+    }
+
+    lua_getfield(L, 1, "texture");
+    TextureID texture;
+    texture.id = luaL_checkinteger(L, -1);
+    lua_getfield(L, 1, "columns");
+    lua_Integer columns = luaL_optinteger(L, -1, 1);
+    lua_pop(L, 2);
+    if (columns <= 0) {
+        RETURN_ERROR(L, "'columns' must be positive");
+    }
+
+    Vector2 frame_size;
+    load_v2(L, frame_size, "frame_size", 1);
+
+    lua_getfield(L, 1, "clips");
+    if (!lua_istable(L, -1)) {
+        RETURN_ERROR(L, "'clips' must be a table of named clips");
+    }
+    int clips_arg = lua_gettop(L);
+
     lua_newtable(L);
+    int result = lua_gettop(L);
 
-    lua_pushinteger(L, (int) Actions::LeftMouseButton); lua_setfield(L, -2, "LeftMouseButton");
-    lua_pushinteger(L, (int) Actions::RightMouseButton); lua_setfield(L, -2, "RightMouseButton");
-    lua_pushinteger(L, (int) Actions::MiddleMouseButton); lua_setfield(L, -2, "MiddleMouseButton");
-    lua_pushinteger(L, (int) Actions::MouseButtonX1); lua_setfield(L, -2, "MouseButtonX1");
-    lua_pushinteger(L, (int) Actions::MouseButtonX2); lua_setfield(L, -2, "MouseButtonX2");
-    lua_pushinteger(L, (int) Actions::MouseButtonX3); lua_setfield(L, -2, "MouseButtonX3");
-    lua_pushinteger(L, (int) Actions::MouseButtonX4); lua_setfield(L, -2, "MouseButtonX4");
-    lua_pushinteger(L, (int) Actions::MouseButtonX5); lua_setfield(L, -2, "MouseButtonX5");
-    lua_pushinteger(L, (int) Actions::Space); lua_setfield(L, -2, "Space");
-    lua_pushinteger(L, (int) Actions::Apostrophe); lua_setfield(L, -2, "Apostrophe");
-    lua_pushinteger(L, (int) Actions::Comma); lua_setfield(L, -2, "Comma");
-    lua_pushinteger(L, (int) Actions::Minus); lua_setfield(L, -2, "Minus");
-    lua_pushinteger(L, (int) Actions::Period); lua_setfield(L, -2, "Period");
-    lua_pushinteger(L, (int) Actions::Slash); lua_setfield(L, -2, "Slash");
-    lua_pushinteger(L, (int) Actions::Num0); lua_setfield(L, -2, "Num0");
-    lua_pushinteger(L, (int) Actions::Num1); lua_setfield(L, -2, "Num1");
-    lua_pushinteger(L, (int) Actions::Num2); lua_setfield(L, -2, "Num2");
-    lua_pushinteger(L, (int) Actions::Num3); lua_setfield(L, -2, "Num3");
-    lua_pushinteger(L, (int) Actions::Num4); lua_setfield(L, -2, "Num4");
-    lua_pushinteger(L, (int) Actions::Num5); lua_setfield(L, -2, "Num5");
-    lua_pushinteger(L, (int) Actions::Num6); lua_setfield(L, -2, "Num6");
-    lua_pushinteger(L, (int) Actions::Num7); lua_setfield(L, -2, "Num7");
-    lua_pushinteger(L, (int) Actions::Num8); lua_setfield(L, -2, "Num8");
-    lua_pushinteger(L, (int) Actions::Num9); lua_setfield(L, -2, "Num9");
-    lua_pushinteger(L, (int) Actions::Semicolon); lua_setfield(L, -2, "Semicolon");
-    lua_pushinteger(L, (int) Actions::Equal); lua_setfield(L, -2, "Equal");
-    lua_pushinteger(L, (int) Actions::A); lua_setfield(L, -2, "A");
-    lua_pushinteger(L, (int) Actions::B); lua_setfield(L, -2, "B");
-    lua_pushinteger(L, (int) Actions::C); lua_setfield(L, -2, "C");
-    lua_pushinteger(L, (int) Actions::D); lua_setfield(L, -2, "D");
-    lua_pushinteger(L, (int) Actions::E); lua_setfield(L, -2, "E");
-    lua_pushinteger(L, (int) Actions::F); lua_setfield(L, -2, "F");
-    lua_pushinteger(L, (int) Actions::G); lua_setfield(L, -2, "G");
-    lua_pushinteger(L, (int) Actions::H); lua_setfield(L, -2, "H");
-    lua_pushinteger(L, (int) Actions::I); lua_setfield(L, -2, "I");
-    lua_pushinteger(L, (int) Actions::J); lua_setfield(L, -2, "J");
-    lua_pushinteger(L, (int) Actions::K); lua_setfield(L, -2, "K");
-    lua_pushinteger(L, (int) Actions::L); lua_setfield(L, -2, "L");
-    lua_pushinteger(L, (int) Actions::M); lua_setfield(L, -2, "M");
-    lua_pushinteger(L, (int) Actions::N); lua_setfield(L, -2, "N");
-    lua_pushinteger(L, (int) Actions::O); lua_setfield(L, -2, "O");
-    lua_pushinteger(L, (int) Actions::P); lua_setfield(L, -2, "P");
-    lua_pushinteger(L, (int) Actions::Q); lua_setfield(L, -2, "Q");
-    lua_pushinteger(L, (int) Actions::R); lua_setfield(L, -2, "R");
-    lua_pushinteger(L, (int) Actions::S); lua_setfield(L, -2, "S");
-    lua_pushinteger(L, (int) Actions::T); lua_setfield(L, -2, "T");
-    lua_pushinteger(L, (int) Actions::U); lua_setfield(L, -2, "U");
-    lua_pushinteger(L, (int) Actions::V); lua_setfield(L, -2, "V");
-    lua_pushinteger(L, (int) Actions::W); lua_setfield(L, -2, "W");
-    lua_pushinteger(L, (int) Actions::X); lua_setfield(L, -2, "X");
-    lua_pushinteger(L, (int) Actions::Y); lua_setfield(L, -2, "Y");
-    lua_pushinteger(L, (int) Actions::Z); lua_setfield(L, -2, "Z");
-    lua_pushinteger(L, (int) Actions::Left_bracket); lua_setfield(L, -2, "Left_bracket");
-    lua_pushinteger(L, (int) Actions::Backslash); lua_setfield(L, -2, "Backslash");
-    lua_pushinteger(L, (int) Actions::Right_bracket); lua_setfield(L, -2, "Right_bracket");
-    lua_pushinteger(L, (int) Actions::Grave_accent); lua_setfield(L, -2, "Grave_accent");
-    lua_pushinteger(L, (int) Actions::World1); lua_setfield(L, -2, "World1");
-    lua_pushinteger(L, (int) Actions::World2); lua_setfield(L, -2, "World2");
-    lua_pushinteger(L, (int) Actions::Escape); lua_setfield(L, -2, "Escape");
-    lua_pushinteger(L, (int) Actions::Enter); lua_setfield(L, -2, "Enter");
-    lua_pushinteger(L, (int) Actions::Tab); lua_setfield(L, -2, "Tab");
-    lua_pushinteger(L, (int) Actions::Backspace); lua_setfield(L, -2, "Backspace");
-    lua_pushinteger(L, (int) Actions::Insert); lua_setfield(L, -2, "Insert");
-    lua_pushinteger(L, (int) Actions::Delete); lua_setfield(L, -2, "Delete");
-    lua_pushinteger(L, (int) Actions::Right); lua_setfield(L, -2, "Right");
-    lua_pushinteger(L, (int) Actions::Left); lua_setfield(L, -2, "Left");
-    lua_pushinteger(L, (int) Actions::Down); lua_setfield(L, -2, "Down");
-    lua_pushinteger(L, (int) Actions::Up); lua_setfield(L, -2, "Up");
-    lua_pushinteger(L, (int) Actions::PageUp); lua_setfield(L, -2, "PageUp");
-    lua_pushinteger(L, (int) Actions::PageDown); lua_setfield(L, -2, "PageDown");
-    lua_pushinteger(L, (int) Actions::Home); lua_setfield(L, -2, "Home");
-    lua_pushinteger(L, (int) Actions::End); lua_setfield(L, -2, "End");
-    lua_pushinteger(L, (int) Actions::CapsLock); lua_setfield(L, -2, "CapsLock");
-    lua_pushinteger(L, (int) Actions::ScrollLock); lua_setfield(L, -2, "ScrollLock");
-    lua_pushinteger(L, (int) Actions::NumLock); lua_setfield(L, -2, "NumLock");
-    lua_pushinteger(L, (int) Actions::PrintScreen); lua_setfield(L, -2, "PrintScreen");
-    lua_pushinteger(L, (int) Actions::Pause); lua_setfield(L, -2, "Pause");
-    lua_pushinteger(L, (int) Actions::F1); lua_setfield(L, -2, "F1");
-    lua_pushinteger(L, (int) Actions::F2); lua_setfield(L, -2, "F2");
-    lua_pushinteger(L, (int) Actions::F3); lua_setfield(L, -2, "F3");
-    lua_pushinteger(L, (int) Actions::F4); lua_setfield(L, -2, "F4");
-    lua_pushinteger(L, (int) Actions::F5); lua_setfield(L, -2, "F5");
-    lua_pushinteger(L, (int) Actions::F6); lua_setfield(L, -2, "F6");
-    lua_pushinteger(L, (int) Actions::F7); lua_setfield(L, -2, "F7");
-    lua_pushinteger(L, (int) Actions::F8); lua_setfield(L, -2, "F8");
-    lua_pushinteger(L, (int) Actions::F9); lua_setfield(L, -2, "F9");
-    lua_pushinteger(L, (int) Actions::F10); lua_setfield(L, -2, "F10");
-    lua_pushinteger(L, (int) Actions::F11); lua_setfield(L, -2, "F11");
-    lua_pushinteger(L, (int) Actions::F12); lua_setfield(L, -2, "F12");
-    lua_pushinteger(L, (int) Actions::F13); lua_setfield(L, -2, "F13");
-    lua_pushinteger(L, (int) Actions::F14); lua_setfield(L, -2, "F14");
-    lua_pushinteger(L, (int) Actions::F15); lua_setfield(L, -2, "F15");
-    lua_pushinteger(L, (int) Actions::F16); lua_setfield(L, -2, "F16");
-    lua_pushinteger(L, (int) Actions::F17); lua_setfield(L, -2, "F17");
-    lua_pushinteger(L, (int) Actions::F18); lua_setfield(L, -2, "F18");
-    lua_pushinteger(L, (int) Actions::F19); lua_setfield(L, -2, "F19");
-    lua_pushinteger(L, (int) Actions::F20); lua_setfield(L, -2, "F20");
-    lua_pushinteger(L, (int) Actions::F21); lua_setfield(L, -2, "F21");
-    lua_pushinteger(L, (int) Actions::F22); lua_setfield(L, -2, "F22");
-    lua_pushinteger(L, (int) Actions::F23); lua_setfield(L, -2, "F23");
-    lua_pushinteger(L, (int) Actions::F24); lua_setfield(L, -2, "F24");
-    lua_pushinteger(L, (int) Actions::F25); lua_setfield(L, -2, "F25");
-    lua_pushinteger(L, (int) Actions::Kp0); lua_setfield(L, -2, "Kp0");
-    lua_pushinteger(L, (int) Actions::Kp1); lua_setfield(L, -2, "Kp1");
-    lua_pushinteger(L, (int) Actions::Kp2); lua_setfield(L, -2, "Kp2");
-    lua_pushinteger(L, (int) Actions::Kp3); lua_setfield(L, -2, "Kp3");
-    lua_pushinteger(L, (int) Actions::Kp4); lua_setfield(L, -2, "Kp4");
-    lua_pushinteger(L, (int) Actions::Kp5); lua_setfield(L, -2, "Kp5");
-    lua_pushinteger(L, (int) Actions::Kp6); lua_setfield(L, -2, "Kp6");
-    lua_pushinteger(L, (int) Actions::Kp7); lua_setfield(L, -2, "Kp7");
-    lua_pushinteger(L, (int) Actions::Kp8); lua_setfield(L, -2, "Kp8");
-    lua_pushinteger(L, (int) Actions::Kp9); lua_setfield(L, -2, "Kp9");
-    lua_pushinteger(L, (int) Actions::KpDecimal); lua_setfield(L, -2, "KpDecimal");
-    lua_pushinteger(L, (int) Actions::KpDivide); lua_setfield(L, -2, "KpDivide");
-    lua_pushinteger(L, (int) Actions::KpMultiply); lua_setfield(L, -2, "KpMultiply");
-    lua_pushinteger(L, (int) Actions::KpSubtract); lua_setfield(L, -2, "KpSubtract");
-    lua_pushinteger(L, (int) Actions::KpAdd); lua_setfield(L, -2, "KpAdd");
-    lua_pushinteger(L, (int) Actions::KpEnter); lua_setfield(L, -2, "KpEnter");
-    lua_pushinteger(L, (int) Actions::KpEqual); lua_setfield(L, -2, "KpEqual");
-    lua_pushinteger(L, (int) Actions::LeftShift); lua_setfield(L, -2, "LeftShift");
-    lua_pushinteger(L, (int) Actions::LeftControl); lua_setfield(L, -2, "LeftControl");
-    lua_pushinteger(L, (int) Actions::LeftAlt); lua_setfield(L, -2, "LeftAlt");
-    lua_pushinteger(L, (int) Actions::LeftSuper); lua_setfield(L, -2, "LeftSuper");
-    lua_pushinteger(L, (int) Actions::RightShift); lua_setfield(L, -2, "RightShift");
-    lua_pushinteger(L, (int) Actions::RightControl); lua_setfield(L, -2, "RightControl");
-    lua_pushinteger(L, (int) Actions::RightAlt); lua_setfield(L, -2, "RightAlt");
-    lua_pushinteger(L, (int) Actions::RightSuper); lua_setfield(L, -2, "RightSuper");
-    lua_pushinteger(L, (int) Actions::Menu); lua_setfield(L, -2, "Menu");
+    lua_pushnil(L);
+    while (lua_next(L, clips_arg)) {
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        load_clip(L, texture, frame_size, columns);
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, -1);
+        lua_pushinteger(L, animators.clips.size() - 1);
+        lua_settable(L, result);
+    }
+
+    return 1;
+}
+
+void start_clip(u32 index, u32 clip) {
+    animators.clip[index] = clip;
+    animators.frame[index] = 0;
+    animators.time[index] = 0.0f;
+    animators.direction[index] = 1;
+    animators.state[index] = ANIMATOR_PLAYING;
+    sync_animator_sprite(index);
+    queue_frame_event(index);
+}
+
+// Animator.new(clip, {entity = id, speed = 1, on_event = function(animator, name) end})
+int lua_animator_new(lua_State *L) {
+    u32 clip = check_clip(L, 1);
+
+    u32 index;
+    if (animators.free.size() > 0) {
+        index = animators.free.back();
+        animators.free.pop();
+    } else {
+        index = animators.state.size();
+        animators.clip.push(halloc, 0);
+        animators.frame.push(halloc, 0);
+        animators.generation.push(halloc, 0);
+        animators.time.push(halloc, 0.0f);
+        animators.speed.push(halloc, 1.0f);
+        animators.direction.push(halloc, 1);
+        animators.state.push(halloc, ANIMATOR_FREE);
+        animators.entity.push(halloc, NO_ENTITY);
+        animators.on_event_ref.push(halloc, LUA_NOREF);
+    }
+
+    animators.speed[index] = 1.0f;
+    animators.entity[index] = NO_ENTITY;
+    animators.on_event_ref[index] = LUA_NOREF;
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "speed");
+        animators.speed[index] = luaL_optnumber(L, -1, 1.0);
+        lua_getfield(L, 2, "entity");
+        if (!lua_isnil(L, -1)) animators.entity[index] = luaL_checkinteger(L, -1);
+        lua_pop(L, 2);
+
+        lua_getfield(L, 2, "on_event");
+        if (lua_isfunction(L, -1)) {
+            animators.on_event_ref[index] = luaL_ref(L, LUA_REGISTRYINDEX);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
 
-    lua_setglobal(L, "Actions");
+    start_clip(index, clip);
+    lua_pushinteger(L, ((lua_Integer) animators.generation[index] << 32) | index);
+    return 1;
 }
 
-void get_v2_op_args(Vector2 *lhs, Vector2 *rhs, lua_State *L) {
-    luaL_checktype(L, 1, LUA_TTABLE);
-    luaL_checktype(L, 2, LUA_TTABLE);
+// Animator.play(animator, clip, [restart]) switches clips, playing the current clip
+// again only restarts it when asked to.
+int lua_animator_play(lua_State *L) {
+    i64 index = animator_from_lua(L, 1);
+    if (index < 0) return 0;
 
-    lua_getfield(L, 1, "x");
-    lhs->x = luaL_checknumber(L, -1);
-    lua_getfield(L, 1, "y");
-    lhs->y = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+    u32 clip = check_clip(L, 2);
+    if (clip != animators.clip[index] || lua_toboolean(L, 3) || animators.state[index] == ANIMATOR_FINISHED) {
+        start_clip(index, clip);
+    } else {
+        animators.state[index] = ANIMATOR_PLAYING;
+    }
+    return 0;
+}
 
-    lua_getfield(L, 2, "x");
-    rhs->x = luaL_checknumber(L, -1);
-    lua_getfield(L, 2, "y");
-    rhs->y = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+int lua_animator_pause(lua_State *L) {
+    i64 index = animator_from_lua(L, 1);
+    if (index >= 0 && animators.state[index] == ANIMATOR_PLAYING) animators.state[index] = ANIMATOR_PAUSED;
+    return 0;
 }
 
-void push_v2(lua_State *L, const Vector2 &vector) {
-    lua_newtable(L);
-    lua_pushnumber(L, vector.x); lua_setfield(L, -2, "x");
-    lua_pushnumber(L, vector.y); lua_setfield(L, -2, "y");
+int lua_animator_resume(lua_State *L) {
+    i64 index = animator_from_lua(L, 1);
+    if (index >= 0 && animators.state[index] == ANIMATOR_PAUSED) animators.state[index] = ANIMATOR_PLAYING;
+    return 0;
 }
 
-int lua_v2(lua_State *L) {
-    float x = luaL_checknumber(L, 1);
-    float y = luaL_optnumber(L, 2, x); // default to same as x so you can go: v2(1)
-    push_v2(L, {x, y});
-    return 1;
+int lua_animator_set_speed(lua_State *L) {
+    i64 index = animator_from_lua(L, 1);
+    if (index >= 0) animators.speed[index] = luaL_checknumber(L, 2);
+    return 0;
 }
 
-int lua_v2_add(lua_State *L) {
-    Vector2 lhs, rhs;
-    get_v2_op_args(&lhs, &rhs, L);
-    push_v2(L, lhs + rhs);
-    return 1;
+// Animator.frame(animator) -> frame number in the clip counting from 1, finished
+int lua_animator_frame(lua_State *L) {
+    i64 index = animator_from_lua(L, 1);
+    if (index < 0) return 0;
+
+    lua_pushinteger(L, animators.frame[index] + 1);
+    lua_pushboolean(L, animators.state[index] == ANIMATOR_FINISHED);
+    return 2;
 }
 
-int lua_v2_sub(lua_State *L) {
-    Vector2 lhs, rhs;
-    get_v2_op_args(&lhs, &rhs, L);
-    push_v2(L, lhs - rhs);
-    return 1;
+// Animator.region(animator) -> x, y, w, h of the current frame in the sheet
+int lua_animator_region(lua_State *L) {
+    i64 index = animator_from_lua(L, 1);
+    if (index < 0) return 0;
+
+    const Rect2 &region = animators.frames[animators.clips[animators.clip[index]].first + animators.frame[index]];
+    lua_pushnumber(L, region.position.x);
+    lua_pushnumber(L, region.position.y);
+    lua_pushnumber(L, region.size.x);
+    lua_pushnumber(L, region.size.y);
+    return 4;
 }
 
-int lua_v2_mul(lua_State *L) {
-    Vector2 lhs, rhs;
-    get_v2_op_args(&lhs, &rhs, L);
-    push_v2(L, lhs * rhs);
-    return 1;
+int lua_animator_destroy(lua_State *L) {
+    i64 index = animator_from_lua(L, 1);
+    if (index < 0) return 0;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, animators.on_event_ref[index]);
+    animators.on_event_ref[index] = LUA_NOREF;
+    animators.state[index] = ANIMATOR_FREE;
+    animators.generation[index]++;
+    animators.free.push(halloc, index);
+    return 0;
 }
 
-int lua_v2_div(lua_State *L) {
-    Vector2 lhs, rhs;
-    get_v2_op_args(&lhs, &rhs, L);
-    push_v2(L, lhs / rhs);
+int lua_animator_count(lua_State *L) {
+    lua_pushinteger(L, animators.state.size() - animators.free.size());
     return 1;
 }
 
-int lua_v2_normalize(lua_State *L) {
-    lua_getfield(L, 1, "x");
-    float x = luaL_checknumber(L, -1);
-    lua_getfield(L, 1, "y");
-    float y = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+void bind_animators_to_lua(lua_State *L) {
+    animators.L = L;
 
-    push_v2(L, Vector2(x, y).normalized());
-    return 1;
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_animator_sheet); lua_setfield(L, -2, "sheet");
+    lua_pushcfunction(L, lua_animator_new); lua_setfield(L, -2, "new");
+    lua_pushcfunction(L, lua_animator_play); lua_setfield(L, -2, "play");
+    lua_pushcfunction(L, lua_animator_pause); lua_setfield(L, -2, "pause");
+    lua_pushcfunction(L, lua_animator_resume); lua_setfield(L, -2, "resume");
+    lua_pushcfunction(L, lua_animator_set_speed); lua_setfield(L, -2, "set_speed");
+    lua_pushcfunction(L, lua_animator_frame); lua_setfield(L, -2, "frame");
+    lua_pushcfunction(L, lua_animator_region); lua_setfield(L, -2, "region");
+    lua_pushcfunction(L, lua_animator_destroy); lua_setfield(L, -2, "destroy");
+    lua_pushcfunction(L, lua_animator_count); lua_setfield(L, -2, "count");
+
+    lua_pushinteger(L, ANIMATION_LOOP); lua_setfield(L, -2, "Loop");
+    lua_pushinteger(L, ANIMATION_ONCE); lua_setfield(L, -2, "Once");
+    lua_pushinteger(L, ANIMATION_PING_PONG); lua_setfield(L, -2, "PingPong");
+    lua_setglobal(L, "Animator");
 }
 
-int lua_v2_length(lua_State *L) {
-    lua_getfield(L, 1, "x");
-    float x = luaL_checknumber(L, -1);
-    lua_getfield(L, 1, "y");
-    float y = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+// Display lists hold draw commands that Lua records once, static backgrounds and HUD
+// frames then replay every frame from native code under an offset, scale and z
+// offset. Items carry their bounds so replaying culls against the view rect, sprites
+// are only culled when their size is known from a region or an explicit `size`.
 
-    lua_pushinteger(L, Vector2(x, y).length());
-    return 1;
+enum DisplayItemKind : u8 {
+    DISPLAY_RECT,
+    DISPLAY_SPRITE,
+};
+
+struct DisplayItem {
+    DisplayItemKind kind;
+    bool bounded;
+    int z_index;
+    u32 index; // into the list's rects or sprites
+    Rect2 bounds;
+};
+
+struct DisplayList {
+    u32 generation;
+    bool active;
+
+    DArray<DisplayItem> items;
+    DArray<Rect2DCmd> rect_cmds;
+    DArray<Rect2> rects;
+    DArray<Sprite2DCmd> sprites;
+
+    bool bounded; // false once any item has no known size
+    Rect2 bounds;
+};
+
+DArray<DisplayList *> display_lists;
+DArray<u32> free_display_lists;
+
+DisplayList *display_list_from_lua(lua_State *L, int arg) {
+    lua_Integer handle = luaL_checkinteger(L, arg);
+    u32 index = handle & 0xffffffff;
+    if (index >= display_lists.size()) return nullptr;
+
+    DisplayList *list = display_lists[index];
+    if (!list->active || list->generation != (u32) (handle >> 32)) return nullptr;
+    return list;
 }
 
-int lua_v2_angle(lua_State *L) {
-    lua_getfield(L, 1, "x");
-    float x = luaL_checknumber(L, -1);
-    lua_getfield(L, 1, "y");
-    float y = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+bool rects_overlap(const Rect2 &a, const Rect2 &b) {
+    return a.position.x <= b.position.x + b.size.x && b.position.x <= a.position.x + a.size.x &&
+           a.position.y <= b.position.y + b.size.y && b.position.y <= a.position.y + a.size.y;
+}
 
-    lua_pushinteger(L, Vector2(x, y).angle());
-    return 1;
+void add_display_item(DisplayList *list, DisplayItem item) {
+    if (!item.bounded) {
+        list->bounded = false;
+    } else if (list->items.size() == 0) {
+        list->bounds = item.bounds;
+    } else {
+        float left = fminf(list->bounds.position.x, item.bounds.position.x);
+        float top = fminf(list->bounds.position.y, item.bounds.position.y);
+        float right = fmaxf(list->bounds.position.x + list->bounds.size.x, item.bounds.position.x + item.bounds.size.x);
+        float bottom = fmaxf(list->bounds.position.y + list->bounds.size.y, item.bounds.position.y + item.bounds.size.y);
+        list->bounds = {{left, top}, {right - left, bottom - top}};
+    }
+    list->items.push(halloc, item);
 }
 
-int lua_rect2s_overlap(lua_State *L) {
-    Rect2 a, b;
-    load_rect2(L, a, 1);
-    load_rect2(L, b, 2);
-    lua_pushboolean(L, a.intersects(b));
+Rect2 transform_rect(const Rect2 &rect, Vector2 offset, float scale) {
+    return {{offset.x + rect.position.x * scale, offset.y + rect.position.y * scale}, {rect.size.x * scale, rect.size.y * scale}};
+}
+
+void replay_display_list(DisplayList *list, Vector2 offset, float scale, int z_offset) {
+    if (list->bounded && list->items.size() > 0 && !rects_overlap(transform_rect(list->bounds, offset, scale), view_rect)) {
+        render_stats.culled += list->items.size();
+        return;
+    }
+
+    bool identity = offset.x == 0.0f && offset.y == 0.0f && scale == 1.0f;
+
+    for (const DisplayItem &item : list->items) {
+        if (item.bounded && !in_view(identity ? item.bounds : transform_rect(item.bounds, offset, scale))) continue;
+
+        if (item.kind == DISPLAY_RECT) {
+            if (identity) {
+                submit_cmd(list->rect_cmds[item.index], list->rects[item.index], item.z_index + z_offset);
+            } else {
+                Rect2 rect = transform_rect(list->rects[item.index], offset, scale);
+                Rect2DCmd cmd = list->rect_cmds[item.index];
+                cmd.set(rect);
+                submit_cmd(cmd, rect, item.z_index + z_offset);
+            }
+        } else {
+            Sprite2DCmd cmd = list->sprites[item.index];
+            if (!identity) {
+                cmd.position = {offset.x + cmd.position.x * scale, offset.y + cmd.position.y * scale};
+                cmd.scale = {cmd.scale.x * scale, cmd.scale.y * scale};
+            }
+            submit_cmd(cmd, item.z_index + z_offset);
+        }
+    }
+}
+
+int lua_display_list_new(lua_State *L) {
+    u32 index;
+    if (free_display_lists.size() > 0) {
+        index = free_display_lists.back();
+        free_display_lists.pop();
+    } else {
+        index = display_lists.size();
+        display_lists.push(halloc, new DisplayList{});
+    }
+
+    DisplayList *list = display_lists[index];
+    list->active = true;
+    list->bounded = true;
+    list->bounds = {};
+
+    lua_pushinteger(L, ((lua_Integer) list->generation << 32) | index);
     return 1;
 }
 
-int lua_rect2_has_point(lua_State *L) {
+// DisplayList.rect(list, {position = v2(), size = v2(), color = {}, ...}), same table as draw_rect2
+int lua_display_list_rect(lua_State *L) {
+    DisplayList *list = display_list_from_lua(L, 1);
+    if (!list) return 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    Rect2DCmd cmd;
     Rect2 rect;
-    load_rect2(L, rect, 1);
+    DisplayItem item = {DISPLAY_RECT, true, 0, (u32) list->rects.size(), {}};
+    read_rect2_cmd(L, 2, cmd, rect, item.z_index);
 
-    lua_getfield(L, 2, "x");
-    float x = luaL_checknumber(L, -1);
-    lua_getfield(L, 2, "y");
-    float y = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+    item.bounds = rect;
+    list->rect_cmds.push(halloc, cmd);
+    list->rects.push(halloc, rect);
+    add_display_item(list, item);
+    return 0;
+}
 
-    lua_pushboolean(L, rect.has_point({x, y}));
-    return 1;
+// DisplayList.sprite(list, {position = v2(), texture = tex, size = v2(), ...}), same table
+// as draw_sprite. `size` or `region` give the drawn size in texture pixels for culling.
+int lua_display_list_sprite(lua_State *L) {
+    DisplayList *list = display_list_from_lua(L, 1);
+    if (!list) return 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    Sprite2DCmd cmd;
+    DisplayItem item = {DISPLAY_SPRITE, false, 0, (u32) list->sprites.size(), {}};
+    read_sprite_cmd(L, 2, cmd, item.z_index);
+
+    Vector2 size;
+    lua_getfield(L, 2, "size");
+    bool has_size = lua_istable(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "region");
+    bool has_region = lua_istable(L, -1);
+    lua_pop(L, 1);
+
+    if (has_size) {
+        load_v2(L, size, "size", 2);
+    } else if (has_region) {
+        size = cmd.region.size;
+    }
+
+    // Same conservative box as sprite_in_view, the anchor isn't known here either.
+    if (has_size || has_region) {
+        item.bounds = sprite_bounds(cmd, size);
+        item.bounded = true;
+    }
+
+    list->sprites.push(halloc, cmd);
+    add_display_item(list, item);
+    return 0;
 }
 
-int lua_get_axis(lua_State *L) {
-    int negitive = luaL_checkinteger(L, 1);
-    int positive = luaL_checkinteger(L, 2);
-    lua_pushnumber(L, Input::get_axis((Actions) negitive, (Actions) positive));
-    return 1;
+// DisplayList.draw(list, [x, y, scale, z_offset])
+int lua_display_list_draw(lua_State *L) {
+    DisplayList *list = display_list_from_lua(L, 1);
+    if (!list) return 0;
+
+    Vector2 offset = {(float) luaL_optnumber(L, 2, 0.0), (float) luaL_optnumber(L, 3, 0.0)};
+    replay_display_list(list, offset, luaL_optnumber(L, 4, 1.0), luaL_optinteger(L, 5, 0));
+    return 0;
 }
 
-int lua_get_direction(lua_State *L) {
-    if (!lua_istable(L, 1)) {
-        RETURN_ERROR(L, "{up: Actions.W, left: Actions.A, down: Actions.S, right: Actions.D} as the first argument");
+void clear_display_list(DisplayList *list) {
+    list->items.resize(halloc, 0);
+    list->rect_cmds.resize(halloc, 0);
+    list->rects.resize(halloc, 0);
+    list->sprites.resize(halloc, 0);
+    list->bounded = true;
+    list->bounds = {};
+}
+
+int lua_display_list_clear(lua_State *L) {
+    DisplayList *list = display_list_from_lua(L, 1);
+    if (list) clear_display_list(list);
+    return 0;
+}
+
+// DisplayList.bounds(list) -> x, y, w, h, nothing when some item has no known size
+int lua_display_list_bounds(lua_State *L) {
+    DisplayList *list = display_list_from_lua(L, 1);
+    if (!list || !list->bounded) return 0;
+
+    lua_pushnumber(L, list->bounds.position.x);
+    lua_pushnumber(L, list->bounds.position.y);
+    lua_pushnumber(L, list->bounds.size.x);
+    lua_pushnumber(L, list->bounds.size.y);
+    return 4;
+}
+
+int lua_display_list_destroy(lua_State *L) {
+    DisplayList *list = display_list_from_lua(L, 1);
+    if (!list) return 0;
+
+    clear_display_list(list);
+    list->active = false;
+    list->generation++;
+    free_display_lists.push(halloc, luaL_checkinteger(L, 1) & 0xffffffff);
+    return 0;
+}
+
+void bind_display_lists_to_lua(lua_State *L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_display_list_new); lua_setfield(L, -2, "new");
+    lua_pushcfunction(L, lua_display_list_rect); lua_setfield(L, -2, "rect");
+    lua_pushcfunction(L, lua_display_list_sprite); lua_setfield(L, -2, "sprite");
+    lua_pushcfunction(L, lua_display_list_draw); lua_setfield(L, -2, "draw");
+    lua_pushcfunction(L, lua_display_list_clear); lua_setfield(L, -2, "clear");
+    lua_pushcfunction(L, lua_display_list_bounds); lua_setfield(L, -2, "bounds");
+    lua_pushcfunction(L, lua_display_list_destroy); lua_setfield(L, -2, "destroy");
+    lua_setglobal(L, "DisplayList");
+}
+
+// Actors are Lua states of their own that tick on the job system. They share nothing
+// with the main state, values are serialized into byte blobs and passed through
+// single producer single consumer queues. Every actor ticks once per frame between
+// PreUpdate and PostUpdate.
+
+#define ACTOR_QUEUE_SIZE 1024 // must be a power of two
+#define ACTOR_MAX_DEPTH 32
+
+enum MessageTag : u8 {
+    MSG_NIL,
+    MSG_FALSE,
+    MSG_TRUE,
+    MSG_INTEGER,
+    MSG_NUMBER,
+    MSG_STRING,
+    MSG_TABLE,
+    MSG_TABLE_END,
+};
+
+struct ActorMessage {
+    u8 *data;
+    u64 size;
+};
+
+struct MessageQueue {
+    std::atomic<u64> head{0};
+    std::atomic<u64> tail{0};
+    ActorMessage messages[ACTOR_QUEUE_SIZE];
+
+    bool push(ActorMessage message) {
+        u64 t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= ACTOR_QUEUE_SIZE) return false;
+
+        messages[t & (ACTOR_QUEUE_SIZE - 1)] = message;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
     }
 
-    lua_getfield(L, 1, "left");
-    Actions left = (Actions) luaL_checkinteger(L, -1);
+    bool pop(ActorMessage *message) {
+        u64 h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
 
-    lua_getfield(L, 1, "right");
-    Actions right = (Actions) luaL_checkinteger(L, -1);
+        *message = messages[h & (ACTOR_QUEUE_SIZE - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
 
-    lua_getfield(L, 1, "up");
-    Actions up = (Actions) luaL_checkinteger(L, -1);
+void write_message_bytes(DArray<u8> &out, const void *data, u64 size) {
+    const u8 *bytes = (const u8 *) data;
+    for (u64 i = 0; i < size; ++i) out.push(halloc, bytes[i]);
+}
 
-    lua_getfield(L, 1, "down");
-    Actions down = (Actions) luaL_checkinteger(L, -1);
+// Returns nullptr on success, otherwise a description of what could not be sent.
+const char *serialize_lua_value(lua_State *L, int index, DArray<u8> &out, int depth = 0) {
+    index = lua_absindex(L, index);
+    switch (lua_type(L, index)) {
+        case LUA_TNIL: {
+            out.push(halloc, MSG_NIL);
+        } break;
+        case LUA_TBOOLEAN: {
+            out.push(halloc, lua_toboolean(L, index) ? MSG_TRUE : MSG_FALSE);
+        } break;
+        case LUA_TNUMBER: {
+            if (lua_isinteger(L, index)) {
+                lua_Integer value = lua_tointeger(L, index);
+                out.push(halloc, MSG_INTEGER);
+                write_message_bytes(out, &value, sizeof(value));
+            } else {
+                lua_Number value = lua_tonumber(L, index);
+                out.push(halloc, MSG_NUMBER);
+                write_message_bytes(out, &value, sizeof(value));
+            }
+        } break;
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char *str = lua_tolstring(L, index, &len);
+            u64 size = len;
+            out.push(halloc, MSG_STRING);
+            write_message_bytes(out, &size, sizeof(size));
+            write_message_bytes(out, str, len);
+        } break;
+        case LUA_TTABLE: {
+            if (depth >= ACTOR_MAX_DEPTH) return "message is nested too deeply (cyclic table?)";
+
+            out.push(halloc, MSG_TABLE);
+            lua_pushnil(L);
+            while (lua_next(L, index)) {
+                const char *error = serialize_lua_value(L, -2, out, depth + 1);
+                if (!error) error = serialize_lua_value(L, -1, out, depth + 1);
+                if (error) {
+                    lua_pop(L, 2);
+                    return error;
+                }
+                lua_pop(L, 1);
+            }
+            out.push(halloc, MSG_TABLE_END);
+        } break;
+        default: return "only nil, booleans, numbers, strings and tables can be sent between actors";
+    }
+    return nullptr;
+}
 
-    push_v2(L, Input::get_direction(up, down, left, right));
-    return 1;
+void deserialize_lua_value(lua_State *L, const u8 *&at) {
+    u8 tag = *at++;
+    switch (tag) {
+        case MSG_FALSE: lua_pushboolean(L, false); break;
+        case MSG_TRUE: lua_pushboolean(L, true); break;
+        case MSG_INTEGER: {
+            lua_Integer value;
+            memcpy(&value, at, sizeof(value));
+            at += sizeof(value);
+            lua_pushinteger(L, value);
+        } break;
+        case MSG_NUMBER: {
+            lua_Number value;
+            memcpy(&value, at, sizeof(value));
+            at += sizeof(value);
+            lua_pushnumber(L, value);
+        } break;
+        case MSG_STRING: {
+            u64 size;
+            memcpy(&size, at, sizeof(size));
+            at += sizeof(size);
+            lua_pushlstring(L, (const char *) at, size);
+            at += size;
+        } break;
+        case MSG_TABLE: {
+            lua_newtable(L);
+            while (*at != MSG_TABLE_END) {
+                deserialize_lua_value(L, at);
+                deserialize_lua_value(L, at);
+                lua_rawset(L, -3);
+            }
+            at++;
+        } break;
+        default: lua_pushnil(L); break;
+    }
 }
 
-int lua_mouse_position(lua_State *L) {
-    push_v2(L, Input::get_mouse_position());
-    return 1;
+// Serializes the value at `index` into a message, errors back into Lua if it can't be.
+ActorMessage check_message(lua_State *L, int index) {
+    DArray<u8> bytes;
+    const char *error = serialize_lua_value(L, index, bytes);
+    if (error) {
+        bytes.free();
+        luaL_error(L, "Could not send message: %s", error);
+    }
+
+    ActorMessage message = {new u8[bytes.size()], bytes.size()};
+    memcpy(message.data, &bytes[0], bytes.size());
+    bytes.free();
+    return message;
 }
 
-int lua_mouse_delta(lua_State *L) {
-    push_v2(L, Input::get_mouse_delta());
+void free_message(ActorMessage message) {
+    delete[] message.data;
+}
+
+struct Actor {
+    lua_State *L;
+    MessageQueue inbox;  // main state -> actor
+    MessageQueue outbox; // actor -> main state
+
+    lua_State *owner;
+    int on_message_ref = LUA_NOREF; // lives in the owner state
+
+    std::atomic<bool> killed{false};
+    bool failed = false;
+    u64 dropped = 0;
+
+    char error[512] = {}; // written by the actor's worker, logged from the main thread
+};
+
+DArray<Actor *> actors;
+DArray<Actor *> spawned_actors;
+JobCounter *actor_tick = nullptr;
+double actor_delta = 0.0;
+
+Actor *actor_from_state(lua_State *L) {
+    return *(Actor **) lua_getextraspace(L);
+}
+
+int lua_actor_send_to_owner(lua_State *L) {
+    Actor *actor = actor_from_state(L);
+    ActorMessage message = check_message(L, 1);
+    if (!actor->outbox.push(message)) {
+        free_message(message);
+        actor->dropped++;
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    lua_pushboolean(L, true);
     return 1;
 }
 
-int lua_is_pressed(lua_State *L) {
-    int action = luaL_checkinteger(L, 1);
-    lua_pushboolean(L, Input::is_pressed((Actions) action));
+void run_actor_ticks(void *, u64 begin, u64 end) {
+    for (u64 i = begin; i < end; ++i) {
+        Actor *actor = actors[i];
+        if (actor->killed.load(std::memory_order_acquire) || actor->failed) continue;
+
+        lua_State *L = actor->L;
+        ActorMessage message;
+        while (actor->inbox.pop(&message)) {
+            lua_getglobal(L, "on_message");
+            const u8 *at = message.data;
+            deserialize_lua_value(L, at);
+            free_message(message);
+
+            if (!lua_isfunction(L, -2)) {
+                lua_pop(L, 2);
+                continue;
+            }
+            if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+                snprintf(actor->error, sizeof(actor->error), "%s", lua_tostring(L, -1));
+                lua_pop(L, 1);
+                actor->failed = true;
+                break;
+            }
+        }
+
+        if (actor->failed) continue;
+
+        if (lua_getglobal(L, "Tick") == LUA_TFUNCTION) {
+            lua_pushnumber(L, actor_delta);
+            if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+                snprintf(actor->error, sizeof(actor->error), "%s", lua_tostring(L, -1));
+                lua_pop(L, 1);
+                actor->failed = true;
+            }
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+}
+
+void kick_actors(Events::PreUpdate &) {
+    for (Actor *actor : spawned_actors) {
+        actors.push(halloc, actor);
+    }
+    spawned_actors.resize(halloc, 0);
+
+    if (actors.size() == 0) return;
+
+    actor_delta = Time::delta();
+    actor_tick = parallel_for(actors.size(), 1, run_actor_ticks, nullptr);
+}
+
+void sync_actors(Events::PostUpdate &) {
+    if (!actor_tick) return;
+
+    // The tick barrier, nothing below runs while an actor is still ticking.
+    wait_jobs(actor_tick);
+    free_jobs(actor_tick);
+    actor_tick = nullptr;
+
+    for (u64 i = 0; i < actors.size(); ++i) {
+        Actor *actor = actors[i];
+        lua_State *L = actor->owner;
+
+        if (actor->error[0]) {
+            // A failed actor stops ticking but lives on until its handle is killed.
+            LOG_ERROR("ERROR: actor stopped: %", actor->error);
+            actor->error[0] = 0;
+        }
+
+        ActorMessage message;
+        while (actor->outbox.pop(&message)) {
+            if (actor->on_message_ref == LUA_NOREF) {
+                free_message(message);
+                continue;
+            }
+
+            lua_rawgeti(L, LUA_REGISTRYINDEX, actor->on_message_ref);
+            const u8 *at = message.data;
+            deserialize_lua_value(L, at);
+            free_message(message);
+
+            if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+                LOG_ERROR("ERROR: could not call Lua callback: %\n", lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+
+        if (actor->killed.load()) {
+            while (actor->inbox.pop(&message)) free_message(message);
+            luaL_unref(L, LUA_REGISTRYINDEX, actor->on_message_ref);
+            lua_close(actor->L);
+            delete actor;
+
+            actors.remove_at(i--);
+        }
+    }
+}
+
+#define ACTOR_META "Lovial.Actor"
+
+struct LuaActor {
+    Actor *actor;
+};
+
+Actor *check_actor(lua_State *L, int arg) {
+    LuaActor *handle = (LuaActor *) luaL_checkudata(L, arg, ACTOR_META);
+    if (!handle->actor) luaL_error(L, "Actor has already been killed");
+    return handle->actor;
+}
+
+int lua_actor_send(lua_State *L) {
+    Actor *actor = check_actor(L, 1);
+    ActorMessage message = check_message(L, 2);
+    if (!actor->inbox.push(message)) {
+        free_message(message);
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    lua_pushboolean(L, true);
     return 1;
 }
 
-int lua_is_typed(lua_State *L) {
-    int action = luaL_checkinteger(L, 1);
-    lua_pushboolean(L, Input::is_typed((Actions) action));
-    return 1;
-}
+int lua_actor_on_message(lua_State *L) {
+    Actor *actor = check_actor(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, actor->on_message_ref);
+    lua_pushvalue(L, 2);
+    actor->on_message_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+int lua_actor_kill(lua_State *L) {
+    LuaActor *handle = (LuaActor *) luaL_checkudata(L, 1, ACTOR_META);
+    if (handle->actor) {
+        handle->actor->killed.store(true);
+        handle->actor = nullptr;
+    }
+    return 0;
+}
+
+// Only pure functions are safe to share, anything touching the window, renderer,
+// physics or the global rng stays in the main state.
+void bind_actor_api(lua_State *L) {
+    bind_function(L, "send", lua_actor_send_to_owner);
+
+    bind_function(L, "v2", lua_v2);
+    bind_function(L, "v2_add", lua_v2_add);
+    bind_function(L, "v2_sub", lua_v2_sub);
+    bind_function(L, "v2_mul", lua_v2_mul);
+    bind_function(L, "v2_div", lua_v2_div);
+    bind_function(L, "v2_normalize", lua_v2_normalize);
+    bind_function(L, "v2_length", lua_v2_length);
+    bind_function(L, "v2_angle", lua_v2_angle);
+
+    bind_function(L, "rect2s_overlap", lua_rect2s_overlap);
+    bind_function(L, "rect2_has_point", lua_rect2_has_point);
+}
+
+int lua_spawn_actor(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+
+    Actor *actor = new Actor;
+    actor->owner = L;
+    actor->L = luaL_newstate();
+    *(Actor **) lua_getextraspace(actor->L) = actor;
+    luaL_openlibs(actor->L);
+    bind_actor_api(actor->L);
+
+    if (luaL_dofile(actor->L, path) != LUA_OK) {
+        LOG_ERROR("Couldn't spawn actor '%': %", path, lua_tostring(actor->L, -1));
+        lua_close(actor->L);
+        delete actor;
+        return luaL_error(L, "Couldn't spawn actor '%s'", path);
+    }
 
-int lua_is_just_pressed(lua_State *L) {
-    int action = luaL_checkinteger(L, 1);
-    lua_pushboolean(L, Input::is_just_pressed((Actions) action));
-    return 1;
-}
+    spawned_actors.push(halloc, actor);
 
-int lua_is_just_released(lua_State *L) {
-    int action = luaL_checkinteger(L, 1);
-    lua_pushboolean(L, Input::is_just_released((Actions) action));
+    LuaActor *handle = (LuaActor *) lua_newuserdatauv(L, sizeof(LuaActor), 0);
+    handle->actor = actor;
+    luaL_setmetatable(L, ACTOR_META);
     return 1;
 }
 
-int lua_string_typed(lua_State *L) {
-    View<char> chars = Input::get_chars_typed();
-    lua_pushlstring(L, chars.ptr(), chars.size());
-    return 1;
-}
+void bind_actors_to_lua(lua_State *L) {
+    luaL_newmetatable(L, ACTOR_META);
+    lua_pushvalue(L, -1); lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_actor_send); lua_setfield(L, -2, "send");
+    lua_pushcfunction(L, lua_actor_on_message); lua_setfield(L, -2, "on_message");
+    lua_pushcfunction(L, lua_actor_kill); lua_setfield(L, -2, "kill");
+    lua_pushcfunction(L, lua_actor_kill); lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
 
-int lua_delta(lua_State *L) {
-    lua_pushnumber(L, Time::delta());
-    return 1;
+    bind_function(L, "spawn_actor", lua_spawn_actor);
 }
 
-int lua_randi_between(lua_State *L) {
-    int low = luaL_checkinteger(L, 1);
-    int high = luaL_checkinteger(L, 2);
+// Metrics registry for soak tests. Counters, gauges and histograms are updated by the
+// engine once per frame and by Lua through the Metrics table. Every metrics_interval
+// seconds the registry is written in the Prometheus text format to metrics_file and/or
+// to whoever connected to the metrics_socket UNIX socket since the last export, e.g.
+// `socat - UNIX-CONNECT:lovial.sock`.
 
-    lua_pushinteger(L, rng::between(low, high));
-    return 1;
-}
+enum MetricType {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+};
 
-int lua_randf_between(lua_State *L) {
-    float low = luaL_checknumber(L, 1);
-    float high = luaL_checknumber(L, 2);
+struct Metric {
+    char name[64];
+    char help[128];
+    int type;
+    double value;
+
+    // Histograms only, buckets[i] counts observations <= bounds[i].
+    DArray<double> bounds;
+    DArray<u64> buckets;
+    double sum;
+    u64 count;
+};
 
-    lua_pushnumber(L, rng::between(low, high));
-    return 1;
-}
+struct MetricsRegistry {
+    lua_State *L = nullptr;
+    DArray<Metric> metrics;
 
-int lua_randv2_between(lua_State *L) {
-    lua_getfield(L, 1, "x");
-    float x1 = luaL_checknumber(L, -1);
-    lua_getfield(L, 1, "y");
-    float y1 = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+    const char *file = nullptr;
+    const char *socket_path = nullptr;
+    double interval = 5.0;
+    double clock = 0.0;
+    double next_export = 0.0;
+    int socket = -1;
 
-    lua_getfield(L, 2, "x");
-    float x2 = luaL_checknumber(L, -1);
-    lua_getfield(L, 2, "y");
-    float y2 = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+    u64 gc_cycles = 0;
+    DArray<char> text; // reused by every export
 
-    push_v2(L, Vector2(rng::between(x1, x2), rng::between(y1, y2)));
-    return 1;
+    // Engine metrics, registered in bind_metrics_to_lua().
+    u32 frames, frame_seconds, lua_heap, gc_cycles_total, static_arena, frame_arena,
+        registry_refs, texture_bytes, render_commands, watchdog_overruns;
+};
+
+MetricsRegistry metrics;
+
+bool valid_metric_name(const char *name) {
+    if (!*name || strlen(name) >= sizeof(Metric::name)) return false;
+    for (const char *c = name; *c; ++c) {
+        bool letter = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '_' || *c == ':';
+        bool digit = *c >= '0' && *c <= '9';
+        if (!letter && !(digit && c != name)) return false;
+    }
+    return true;
 }
 
-int lua_randf(lua_State *L) {
-    lua_pushnumber(L, rng::randf());
-    return 1;
+// Returns the existing metric when the name is taken by one of the same type.
+i64 register_metric(const char *name, const char *help, int type) {
+    for (u64 i = 0; i < metrics.metrics.size(); ++i) {
+        if (strcmp(metrics.metrics[i].name, name) == 0) {
+            return metrics.metrics[i].type == type ? (i64) i : -1;
+        }
+    }
+
+    Metric metric = {};
+    snprintf(metric.name, sizeof(metric.name), "%s", name);
+    snprintf(metric.help, sizeof(metric.help), "%s", help);
+    metric.type = type;
+    metrics.metrics.push(halloc, metric);
+    return metrics.metrics.size() - 1;
 }
 
-int lua_randi(lua_State *L) {
-    lua_pushinteger(L, rng::randi());
-    return 1;
+void set_histogram_bounds(u32 id, const double *bounds, u64 count) {
+    Metric &metric = metrics.metrics[id];
+    metric.bounds.resize(halloc, count);
+    metric.buckets.resize(halloc, count);
+    for (u64 i = 0; i < count; ++i) {
+        metric.bounds[i] = bounds[i];
+        metric.buckets[i] = 0;
+    }
 }
 
-int lua_randb(lua_State *L) {
-    lua_pushboolean(L, rng::randb());
-    return 1;
+void observe_metric(u32 id, double value) {
+    Metric &metric = metrics.metrics[id];
+    for (u64 i = 0; i < metric.bounds.size(); ++i) {
+        if (value <= metric.bounds[i]) metric.buckets[i]++;
+    }
+    metric.sum += value;
+    metric.count++;
 }
 
-int lua_alloc_id(lua_State *L) {
-    lua_pushinteger(L, alloc_id().id);
-    return 1;
+void append_text(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char line[256];
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0) return;
+    if (length >= (int) sizeof(line)) length = sizeof(line) - 1;
+
+    u64 offset = metrics.text.size();
+    metrics.text.resize(halloc, offset + length);
+    memcpy(&metrics.text[offset], line, length);
 }
 
-int lua_physics_get(lua_State *L) {
-    ID id;
-    id.id = luaL_checkinteger(L, 1);
+void format_metrics() {
+    metrics.text.resize(halloc, 0);
 
-    const pp::PhysicsObject *obj = physics.objects.get(id);
+    static const char *type_names[] = {"counter", "gauge", "histogram"};
+    for (const Metric &metric : metrics.metrics) {
+        if (metric.help[0]) append_text("# HELP %s %s\n", metric.name, metric.help);
+        append_text("# TYPE %s %s\n", metric.name, type_names[metric.type]);
 
-    lua_newtable(L);
-    if (obj == nullptr) {
-        push_v2(L, obj->aabb.position); lua_setfield(L, -2, "position");
-        push_v2(L, obj->aabb.size); lua_setfield(L, -2, "size");
-        lua_pushinteger(L, obj->layer); lua_setfield(L, -1, "layer");
-        lua_pushinteger(L, obj->mask); lua_setfield(L, -1, "mask");
-        lua_pushinteger(L, obj->type); lua_setfield(L, -1, "type");
+        if (metric.type != METRIC_HISTOGRAM) {
+            append_text("%s %.17g\n", metric.name, metric.value);
+            continue;
+        }
+
+        for (u64 i = 0; i < metric.bounds.size(); ++i) {
+            append_text("%s_bucket{le=\"%g\"} %llu\n", metric.name, metric.bounds[i], (unsigned long long) metric.buckets[i]);
+        }
+        append_text("%s_bucket{le=\"+Inf\"} %llu\n", metric.name, (unsigned long long) metric.count);
+        append_text("%s_sum %.17g\n", metric.name, metric.sum);
+        append_text("%s_count %llu\n", metric.name, (unsigned long long) metric.count);
     }
+}
 
-    return 1;
+// Live luaL_ref() slots, free slots in the registry hold the next free index instead.
+u64 count_registry_refs(lua_State *L) {
+    u64 refs = 0;
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+        if (lua_isinteger(L, -2) && !lua_isinteger(L, -1)) refs++;
+        lua_pop(L, 1);
+    }
+    return refs;
 }
 
-int lua_physics_move(lua_State *L) {
-    ID id;
-    id.id = luaL_checkinteger(L, 1);
+void write_metrics_file() {
+    // Written next to the target and renamed over it so scrapers never see half a file.
+    char temp[512];
+    int length = snprintf(temp, sizeof(temp), "%s.tmp", metrics.file);
+    if (length < 0 || (u64) length >= sizeof(temp)) {
+        // No later export would fit either.
+        LOG_ERROR("ERROR: metrics_file path '%' is too long, metrics are not written to a file\n", metrics.file);
+        metrics.file = nullptr;
+        return;
+    }
 
-    lua_getfield(L, 2, "x");
-    float x = luaL_checknumber(L, -1);
-    lua_getfield(L, 2, "y");
-    float y = luaL_checknumber(L, -1);
-    lua_pop(L, 2);
+    // Tried again at the next export, the directory may only be missing for now.
+    FILE *file = fopen(temp, "wb");
+    if (!file) {
+        LOG_ERROR("ERROR: could not write metrics to '%'\n", temp);
+        return;
+    }
+    fwrite(metrics.text.size() ? &metrics.text[0] : "", 1, metrics.text.size(), file);
+    fclose(file);
 
-    lua_pushinteger(L, physics.move_actor(id, {x, y}).id);
-    return 1;
+#ifdef _WIN32
+    remove(metrics.file);
+#endif
+    rename(temp, metrics.file);
 }
 
-int lua_physics_create(lua_State *L) {
-    ID id;
-    lua_getfield(L, 1, "id");
-    id.id = luaL_checkinteger(L, -1);
-
-    Vector2 position, size;
-    load_v2(L, position, "position", 1);
-    load_v2(L, size, "size", 1);
+#ifndef _WIN32
+void open_metrics_socket() {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    int length = snprintf(address.sun_path, sizeof(address.sun_path), "%s", metrics.socket_path);
+    if (length < 0 || (u64) length >= sizeof(address.sun_path)) {
+        LOG_ERROR("ERROR: metrics_socket path '%' is too long\n", metrics.socket_path);
+        return;
+    }
 
-    lua_getfield(L, 1, "layer");
-    int layer = luaL_optinteger(L, -1, 1);
+    metrics.socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (metrics.socket < 0) return;
+    unlink(metrics.socket_path);
 
-    lua_getfield(L, 1, "mask");
-    int mask = luaL_optinteger(L, -1, 1);
+    if (bind(metrics.socket, (sockaddr *) &address, sizeof(address)) != 0 || listen(metrics.socket, 8) != 0) {
+        LOG_ERROR("ERROR: could not open the metrics socket '%'", metrics.socket_path);
+        close(metrics.socket);
+        metrics.socket = -1;
+        return;
+    }
+    fcntl(metrics.socket, F_SETFL, fcntl(metrics.socket, F_GETFL) | O_NONBLOCK);
+}
 
-    lua_getfield(L, 1, "type");
-    int type = luaL_optinteger(L, -1, 0);
+// Every client that connected since the last export gets one snapshot, then is closed.
+// Sends never block the frame, a client that can't take the whole snapshot right away
+// is dropped.
+void write_metrics_socket() {
+    for (;;) {
+        int client = accept(metrics.socket, nullptr, nullptr);
+        if (client < 0) break;
+
+        u64 written = 0;
+        while (written < metrics.text.size()) {
+            ssize_t result = send(client, &metrics.text[written], metrics.text.size() - written, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (result <= 0) break;
+            written += result;
+        }
+        close(client);
+    }
+}
+#endif
 
-    physics.objects.insert(id, {{position, size}, (pp::PhysicsObject::Type) type, mask, layer});
+void export_metrics() {
+    lua_State *L = metrics.L;
+    metrics.metrics[metrics.registry_refs].value = count_registry_refs(L);
 
-    return 0;
+    format_metrics();
+    if (metrics.file) write_metrics_file();
+#ifndef _WIN32
+    if (metrics.socket >= 0) write_metrics_socket();
+#endif
 }
 
-int lua_physics_destroy(lua_State *L) {
-    ID id;
-    id.id = luaL_checkinteger(L, 1);
+void update_metrics(Events::PostUpdate &) {
+    lua_State *L = metrics.L;
+    Metric *m = &metrics.metrics[0];
+
+    m[metrics.frames].value += 1;
+    observe_metric(metrics.frame_seconds, Time::delta());
+    m[metrics.lua_heap].value = lua_gc(L, LUA_GCCOUNT, 0) * 1024.0 + lua_gc(L, LUA_GCCOUNTB, 0);
+    m[metrics.gc_cycles_total].value = metrics.gc_cycles;
+    m[metrics.static_arena].value = arena_usage.static_bytes;
+    m[metrics.frame_arena].value = arena_usage.last_frame_bytes;
+    m[metrics.texture_bytes].value = textures.bytes;
+    m[metrics.render_commands].value = last_render_stats.submitted;
+
+    u64 overruns = 0;
+    for (LuaSystem *system : watchdog.systems) overruns += system->overruns;
+    m[metrics.watchdog_overruns].value = overruns;
+
+    metrics.clock += Time::delta();
+    if ((metrics.file || metrics.socket >= 0) && metrics.clock >= metrics.next_export) {
+        metrics.next_export = metrics.clock + metrics.interval;
+        export_metrics();
+    }
+}
 
-    physics.objects.erase(id);
+#define METRICS_GC_META "Lovial.GCSentinel"
 
+// Finalized at the end of every GC cycle and replaced by a new one, counting cycles.
+int lua_gc_sentinel(lua_State *L) {
+    metrics.gc_cycles++;
+    lua_newuserdatauv(L, 0, 0);
+    luaL_setmetatable(L, METRICS_GC_META);
+    lua_pop(L, 1);
     return 0;
 }
 
-int lua_physics_aabb_cast(lua_State *L) {
-    Vector2 position, size;
-    load_v2(L, position, "position", 1);
-    load_v2(L, size, "size", 1);
-
-    lua_getfield(L, 1, "mask");
-    int mask = luaL_checkinteger(L, -1);
-
-    lua_pushinteger(L, physics.aabb_cast({position, size}, mask).id);
-    return 1;
+u32 check_metric(lua_State *L, int arg) {
+    lua_Integer id = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, id >= 0 && (u64) id < metrics.metrics.size(), arg, "not a metric");
+    return id;
 }
 
-int lua_physics_ray_cast(lua_State *L) {
-    Vector2 start, finish;
-    load_v2(L, start, "start", 1);
-    load_v2(L, finish, "finish", 1);
+int create_lua_metric(lua_State *L, int type) {
+    const char *name = luaL_checkstring(L, 1);
+    const char *help = luaL_optstring(L, 2, "");
+    if (!valid_metric_name(name)) {
+        RETURN_ERROR(L, "Metric names must match [a-zA-Z_:][a-zA-Z0-9_:]* and be shorter than 64 characters");
+    }
 
-    lua_getfield(L, 1, "mask");
-    int mask = luaL_checkinteger(L, -1);
+    i64 id = register_metric(name, help, type);
+    if (id < 0) {
+        RETURN_ERROR(L, "A metric with this name but a different type already exists");
+    }
 
-    lua_pushinteger(L, physics.ray_cast(start, finish, mask).id);
+    lua_pushinteger(L, id);
     return 1;
 }
 
-int lua_physics_circle_cast(lua_State *L) {
-    Vector2 center;
-    load_v2(L, center, "center", 1);
+// Metrics.counter(name, [help]) -> id
+int lua_metrics_counter(lua_State *L) {
+    return create_lua_metric(L, METRIC_COUNTER);
+}
 
-    lua_getfield(L, 1, "radius");
-    float radius = luaL_checknumber(L, -1);
+// Metrics.gauge(name, [help]) -> id
+int lua_metrics_gauge(lua_State *L) {
+    return create_lua_metric(L, METRIC_GAUGE);
+}
 
-    lua_getfield(L, 1, "mask");
-    int mask = luaL_checkinteger(L, -1);
+// Metrics.histogram(name, help, {bounds...}) -> id, bounds in ascending order
+int lua_metrics_histogram(lua_State *L) {
+    luaL_checktype(L, 3, LUA_TTABLE);
 
-    lua_pushinteger(L, physics.circle_cast(center, radius, mask).id);
+    u64 count = lua_rawlen(L, 3);
+    double *bounds = (double *) lua_newuserdatauv(L, count * sizeof(double) + 1, 0);
+    for (u64 i = 0; i < count; ++i) {
+        lua_rawgeti(L, 3, i + 1);
+        bounds[i] = luaL_checknumber(L, -1);
+        lua_pop(L, 1);
+        if (i > 0 && bounds[i] <= bounds[i - 1]) {
+            RETURN_ERROR(L, "Histogram bounds must be in ascending order");
+        }
+    }
+
+    create_lua_metric(L, METRIC_HISTOGRAM);
+    u32 id = lua_tointeger(L, -1);
+    // Registering the same histogram again keeps the counts it already has.
+    if (metrics.metrics[id].count == 0) set_histogram_bounds(id, bounds, count);
     return 1;
 }
 
-int lua_physics_debug(lua_State *L) {
-    auto &renderer = WM::get_main_window()->get_renderers()[0];
-    physics.debug_draw(renderer);
+// Metrics.add(id, [amount]) for counters and gauges
+int lua_metrics_add(lua_State *L) {
+    Metric &metric = metrics.metrics[check_metric(L, 1)];
+    double amount = luaL_optnumber(L, 2, 1.0);
+    if (metric.type == METRIC_HISTOGRAM || (metric.type == METRIC_COUNTER && amount < 0)) {
+        RETURN_ERROR(L, "Counters can only go up and histograms take Metrics.observe()");
+    }
+    metric.value += amount;
     return 0;
 }
 
-void bind_physics_to_lua(lua_State *L) {
-    lua_newtable(L);
-    lua_pushcfunction(L, lua_physics_get); lua_setfield(L, -2, "get");
-    lua_pushcfunction(L, lua_physics_move); lua_setfield(L, -2, "move");
-    lua_pushcfunction(L, lua_physics_create); lua_setfield(L, -2, "create");
-    lua_pushcfunction(L, lua_physics_destroy); lua_setfield(L, -2, "destroy");
-    lua_pushcfunction(L, lua_physics_aabb_cast); lua_setfield(L, -2, "aabb_cast");
-    lua_pushcfunction(L, lua_physics_ray_cast); lua_setfield(L, -2, "ray_cast");
-    lua_pushcfunction(L, lua_physics_circle_cast); lua_setfield(L, -2, "circle_cast");
-    lua_pushcfunction(L, lua_physics_debug); lua_setfield(L, -2, "debug");
+// Metrics.set(id, value) for gauges
+int lua_metrics_set(lua_State *L) {
+    Metric &metric = metrics.metrics[check_metric(L, 1)];
+    if (metric.type != METRIC_GAUGE) {
+        RETURN_ERROR(L, "Only gauges can be set");
+    }
+    metric.value = luaL_checknumber(L, 2);
+    return 0;
+}
 
-    lua_pushinteger(L, (int) pp::PhysicsObject::Type::Actor); lua_setfield(L, -2, "Actor");
-    lua_pushinteger(L, (int) pp::PhysicsObject::Type::Solid); lua_setfield(L, -2, "Solid");
+// Metrics.observe(id, value) for histograms
+int lua_metrics_observe(lua_State *L) {
+    u32 id = check_metric(L, 1);
+    if (metrics.metrics[id].type != METRIC_HISTOGRAM) {
+        RETURN_ERROR(L, "Only histograms take observations");
+    }
+    observe_metric(id, luaL_checknumber(L, 2));
+    return 0;
+}
 
-    lua_setglobal(L, "Physics");
+// Metrics.text() -> the current registry in the Prometheus text format
+int lua_metrics_text(lua_State *L) {
+    metrics.metrics[metrics.registry_refs].value = count_registry_refs(L);
+    format_metrics();
+    lua_pushlstring(L, metrics.text.size() ? &metrics.text[0] : "", metrics.text.size());
+    return 1;
 }
 
-void bind_input_to_lua(lua_State *L) {
-    lua_newtable(L);
-    lua_pushcfunction(L, lua_is_pressed); lua_setfield(L, -2, "is_pressed");
-    lua_pushcfunction(L, lua_is_typed); lua_setfield(L, -2, "is_typed");
-    lua_pushcfunction(L, lua_is_just_pressed); lua_setfield(L, -2, "is_just_pressed");
-    lua_pushcfunction(L, lua_is_just_released); lua_setfield(L, -2, "is_just_released");
-    lua_pushcfunction(L, lua_string_typed); lua_setfield(L, -2, "string_typed");
-    lua_pushcfunction(L, lua_get_axis); lua_setfield(L, -2, "get_axis");
-    lua_pushcfunction(L, lua_get_direction); lua_setfield(L, -2, "get_direction");
-    lua_pushcfunction(L, lua_mouse_position); lua_setfield(L, -2, "mouse_position");
-    lua_pushcfunction(L, lua_mouse_delta); lua_setfield(L, -2, "mouse_delta");
-    lua_setglobal(L, "Input");
+// Metrics.export() writes the file and socket now instead of waiting for the interval.
+int lua_metrics_export(lua_State *L) {
+    export_metrics();
+    return 0;
 }
 
-void bind_time_to_lua(lua_State *L) {
+void bind_metrics_to_lua(lua_State *L) {
+    metrics.L = L;
+
+    metrics.frames = register_metric("lovial_frames_total", "Frames run", METRIC_COUNTER);
+    metrics.frame_seconds = register_metric("lovial_frame_seconds", "Frame time", METRIC_HISTOGRAM);
+    static const double frame_bounds[] = {0.004, 0.008, 0.0167, 0.0334, 0.05, 0.1, 0.25, 1.0};
+    set_histogram_bounds(metrics.frame_seconds, frame_bounds, sizeof(frame_bounds) / sizeof(frame_bounds[0]));
+    metrics.lua_heap = register_metric("lovial_lua_heap_bytes", "Memory used by the main Lua state", METRIC_GAUGE);
+    metrics.gc_cycles_total = register_metric("lovial_lua_gc_cycles_total", "Completed Lua GC cycles", METRIC_COUNTER);
+    metrics.static_arena = register_metric("lovial_static_arena_bytes", "Bytes Lovial allocated in static_arena", METRIC_GAUGE);
+    metrics.frame_arena = register_metric("lovial_frame_arena_bytes", "Bytes Lovial allocated in frame_arena last frame", METRIC_GAUGE);
+    metrics.registry_refs = register_metric("lovial_registry_refs", "Live luaL_ref references", METRIC_GAUGE);
+    metrics.texture_bytes = register_metric("lovial_texture_bytes", "Estimated RGBA size of loaded textures", METRIC_GAUGE);
+    metrics.render_commands = register_metric("lovial_render_commands", "Commands submitted last frame", METRIC_GAUGE);
+    metrics.watchdog_overruns = register_metric("lovial_watchdog_overruns_total", "Lua system calls stopped by the watchdog", METRIC_COUNTER);
+
+    luaL_newmetatable(L, METRICS_GC_META);
+    lua_pushcfunction(L, lua_gc_sentinel); lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    lua_newuserdatauv(L, 0, 0);
+    luaL_setmetatable(L, METRICS_GC_META);
+    lua_pop(L, 1);
+
+#ifndef _WIN32
+    if (metrics.socket_path) open_metrics_socket();
+#endif
+
     lua_newtable(L);
-    lua_pushcfunction(L, lua_delta); lua_setfield(L, -2, "delta");
-    lua_setglobal(L, "Time");
+    lua_pushcfunction(L, lua_metrics_counter); lua_setfield(L, -2, "counter");
+    lua_pushcfunction(L, lua_metrics_gauge); lua_setfield(L, -2, "gauge");
+    lua_pushcfunction(L, lua_metrics_histogram); lua_setfield(L, -2, "histogram");
+    lua_pushcfunction(L, lua_metrics_add); lua_setfield(L, -2, "add");
+    lua_pushcfunction(L, lua_metrics_set); lua_setfield(L, -2, "set");
+    lua_pushcfunction(L, lua_metrics_observe); lua_setfield(L, -2, "observe");
+    lua_pushcfunction(L, lua_metrics_text); lua_setfield(L, -2, "text");
+    lua_pushcfunction(L, lua_metrics_export); lua_setfield(L, -2, "export");
+    lua_setglobal(L, "Metrics");
 }
 
 lua_State *init(int argc, char **argv) {
@@ -903,6 +7759,10 @@ lua_State *init(int argc, char **argv) {
     bind_function(L, "draw_line", lua_draw_line);
     bind_function(L, "draw_text", lua_draw_text);
     bind_function(L, "draw_sprite", lua_draw_sprite);
+    bind_function(L, "draw_rect", lua_draw_rect);
+    bind_function(L, "draw_sprite_at", lua_draw_sprite_at);
+    bind_function(L, "draw_line_xy", lua_draw_line_xy);
+    bind_function(L, "rgba", lua_rgba);
     bind_function(L, "load_texture", lua_load_texture);
     bind_function(L, "load_shader", lua_load_shader);
     bind_function(L, "include", lua_include);
@@ -929,10 +7789,27 @@ lua_State *init(int argc, char **argv) {
     bind_function(L, "rect2_has_point", lua_rect2_has_point);
 
     bind_event_ids_to_lua(L);
+    bind_profiler_to_lua(L);
     bind_input_actions_to_lua(L);
     bind_input_to_lua(L);
     bind_time_to_lua(L);
+    bind_render_to_lua(L);
     bind_physics_to_lua(L);
+    bind_jobs_to_lua(L);
+    bind_rng_to_lua(L);
+    bind_events_to_lua(L);
+    bind_actors_to_lua(L);
+    bind_scheduler_to_lua(L);
+    bind_deferred_work_to_lua(L);
+    bind_timers_to_lua(L);
+    bind_fs_to_lua(L);
+    bind_tweens_to_lua(L);
+    bind_particles_to_lua(L);
+    bind_ecs_to_lua(L);
+    bind_tilemaps_to_lua(L);
+    bind_animators_to_lua(L);
+    bind_display_lists_to_lua(L);
+    bind_metrics_to_lua(L);
 
     rng::set_seed();
 
@@ -1022,12 +7899,94 @@ bool load_config(int argc, char **argv, WindowProps &window_props) {
     }
     lua_pop(L, 1);
 
+    lua_getfield(L, -1, "fixed_tick_rate");
+    if (lua_isnumber(L, -1) && lua_tonumber(L, -1) > 0) {
+        fixed_step.enabled = true;
+        fixed_step.step = 1.0 / lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "max_fixed_steps");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0) {
+        fixed_step.max_steps = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "job_workers");
+    if (lua_isinteger(L, -1)) {
+        jobs.worker_count = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "metrics_file");
+    if (lua_isstring(L, -1)) {
+        metrics.file = StrView(lua_tostring(L, -1)).cstr(static_arena);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "metrics_socket");
+    if (lua_isstring(L, -1)) {
+        metrics.socket_path = StrView(lua_tostring(L, -1)).cstr(static_arena);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "metrics_interval");
+    if (lua_isnumber(L, -1) && lua_tonumber(L, -1) > 0) {
+        metrics.interval = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "system_time_budget_ms");
+    if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0) {
+        watchdog.time_budget_ms = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "system_instruction_budget");
+    if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0) {
+        watchdog.instruction_budget = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "system_overrun_policy");
+    if (lua_isstring(L, -1)) {
+        watchdog.policy = strcmp(lua_tostring(L, -1), "disable") == 0 ? WATCHDOG_DISABLE : WATCHDOG_ABORT;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "idle_budget_ms");
+    if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0) {
+        deferred.budget_ms = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "pipelined_rendering");
+    pipeline.enabled = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "render_stats_overlay");
+    render_overlay = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
     lua_close(L);
     return true;
 }
 
+void init_view_rect(const WindowProps &props) {
+    view_rect.position = {0.0f, 0.0f};
+    // The content scale size only says what the game draws in when scaling is turned on.
+    if (props.content_scale_mode == CONTENT_SCALE_MODE_VIEWPORT && props.content_scale_size.x > 0 && props.content_scale_size.y > 0) {
+        view_rect.size = {(float) props.content_scale_size.x, (float) props.content_scale_size.y};
+        view_follows_window = false;
+    } else {
+        view_rect.size = {(float) props.size.x, (float) props.size.y};
+    }
+}
+
 void clear_frame_arena(Events::PreUpdate &) {
     frame_arena.reset();
+    arena_usage.last_frame_bytes = arena_usage.frame_bytes;
+    arena_usage.frame_bytes = 0;
 }
 
 #ifdef _WIN32
@@ -1047,8 +8006,27 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     if (!argv) return -1;
 
     load_config(argc, (char **) argv, props);
+    init_view_rect(props);
+    jobs.start();
     systems2d(game, props);
     game.push_system(clear_frame_arena);
+    game.push_system(begin_render_frame);
+    game.push_system(poll_input_events);
+    game.push_system(flush_coalesced_events);
+    game.push_system(run_fixed_update);
+    game.push_system(run_scheduler);
+    game.push_system(run_timers);
+    game.push_system(deliver_io_completions);
+    game.push_system(run_tweens);
+    game.push_system(update_particles);
+    game.push_system(step_animators);
+    game.push_system(run_ecs_systems);
+    game.push_system(deliver_events);
+    game.push_system(kick_actors);
+    game.push_system(sync_actors);
+    game.push_system(finish_pipelined_frame);
+    game.push_system(run_deferred_work);
+    game.push_system(update_metrics);
     load_jovial_font(&default_font);
 
     lua_State* L = init(argc, (char**) argv);
@@ -1075,8 +8053,27 @@ int main(int argc, char **argv) {
             .bg    = Colors::GRUVBOX_GREY,
     };
     load_config(argc, argv, props);
+    init_view_rect(props);
+    jobs.start();
     systems2d(game, props);
     game.push_system(clear_frame_arena);
+    game.push_system(begin_render_frame);
+    game.push_system(poll_input_events);
+    game.push_system(flush_coalesced_events);
+    game.push_system(run_fixed_update);
+    game.push_system(run_scheduler);
+    game.push_system(run_timers);
+    game.push_system(deliver_io_completions);
+    game.push_system(run_tweens);
+    game.push_system(update_particles);
+    game.push_system(step_animators);
+    game.push_system(run_ecs_systems);
+    game.push_system(deliver_events);
+    game.push_system(kick_actors);
+    game.push_system(sync_actors);
+    game.push_system(finish_pipelined_frame);
+    game.push_system(run_deferred_work);
+    game.push_system(update_metrics);
     load_jovial_font(&default_font);
 
     lua_State *L = init(argc, argv);
@@ -0,0 +1,31 @@
+-- Replays a frame capture without any game scripts and reports how long submitting it
+-- takes. Captures come from Render.capture(path) in the game, for example bound to a key:
+--
+--     if Input.is_just_pressed(...) then Render.capture("frame.lvcap") end
+--
+-- Run this file as the program with LOVIAL_CAPTURE pointing at the capture. The
+-- capture is submitted LOVIAL_REPLAY_TIMES times per frame for LOVIAL_REPLAY_FRAMES
+-- frames, then the averages are printed and the engine exits.
+
+local path = os.getenv("LOVIAL_CAPTURE") or "frame.lvcap"
+local times = tonumber(os.getenv("LOVIAL_REPLAY_TIMES")) or 10
+local frames = tonumber(os.getenv("LOVIAL_REPLAY_FRAMES")) or 120
+
+local frame = 0
+local total = 0
+local commands = 0
+
+function ReplayDraw()
+    local seconds, count = Render.replay(path, times)
+    total = total + seconds
+    commands = count
+    frame = frame + 1
+
+    if frame == frames then
+        local per_replay = total / (frames * times)
+        print(string.format("%s: %d commands, %.3f ms per replay, %.1f ns per command",
+            path, commands, per_replay * 1000, commands > 0 and per_replay * 1e9 / commands or 0))
+        os.exit(0)
+    end
+end
+push_system(EventIDs.Draw, ReplayDraw)
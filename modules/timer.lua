@@ -1,3 +1,5 @@
+-- Timers ticked by the caller. Timers.after / Timers.every run natively without a TickTimer call.
+
 function CreateTimer(length, on_finish)
     return {
         length = length,
@@ -9,7 +11,7 @@ end
 function TickTimer(timer)
     timer.time_left = timer.time_left - Time.delta()
     if timer.time_left <= 0 then
-        if timer.on_finish != nil then
+        if timer.on_finish ~= nil then
             timer.on_finish(timer)
         end
         return true